@@ -58,12 +58,14 @@
         <a href="/" class="prev-button"><b>&#8249;</b></a>
         <b>Sonos Configuration</b>
     </font><br/>
+    %InputLinks%
     <hr/>
     <p>
         <b>Selected Zone:</b> %ZoneName%
     </p>
     <p>
         <form name="wifiform" action="zoneselect.cgi" method="post">
+        <input type="hidden" name="input" value="%Input%"/>
         Discovered Zones:<br/>
         <div id="zones"><i>Discovering...</i></div><br/>
         <input type="submit" name="select" value="Select Zone"/>
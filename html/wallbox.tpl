@@ -30,21 +30,62 @@
         return letterString[index + 10];
     }
 
+    function letterIndex(code) {
+        return "ABCDEFGHJKLMNPQRSTUV".indexOf(code.charAt(0));
+    }
+
+    function addSongCells(row, code, letters) {
+        var td = document.createElement("td");
+        var index = letterIndex(code);
+        if (code.length < 2 || index < 0 || index >= letters) {
+            // Letter not used by this wallbox
+            td.colSpan = 2;
+            row.appendChild(td);
+            return;
+        }
+
+        td.innerHTML = code;
+        td.style.textAlign = "center";
+        td.style.color = "white";
+        td.style.backgroundColor = "#e33c72";
+        row.appendChild(td);
+
+        td = document.createElement("td");
+        td.style.backgroundColor = "#b1d7ae";
+
+        var input = document.createElement("input");
+        input.type = "text";
+        input.name = "song-" + code;
+        input.size = 15;
+        input.maxlength = 15;
+        if (currSelections.hasOwnProperty(code)) {
+            input.value = currSelections[code];
+        }
+        input.addEventListener('change', function(evt) {
+            if (evt.target.name.indexOf("song-") == 0) {
+                var code = evt.target.name.substring(5);
+                currSelections[code] = evt.target.value;
+            }
+        });
+        td.appendChild(input);
+
+        row.appendChild(td);
+    }
+
     function buildSongSheet() {
         var x = document.getElementById("song_sheet");
         x.innerHTML = "";
 
         var pages = 0;
         var pageLayout = 0;
+        var letters = 20;
 
         var w = document.getElementById("wallbox_type");
-        var wallboxType = w.options[w.selectedIndex].value;
-        if (wallboxType == "SEEBURG_3W1_100") {
-            pages = 5;
-            pageLayout = 1;
-        } else if(wallboxType == "SEEBURG_V3WA_200") {
-            pages = 10;
-            pageLayout = 2;
+        var wallboxOption = w.options[w.selectedIndex];
+        if (wallboxOption.hasAttribute("data-pages")) {
+            pages = parseInt(wallboxOption.getAttribute("data-pages"));
+            pageLayout = parseInt(wallboxOption.getAttribute("data-layout"));
+            letters = parseInt(wallboxOption.getAttribute("data-letters"));
         }
 
         if (pages == 0 || pageLayout == 0) {
@@ -85,67 +126,13 @@
                 
                 row = body.insertRow(-1);
 
-                var code = letter + number;
-                var td = document.createElement("td");
-                td.innerHTML = code;
-                td.style.textAlign = "center";
-                td.style.color = "white";
-                td.style.backgroundColor = "#e33c72";
-                row.appendChild(td);
-
-                td = document.createElement("td");
-                td.style.backgroundColor = "#b1d7ae";
-
-                var input = document.createElement("input");
-                input.type = "text";
-                input.name = "song-" + code;
-                input.size = 15;
-                input.maxlength = 15;
-                if (currSelections.hasOwnProperty(code)) {
-                    input.value = currSelections[code];
-                }
-                input.addEventListener('change', function(evt) {
-                    if (evt.target.name.indexOf("song-") == 0) {
-                        var code = evt.target.name.substring(5);
-                        currSelections[code] = evt.target.value;
-                    }
-                });
-                td.appendChild(input);
-
-                row.appendChild(td);
+                addSongCells(row, letter + number, letters);
 
                 if (pageLayout == 1) {
-                    code = nextLetter(letter) + number;
+                    addSongCells(row, nextLetter(letter) + number, letters);
                 } else if (pageLayout == 2) {
-                    code = nextColumnLetter(letter) + number;
-                }
-                td = document.createElement("td");
-                td.innerHTML = code;
-                td.style.textAlign = "center";
-                td.style.color = "white";
-                td.style.backgroundColor = "#e33c72";
-                row.appendChild(td);
-
-                td = document.createElement("td");
-                td.style.backgroundColor = "#b1d7ae";
-
-                input = document.createElement("input");
-                input.type = "text";
-                input.name = "song-" + code;
-                input.size = 15;
-                input.maxlength = 15;
-                if (currSelections.hasOwnProperty(code)) {
-                    input.value = currSelections[code];
+                    addSongCells(row, nextColumnLetter(letter) + number, letters);
                 }
-                input.addEventListener('change', function(evt) {
-                    if (evt.target.name.indexOf("song-") == 0) {
-                        var code = evt.target.name.substring(5);
-                        currSelections[code] = evt.target.value;
-                    }
-                });
-                td.appendChild(input);
-
-                row.appendChild(td);
                 if (pageLayout == 2) {
                     letter = nextLetter(letter);
                 }
@@ -186,7 +173,7 @@
         currSelections = {};
     }
     function fetchConfiguredSongs() {
-        xhr.open("GET", "songlist.cgi");
+        xhr.open("GET", "songlist.cgi?input=%Input%");
         xhr.onreadystatechange=function() {
             if (xhr.readyState==4 && xhr.status>=200 && xhr.status<300) {
                 var data=JSON.parse(xhr.responseText);
@@ -209,15 +196,30 @@
         <a href="/" class="prev-button"><b>&#8249;</b></a>
         <b>Wallbox Configuration</b>
     </font><br/>
+    %InputLinks%
     <hr/>
     <form name="songform" action="songselect.cgi" method="post">
+    <input type="hidden" name="input" value="%Input%"/>
     <p>
         <b>Wallbox type:</b><br/>
         <select id="wallbox_type" name="wallbox" onchange="buildSongSheet()">
-            <option value="UNKNOWN_WALLBOX" selected>Unknown</option>
-            <option value="SEEBURG_3W1_100">Seeburg Wall-O-Matic 3W-1 &quot;100&quot;</option>
-            <option value="SEEBURG_V3WA_200">Seeburg Wall-O-Matic V-3WA &quot;200&quot;</option>
-        </select>
+            <option value="UNKNOWN_WALLBOX" selected>Auto-detect</option>
+            %WallboxOptions%
+        </select><br/>
+        <input id="detect_save" type="checkbox" name="wallbox-detect-save" value="1" %WallboxDetectSave%/>
+        <label for="detect_save">Save the type once detected</label>
+    </p>
+    <p>
+        <b>Noise filter:</b><br/>
+        Reject pulses shorter than
+        <input id="min_pulse" type="number" name="min-pulse" min="0" max="50" value="%WallboxMinPulse%"/> ms
+        (0 for the default)
+    </p>
+    <p>
+        <b>Coin mechanism:</b><br/>
+        Wait
+        <input id="credit_gap" type="number" name="credit-gap" min="0" max="1000" value="%CreditGap%"/> ms
+        between queued coins (0 for the default)
     </p>
     <p>
         <div id="base_path">
@@ -10,18 +10,55 @@ typedef enum wallbox_type {
     MAX_WALLBOX_TYPES
 } wallbox_type;
 
+/* Number of wallbox selection inputs the board can decode */
+#define WB_INPUTS 2
+
+/*
+ * Running statistics of the selection signal timing, learned from
+ * successfully decoded selections. All times are in microseconds.
+ */
+typedef struct wb_calibration {
+    uint8 wallbox_type;          // wallbox the statistics were learned from
+    uint8 reserved;
+    uint16 samples;              // number of selections learned from
+    uint32 pulse_mean;           // longest counted pulse per selection
+    uint32 pulse_dev;
+    uint32 gap_min_mean;         // shortest gap within a pulse train
+    uint32 gap_min_dev;
+    uint32 gap_max_mean;         // longest gap within a pulse train
+    uint32 gap_max_dev;
+    uint32 delimiter_gap_mean;   // gap between the pulse trains
+    uint32 delimiter_gap_dev;
+    uint32 delimiter_pulse_mean; // uncounted pulse between the pulse trains
+    uint32 delimiter_pulse_dev;
+} wb_calibration;
+
 void user_config_init(void);
+int user_config_get_input_count(void);
+void user_config_save(void);
+
+void user_config_set_wallbox_type(int input, wallbox_type wallbox);
+wallbox_type user_config_get_wallbox_type(int input);
+
+void user_config_set_wallbox_detect_save(bool save);
+bool user_config_get_wallbox_detect_save();
+
+void user_config_set_wallbox_min_pulse(uint8 min_pulse);
+uint8 user_config_get_wallbox_min_pulse();
+
+void user_config_set_credit_gap(uint16 credit_gap);
+uint16 user_config_get_credit_gap();
 
-void user_config_set_wallbox_type(wallbox_type wallbox);
-wallbox_type user_config_get_wallbox_type();
+void user_config_set_wb_calibration(int input, const wb_calibration *calibration);
+bool user_config_get_wb_calibration(int input, wb_calibration *calibration);
 
-void user_config_set_sonos_uuid(const char *uuid);
-const char* user_config_get_sonos_uuid();
+void user_config_set_sonos_uuid(int input, const char *uuid);
+const char* user_config_get_sonos_uuid(int input);
 
 void user_config_set_sonos_uri_base(const char *uri_base);
 const char* user_config_get_sonos_uri_base();
 
-void user_config_set_sonos_track_files(char (*track_file)[200][16]);
-const char* user_config_get_sonos_track_file(int index);
+void user_config_set_sonos_track_files(int input, char (*track_file)[200][16]);
+const char* user_config_get_sonos_track_file(int input, int index);
 
 #endif /* USER_CONFIG_H */
\ No newline at end of file
@@ -0,0 +1,29 @@
+#ifndef USER_HW_TIMER_H
+#define USER_HW_TIMER_H
+
+#include <os_type.h>
+
+#include "user_config.h"
+
+/*
+ * One-shot timers multiplexed onto the FRC1 hardware timer.
+ *
+ * These fire with microsecond precision, unlike os_timer, but the
+ * callback runs in interrupt context. It must be in IRAM, and should
+ * do no more than post a task.
+ */
+
+typedef enum user_hw_timer_slot {
+    HW_TIMER_SELECTION = 0, // one slot per wallbox input
+    HW_TIMER_CREDIT = HW_TIMER_SELECTION + WB_INPUTS,
+    HW_TIMER_SLOTS
+} user_hw_timer_slot;
+
+typedef void (*user_hw_timer_func_t)(void *arg);
+
+void user_hw_timer_init(void);
+void user_hw_timer_arm(user_hw_timer_slot slot, uint32 us, user_hw_timer_func_t func, void *arg);
+void user_hw_timer_arm_at(user_hw_timer_slot slot, uint32 deadline, user_hw_timer_func_t func, void *arg);
+void user_hw_timer_disarm(user_hw_timer_slot slot);
+
+#endif /* USER_HW_TIMER_H */
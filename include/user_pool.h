@@ -0,0 +1,54 @@
+#ifndef USER_POOL_H
+#define USER_POOL_H
+
+#include <os_type.h>
+
+/*
+ * Fixed-size object pools for network connections.
+ *
+ * Every pool takes its blocks from the heap once, when it is created,
+ * and hands them out and takes them back without going to the heap
+ * again. Connections coming and going for weeks on end then leave the
+ * heap as it was, instead of breaking it up until a larger allocation
+ * fails.
+ *
+ * A pool that runs out says so, and its allocation returns NULL for
+ * the caller to handle, as does a buffer larger than those of the pool.
+ */
+
+/*
+ * Blocks of the pools shared by all the network modules. The buffers
+ * hold the Sonos requests, one for each request that can be pending.
+ */
+#define USER_POOL_ESPCONN_COUNT 4
+#define USER_POOL_BUFFER_COUNT  7
+
+/*
+ * Size of the I/O buffers, in bytes. The largest request is one to
+ * enqueue a track with a URI of the longest the client builds, which
+ * comes to 1296 bytes.
+ */
+#define USER_POOL_BUFFER_SIZE 1312
+
+typedef enum user_pool_id {
+    POOL_ESPCONN = 0,       // struct espconn
+    POOL_TCP,               // esp_tcp
+    POOL_BUFFER,            // I/O buffers
+    POOL_SONOS_REQUEST,
+    POOL_SONOS_CONN,
+    POOL_SONOS_NOTIFICATION,
+    MAX_POOLS
+} user_pool_id;
+
+void user_pool_init(void);
+
+bool user_pool_create(user_pool_id id, const char *name, uint16 size, uint16 count);
+void *user_pool_alloc(user_pool_id id);
+void user_pool_free(user_pool_id id, void *block);
+
+void *user_pool_buffer_alloc(int size);
+void user_pool_buffer_free(void *buf);
+
+int user_pool_json(char *buf, int buf_len);
+
+#endif /* USER_POOL_H */
@@ -11,8 +11,9 @@ typedef struct sonos_device {
 } sonos_device;
 
 void user_sonos_client_init(void);
-bool user_sonos_client_set_device(const char *uuid);
-bool user_sonos_client_get_device(sonos_device *device_info);
-void user_sonos_client_enqueue(char letter, int number);
+bool user_sonos_client_set_device(int input, const char *uuid);
+bool user_sonos_client_get_device(int input, sonos_device *device_info);
+void user_sonos_client_enqueue(int input, char letter, int number);
+int user_sonos_client_paths_json(char *buf, int buf_len);
 
 #endif /* USER_SONOS_CLIENT_H */
\ No newline at end of file
@@ -10,11 +10,16 @@ typedef enum transport_state_t {
     PAUSED_PLAYBACK
 } transport_state_t;
 
+/*
+ * State from a change event. Only what changed is sent, so anything
+ * else is left as UNKNOWN, -1 or empty.
+ */
 typedef struct sonos_notify_info {
     char subscribe_id[64];
     transport_state_t transport_state;
     int number_of_tracks;
     int current_track;
+    char transport_uri[96];
 } sonos_notify_info;
 
 typedef void (* user_sonos_listener_callback_t)(
@@ -26,5 +31,6 @@ void user_sonos_listener_init(void);
 void user_sonos_listener_set_callback(user_sonos_listener_callback_t callback, void *user_data);
 
 void user_sonos_listener_subscribe(const sonos_device *device);
+bool user_sonos_listener_subscribed(const char *uuid);
 
 #endif /* USER_SONOS_LISTENER_H */
\ No newline at end of file
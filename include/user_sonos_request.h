@@ -16,11 +16,21 @@ typedef struct sonos_position_info {
     int rel_time;
 } sonos_position_info;
 
+typedef struct sonos_transport_info {
+    char state[24];   // PLAYING, PAUSED_PLAYBACK, STOPPED or TRANSITIONING
+    char status[24];
+    char speed[8];
+} sonos_transport_info;
+
 typedef struct sonos_subscribe_info {
     char subscribe_id[64];
     int timeout_secs;
 } sonos_subscribe_info;
 
+typedef struct sonos_zone_info {
+    char zone_name[128];
+} sonos_zone_info;
+
 typedef void (* user_sonos_request_callback_t)(
     void *user_data, bool success);
 typedef void (* user_sonos_request_add_uri_callback_t)(
@@ -29,9 +39,15 @@ typedef void (* user_sonos_request_add_uri_callback_t)(
 typedef void (* user_sonos_request_position_callback_t)(
     const sonos_position_info *info,
     void *user_data, bool success);
+typedef void (* user_sonos_request_transport_callback_t)(
+    const sonos_transport_info *info,
+    void *user_data, bool success);
 typedef void (* user_sonos_request_subscribe_callback_t)(
     const sonos_subscribe_info *info,
     void *user_data, bool success);
+typedef void (* user_sonos_request_zone_callback_t)(
+    const sonos_zone_info *info,
+    void *user_data, bool success);
 
 void user_sonos_request_init(void);
 
@@ -47,9 +63,25 @@ bool user_sonos_request_seek_track(const sonos_device *device, int track,
 bool user_sonos_request_play(const sonos_device *device,
     user_sonos_request_callback_t callback, void *user_data);
 
+bool user_sonos_request_pause(const sonos_device *device,
+    user_sonos_request_callback_t callback, void *user_data);
+
+bool user_sonos_request_next(const sonos_device *device,
+    user_sonos_request_callback_t callback, void *user_data);
+
+bool user_sonos_request_remove_track_range(const sonos_device *device,
+    uint32 update_id, int start, int count,
+    user_sonos_request_callback_t callback, void *user_data);
+
 bool user_sonos_request_get_position_info(const sonos_device *device,
     user_sonos_request_position_callback_t callback, void *user_data);
 
+bool user_sonos_request_get_transport_info(const sonos_device *device,
+    user_sonos_request_transport_callback_t callback, void *user_data);
+
+bool user_sonos_request_set_volume(const sonos_device *device, int volume,
+    user_sonos_request_callback_t callback, void *user_data);
+
 bool user_sonos_request_subscribe(const sonos_device *device,
     uint8 listener_ip[4], int listener_port, int timeout_secs,
     user_sonos_request_subscribe_callback_t callback, void *user_data);
@@ -58,4 +90,12 @@ bool user_sonos_request_resubscribe(const sonos_device *device,
     const char *subscribe_id, int timeout_secs,
     user_sonos_request_subscribe_callback_t callback, void *user_data);
 
+bool user_sonos_request_get_zone_info(const sonos_device *device,
+    user_sonos_request_zone_callback_t callback, void *user_data);
+
+void user_sonos_request_cancel(void *user_data);
+
+void user_sonos_request_stats_reset(void);
+int user_sonos_request_stats_json(int part, char *buf, int buf_len);
+
 #endif /* USER_SONOS_REQUEST_H */
\ No newline at end of file
@@ -0,0 +1,117 @@
+#ifndef USER_SONOS_RESPONSE_H
+#define USER_SONOS_RESPONSE_H
+
+#include <os_type.h>
+
+/*
+ * Streaming parser for the HTTP responses to Sonos requests.
+ *
+ * Takes the response in whatever chunks it arrives in, and picks out
+ * the status code, the framing headers, and a given set of header
+ * values and SOAP body elements as it goes. Only the element being
+ * read is held, so responses of any size are parsed in a single pass
+ * with a small fixed amount of state.
+ *
+ * The body is framed by its Content-Length or by chunked transfer
+ * encoding, so the response is done as soon as its last byte is read,
+ * and the connection is left ready for the next request. A body with
+ * neither runs until the connection closes, or until the end of its
+ * SOAP envelope.
+ *
+ * Values are written into a result structure given by the caller, at
+ * the offsets listed in the field definitions. Text that does not fit
+ * in its field is cut short.
+ *
+ * Requests, such as event notifications, are parsed the same way,
+ * with their request line kept in place of the status code. Event
+ * bodies carry their state as markup escaped within the LastChange
+ * element, which is parsed as markup when unescaping is turned on.
+ */
+
+/* Longest status or header line that is parsed */
+#define SONOS_RESPONSE_LINE_MAX 96
+
+/* Longest element name that is matched */
+#define SONOS_RESPONSE_TAG_MAX 32
+
+/* Longest number or time value that is parsed */
+#define SONOS_RESPONSE_TEXT_MAX 24
+
+/* Longest character entity that is decoded, such as "&quot;" */
+#define SONOS_RESPONSE_ENTITY_MAX 8
+
+typedef enum sonos_response_source {
+    RESPONSE_START = 0,  // request or status line, named ""
+    RESPONSE_HEADER,     // header line, named with its colon
+    RESPONSE_ELEMENT,    // element of the body
+    RESPONSE_VALUE       // val attribute of an element of the body
+} sonos_response_source;
+
+typedef enum sonos_response_type {
+    RESPONSE_TEXT = 0,   // char array of the field size
+    RESPONSE_INT,        // int, left unchanged unless 0..INT_MAX
+    RESPONSE_TIME,       // int, seconds from H:MM:SS
+    RESPONSE_SECONDS     // int, seconds from "Second-N"
+} sonos_response_type;
+
+typedef struct sonos_response_field {
+    const char *name;
+    sonos_response_source source;
+    sonos_response_type type;
+    uint32 offset;       // of the value within the result
+    uint32 size;         // of the text value
+} sonos_response_field;
+
+typedef enum sonos_response_state {
+    RESPONSE_STATUS = 0,
+    RESPONSE_HEADERS,
+    RESPONSE_BODY,
+    RESPONSE_CHUNK_SIZE,
+    RESPONSE_CHUNK_DATA,
+    RESPONSE_CHUNK_END,  // line break after the chunk data
+    RESPONSE_TRAILER,
+    RESPONSE_DONE
+} sonos_response_state;
+
+typedef struct sonos_response {
+    sonos_response_state state;
+    int code;
+    int content_length;  // -1 if not given
+    bool chunked;
+    bool keep_alive;
+    bool truncated;      // the connection closed partway through the body
+    bool unescape;       // markup escaped as text is parsed as markup
+    uint32 body_len;
+    uint32 chunk_left;
+
+    const sonos_response_field *fields;
+    int field_count;
+    void *result;
+
+    char line[SONOS_RESPONSE_LINE_MAX];
+    int line_len;
+    bool line_overflow;
+
+    bool in_tag;
+    bool tag_named;      // the name has ended, skipping attributes
+    char tag[SONOS_RESPONSE_TAG_MAX];
+    int tag_len;
+    char tag_last;
+    const sonos_response_field *value_field; // element whose val attribute is wanted
+    int value_match;     // characters matched of the attribute name
+
+    char entity[SONOS_RESPONSE_ENTITY_MAX];
+    int entity_len;      // 0 unless partway through an entity
+
+    const sonos_response_field *capture;
+    char text[SONOS_RESPONSE_TEXT_MAX];
+    int text_len;
+} sonos_response;
+
+void sonos_response_init(sonos_response *response,
+    const sonos_response_field *fields, int field_count, void *result);
+
+int sonos_response_feed(sonos_response *response, const char *data, int len);
+void sonos_response_finish(sonos_response *response);
+
+#endif /* USER_SONOS_RESPONSE_H */
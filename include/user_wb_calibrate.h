@@ -0,0 +1,25 @@
+#ifndef USER_WB_CALIBRATE_H
+#define USER_WB_CALIBRATE_H
+
+#include "user_wb_protocol.h"
+
+/*
+ * Timing observed over the course of a single selection.
+ * All times are in microseconds, and zero if not observed.
+ */
+typedef struct wb_train_timing {
+    uint32 pulse_max;       // longest counted pulse
+    uint32 gap_min;         // shortest gap within a pulse train
+    uint32 gap_max;         // longest gap within a pulse train
+    uint32 delimiter_gap;   // gap between the pulse trains
+    uint32 delimiter_pulse; // uncounted pulse between the pulse trains
+} wb_train_timing;
+
+void user_wb_calibrate_init(void);
+void user_wb_calibrate_get_timing(int input, wallbox_type wb_type, wb_timing *timing);
+
+void user_wb_calibrate_train_pulse(wb_train_timing *train, const wb_selection_pulse *pulse,
+    const wb_selection_tally *before, const wb_selection_tally *after);
+void user_wb_calibrate_train_commit(int input, wallbox_type wb_type, const wb_train_timing *train);
+
+#endif /* USER_WB_CALIBRATE_H */
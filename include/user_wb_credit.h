@@ -1,6 +1,8 @@
 #ifndef USER_WB_CREDIT_H
 #define USER_WB_CREDIT_H
 
+#include <os_type.h>
+
 /* Definition of coin pulse durations */
 #define COIN_NICKEL_PULSE_MS  50
 #define COIN_DIME_PULSE_MS    40
@@ -19,14 +21,56 @@
 #define COIN_QUARTER_IO_NUM  14
 #define COIN_QUARTER_IO_FUNC FUNC_GPIO14
 
+/* Default gap between queued coin pulses, in milliseconds */
+#define COIN_PULSE_GAP_MS 100
+
+/* Limits on the coin pulse queue */
+#define CREDIT_MAX_REQUESTS 8  // requests queued, or remembered once done
+#define CREDIT_MAX_COUNT    20 // coins in one request
+#define CREDIT_MAX_PENDING  40 // coins queued across all requests
+
+/* Coin pulses whose measured widths are kept */
+#define CREDIT_PULSE_LOG 16
+
+/* Measured pulse width error worth logging, in microseconds */
+#define CREDIT_PULSE_TOLERANCE_US 1000
+
 typedef enum CoinType {
     NICKEL = 0,
     DIME,
     QUARTER
 } CoinType;
 
+typedef enum wb_credit_state {
+    CREDIT_UNKNOWN = 0, // no such request, or forgotten
+    CREDIT_QUEUED,      // waiting for earlier requests
+    CREDIT_ACTIVE,      // first in line, coins being sent
+    CREDIT_DONE         // all coins sent
+} wb_credit_state;
+
+typedef struct wb_credit_status {
+    wb_credit_state state;
+    int sent;
+    int count;
+    uint32 width_target; // requested pulse width, in microseconds
+    uint32 width_min;    // measured widths of the pulses sent so far
+    uint32 width_max;
+} wb_credit_status;
+
+/*
+ * Measured width of a coin pulse, as it was driven on the output.
+ */
+typedef struct wb_credit_pulse {
+    uint16 id;           // request the pulse was sent for
+    uint8 coin_type;
+    uint32 width_target; // in microseconds
+    uint32 width;        // in microseconds
+} wb_credit_pulse;
+
 void user_wb_credit_init(void);
 
-int user_wb_credit_drop(CoinType coin_type);
+int user_wb_credit_queue(CoinType coin_type, int count);
+bool user_wb_credit_status(int id, wb_credit_status *status);
+int user_wb_credit_pulses(wb_credit_pulse *pulses, int max_pulses);
 
 #endif /* USER_WB_CREDIT_H */
\ No newline at end of file
@@ -0,0 +1,63 @@
+#ifndef USER_WB_DECODER_H
+#define USER_WB_DECODER_H
+
+#include <os_type.h>
+
+#include "user_wb_protocol.h"
+#include "user_wb_calibrate.h"
+
+/* Maximum accumulated length of a pulse stream */
+#define MAX_WB_SELECTION_PULSES 64
+
+/* Selection timeouts, in milliseconds */
+#define WB_TIMEOUT_IDLE     3000 // no valid selection yet
+#define WB_TIMEOUT_COMPLETE 10   // complete selection, wait this long past the debounce gap
+
+typedef enum wb_decoder_result {
+    DECODER_EDGE_NONE = 0,    // not a level transition
+    DECODER_EDGE_OK,          // edge accepted
+    DECODER_EDGE_SPIKE,       // pulse too short to be real, discarded
+    DECODER_EDGE_ERROR_GAP,   // gap ended with a pulse still pending
+    DECODER_EDGE_ERROR_PULSE, // pulse ended without a preceding gap
+    DECODER_EDGE_ERROR_MAX,   // too many pulses, selection discarded
+    DECODER_EDGE_UNKNOWN      // no wallbox protocol, selection discarded
+} wb_decoder_result;
+
+/*
+ * Selection decoder state for one signal input.
+ *
+ * The decoder only consumes edge timestamps and makes no system calls,
+ * so the caller is responsible for timing out the selection and
+ * calling wb_decoder_commit() once the reported timeout has elapsed
+ * without another edge. Callers working from recorded edges rather
+ * than a timer check wb_decoder_expired() ahead of each edge instead.
+ */
+typedef struct wb_decoder {
+    const wb_protocol *protocol;
+    wb_timing timing;
+    int last_value;
+    uint32 last_time;
+    uint32 gap_start;                   // time of the last accepted falling edge
+    wb_selection_pulse current;         // pulse being received
+    wb_selection_pulse previous;        // last complete pulse
+    wb_selection_tally tally;           // tally including the last complete pulse
+    wb_selection_tally tally_previous;  // tally before the last complete pulse
+    int pulse_index;
+    wb_train_timing train;              // timing of the selection in progress
+    uint32 spikes;                      // pulses rejected as noise during the selection
+    uint32 bounces;                     // gaps merged as bounce during the selection
+    uint32 timeout;                     // commit timeout after the last edge, in milliseconds
+    bool pending;                       // edges received since the last commit
+    bool stats;                         // record the signal statistics
+    int stats_input;                    // input to record them against
+} wb_decoder;
+
+void wb_decoder_init(wb_decoder *decoder, const wb_protocol *protocol, const wb_timing *timing, uint32 time);
+void wb_decoder_set_protocol(wb_decoder *decoder, const wb_protocol *protocol, const wb_timing *timing);
+void wb_decoder_clear(wb_decoder *decoder);
+
+wb_decoder_result wb_decoder_edge(wb_decoder *decoder, int value, uint32 time);
+bool wb_decoder_expired(const wb_decoder *decoder, uint32 time);
+wb_tally_state wb_decoder_commit(wb_decoder *decoder, char *letter, int *number, wb_train_timing *train);
+
+#endif /* USER_WB_DECODER_H */
@@ -0,0 +1,23 @@
+#ifndef USER_WB_DETECT_H
+#define USER_WB_DETECT_H
+
+#include <os_type.h>
+
+#include "user_config.h"
+
+/*
+ * Wallbox model detection.
+ *
+ * Runs a decoder for every known wallbox protocol over the selection
+ * signal of an input, and locks onto the model whose decoder keeps
+ * producing valid selections when the others do not. Each input is
+ * detected on its own.
+ */
+
+void user_wb_detect_reset(int input, uint32 time);
+bool user_wb_detect_edge(int input, int value, uint32 time);
+uint32 user_wb_detect_timeout(int input);
+bool user_wb_detect_commit(int input, char *letter, int *number);
+wallbox_type user_wb_detect_locked(int input);
+
+#endif /* USER_WB_DETECT_H */
@@ -0,0 +1,31 @@
+#ifndef USER_WB_LEDGER_H
+#define USER_WB_LEDGER_H
+
+#include <os_type.h>
+
+#include "user_wb_credit.h"
+
+/*
+ * Credit and play ledger.
+ *
+ * Counts the coins sent to the wallbox by type, and the selections
+ * queued for play by index. The counters are kept in RAM, and saved
+ * in batches on a timer as CRC protected snapshots, appended to a
+ * ring of slots in a reserved flash region. At startup the newest
+ * intact snapshot is loaded back.
+ */
+
+/* Coin types counted by the ledger */
+#define WB_LEDGER_COINS 3
+
+/* Selection indices counted by the ledger */
+#define WB_LEDGER_SELECTIONS 200
+
+void user_wb_ledger_init(void);
+
+void user_wb_ledger_credit(CoinType coin_type);
+void user_wb_ledger_play(char letter, int number);
+
+int user_wb_ledger_json(int part, char *buf, int buf_len);
+
+#endif /* USER_WB_LEDGER_H */
@@ -0,0 +1,92 @@
+#ifndef USER_WB_PROTOCOL_H
+#define USER_WB_PROTOCOL_H
+
+#include <os_type.h>
+
+#include "user_config.h"
+
+/* Default minimum allowable pulse gap, in microseconds */
+#define DEBOUNCE_GAP 10000
+
+/* Default minimum allowable pulse width, in microseconds */
+#define GLITCH_PULSE 2000
+
+typedef enum wb_delimiter_type {
+    DELIMITER_GAP = 0,      // long gap before the first pulse of the second train
+    DELIMITER_GAP_OR_PULSE  // long gap, or a long uncounted pulse between the trains
+} wb_delimiter_type;
+
+typedef enum wb_selection_layout {
+    LAYOUT_NUMBER_LETTER = 0, // first train selects the number, second the letter
+    LAYOUT_LETTER_NUMBER      // first train selects the letter, second the number
+} wb_selection_layout;
+
+/*
+ * Signal protocol descriptor for a wallbox model.
+ *
+ * The descriptor table is stored in flash, so every field must be
+ * 32 bits wide and only be read through a pointer to the table entry.
+ */
+typedef struct wb_protocol {
+    const char *name;        // configuration name
+    const char *description; // display name
+    uint32 delimiter;        // wb_delimiter_type
+    uint32 delimiter_gap;    // gap longer than this is a delimiter, in microseconds
+    uint32 delimiter_pulse;  // pulse longer than this is a delimiter, in microseconds
+    uint32 p1_min;           // valid range of the first pulse train
+    uint32 p1_max;
+    uint32 p1_skip;          // first train count that is never sent, or 0
+    uint32 p2_min;           // valid range of the second pulse train
+    uint32 p2_max;
+    uint32 layout;           // wb_selection_layout
+    uint32 letter_count;     // letters used from the selection alphabet
+    uint32 commit_timeout;   // wait after a valid selection, in milliseconds
+} wb_protocol;
+
+/*
+ * Decoding thresholds in use for an installed wallbox.
+ * Starts out from the protocol defaults, and may be tightened
+ * by calibration against the observed signal.
+ */
+typedef struct wb_timing {
+    uint32 delimiter_gap;   // in microseconds
+    uint32 delimiter_pulse; // in microseconds
+    uint32 debounce_gap;    // in microseconds
+    uint32 min_pulse;       // shorter pulses are noise, in microseconds
+    uint32 commit_timeout;  // in milliseconds
+} wb_timing;
+
+typedef struct wb_selection_pulse {
+    uint32 elapsed; // time since the end of the last pulse
+    uint32 duration; // duration of the current pulse
+} wb_selection_pulse;
+
+/*
+ * Running pulse counts for the selection in progress.
+ * Updated once per pulse, so decoding never has to revisit
+ * earlier pulses in the train.
+ */
+typedef struct wb_selection_tally {
+    int p1;
+    int p2;
+    bool delimiter;
+} wb_selection_tally;
+
+typedef enum wb_tally_state {
+    TALLY_INCOMPLETE = 0, // not a valid selection yet, but could become one
+    TALLY_VALID,          // valid selection, but more pulses are allowed
+    TALLY_COMPLETE,       // valid selection, no more pulses are allowed
+    TALLY_INVALID         // can never become a valid selection
+} wb_tally_state;
+
+const wb_protocol *wb_protocol_get(wallbox_type wb_type);
+wallbox_type wb_protocol_find(const char *name, int len);
+
+void wb_protocol_default_timing(const wb_protocol *protocol, wb_timing *timing);
+
+void wb_protocol_tally_step(const wb_protocol *protocol, const wb_timing *timing,
+    wb_selection_tally *tally, const wb_selection_pulse *pulse);
+wb_tally_state wb_protocol_tally_decode(const wb_protocol *protocol,
+    const wb_selection_tally *tally, char *letter, int *number);
+
+#endif /* USER_WB_PROTOCOL_H */
@@ -0,0 +1,44 @@
+#ifndef USER_WB_REPLAY_H
+#define USER_WB_REPLAY_H
+
+#include <os_type.h>
+
+#include "user_config.h"
+
+/*
+ * Replays a recorded selection signal trace through the same decoder
+ * used for the live signal, for checking decoder changes against
+ * known traces before they go to an installed unit.
+ *
+ * The trace is CSV text, one record per line:
+ *   <time>,<level>    edge at the time in microseconds, and the
+ *                     signal level after the edge
+ *   expect,<song>     expected result of the next selection, as a
+ *                     selection such as "B7", or "error"
+ * Blank lines and lines starting with '#' are ignored.
+ *
+ * Calibrated timing is taken from the given input.
+ */
+typedef struct wb_replay wb_replay;
+
+/*
+ * Outcome of a finished replay. The trace passes if every selection
+ * matched the result expected of it, and nothing was left unmatched.
+ */
+typedef struct wb_replay_summary {
+    uint32 edges;
+    uint32 selections;
+    uint32 correct;
+    uint32 incorrect;
+    uint32 unchecked;   // selections with no expected result
+    uint32 missed;      // expected results with no selection
+    uint32 bad_lines;
+} wb_replay_summary;
+
+wb_replay *user_wb_replay_start(int input, wallbox_type wb_type, bool calibrated);
+bool user_wb_replay_feed(wb_replay *replay, const char *data, int len);
+int user_wb_replay_finish(wb_replay *replay, char *buf, int buf_len);
+bool user_wb_replay_summary(const wb_replay *replay, wb_replay_summary *summary);
+void user_wb_replay_free(wb_replay *replay);
+
+#endif /* USER_WB_REPLAY_H */
@@ -4,6 +4,8 @@
 #include "user_config.h"
 
 void user_wb_selection_init(void);
-void user_wb_set_wallbox_type(wallbox_type wb_type);
+void user_wb_set_wallbox_type(int input, wallbox_type wb_type);
+wallbox_type user_wb_get_wallbox_type(int input);
+void user_wb_reload_timing(void);
 
 #endif /* USER_WB_SELECTION_H */
\ No newline at end of file
@@ -0,0 +1,58 @@
+#ifndef USER_WB_STATS_H
+#define USER_WB_STATS_H
+
+#include <os_type.h>
+
+#include "user_config.h"
+#include "user_wb_protocol.h"
+
+/*
+ * Selection signal statistics.
+ *
+ * Keeps histograms of the pulse and gap widths seen by the selection
+ * decoder of each input, and counts of the errors it ran into, so the
+ * margins to the decoding thresholds can be checked on a running unit.
+ *
+ * Histogram bins are half an octave wide. The first bin holds widths
+ * below WB_STATS_BIN_MIN, and the last holds everything from its lower
+ * bound up.
+ */
+
+#define WB_STATS_BINS 32
+
+/* Lower bound of the second bin, in microseconds, must be a power of 2 */
+#define WB_STATS_BIN_MIN 128
+
+typedef enum wb_stats_counter {
+    WB_STATS_SELECTION = 0, // selections decoded
+    WB_STATS_ERROR_GAP,     // gap ended with a pulse still pending, "Error 1"
+    WB_STATS_ERROR_PULSE,   // pulse ended without a preceding gap, "Error 2"
+    WB_STATS_ERROR_MAX,     // too many pulses, "Error MAX"
+    WB_STATS_ERROR_DECODE,  // timed out without a valid selection
+    WB_STATS_SPIKE,         // pulses rejected as noise
+    WB_STATS_BOUNCE,        // gaps merged as bounce
+    WB_STATS_OVERFLOW,      // edges lost to a full edge queue
+    WB_STATS_COUNTERS
+} wb_stats_counter;
+
+typedef struct wb_stats {
+    int input;
+    wallbox_type wallbox_type;             // active when the statistics were read
+    wb_timing timing;
+    uint32 counters[WB_STATS_COUNTERS];
+    uint32 pulse[WB_STATS_BINS];           // counted and delimiter pulses
+    uint32 gap[WB_STATS_BINS];             // gaps within a pulse train
+    uint32 delimiter_gap[WB_STATS_BINS];   // gaps between the pulse trains
+    uint32 spike[WB_STATS_BINS];           // pulses rejected as noise
+} wb_stats;
+
+void user_wb_stats_reset(int input);
+void user_wb_stats_count(int input, wb_stats_counter counter, uint32 count);
+void user_wb_stats_pulse(int input, const wb_selection_pulse *pulse,
+    const wb_selection_tally *before, const wb_selection_tally *after);
+void user_wb_stats_spike(int input, uint32 width);
+
+void user_wb_stats_get(int input, wb_stats *stats);
+int user_wb_stats_json(const wb_stats *stats, int part, char *buf, int buf_len);
+
+#endif /* USER_WB_STATS_H */
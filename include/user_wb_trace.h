@@ -0,0 +1,70 @@
+#ifndef USER_WB_TRACE_H
+#define USER_WB_TRACE_H
+
+#include <os_type.h>
+
+#include "user_config.h"
+
+/*
+ * Selection signal trace recorder.
+ *
+ * Keeps the raw edges of the most recent selection attempts in a
+ * ring of fixed size slots in a reserved flash region. Each edge is
+ * stored as a varint of the time since the previous edge, shifted
+ * left by one, with the signal level after the edge in the low bit.
+ */
+
+/* Size of a trace record in flash, including the header */
+#define WB_TRACE_SLOT_SIZE 512
+
+typedef enum wb_trace_result {
+    WB_TRACE_SONG = 0,   // decoded to a selection
+    WB_TRACE_ERROR       // failed to decode
+} wb_trace_result;
+
+/* Record flags */
+#define WB_TRACE_FLAG_TRUNCATED 0x01 // edges did not all fit in the slot
+
+/* Input the record was taken from, in the upper bits of the flags */
+#define WB_TRACE_FLAG_INPUT_SHIFT 4
+#define WB_TRACE_INPUT(flags) ((flags) >> WB_TRACE_FLAG_INPUT_SHIFT)
+
+typedef struct wb_trace_header {
+    uint32 magic;
+    uint32 sequence;     // attempt number, increasing across the ring
+    uint32 start_time;   // system time of the first edge
+    uint8 wallbox_type;
+    uint8 result;        // wb_trace_result
+    char letter;         // decoded selection, for WB_TRACE_SONG
+    uint8 number;
+    uint8 flags;
+    uint8 spikes;        // pulses rejected as noise
+    uint16 edge_count;
+    uint16 data_len;     // bytes of edge data following the header
+    uint16 bounces;      // gaps merged as bounce
+} wb_trace_header;
+
+/*
+ * State for reading the recorded traces out, oldest first.
+ */
+typedef struct wb_trace_reader {
+    int slot;            // next slot to load
+    int slots_left;      // slots not yet visited
+    bool loaded;         // record holds a slot that is being read
+    int offset;          // position within the edge data
+    int edges_left;
+    uint32 time;         // time of the last edge read
+    uint32 record[WB_TRACE_SLOT_SIZE / 4];
+} wb_trace_reader;
+
+void user_wb_trace_init(void);
+void user_wb_trace_edge(int input, int value, uint32 time);
+void user_wb_trace_commit(int input, wallbox_type wb_type, wb_trace_result result, char letter, int number,
+    uint32 spikes, uint32 bounces);
+void user_wb_trace_discard(int input);
+
+void user_wb_trace_reader_init(wb_trace_reader *reader);
+int user_wb_trace_read_csv(wb_trace_reader *reader, char *buf, int buf_len);
+int user_wb_trace_read_bin(wb_trace_reader *reader, char *buf, int buf_len);
+
+#endif /* USER_WB_TRACE_H */
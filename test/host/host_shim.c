@@ -0,0 +1,48 @@
+#include <time.h>
+
+#include "user_config.h"
+#include "user_wb_stats.h"
+
+/*
+ * Host versions of the system and configuration calls made by the
+ * selection decoder. Settings are left at their defaults, nothing is
+ * calibrated, and statistics are not recorded.
+ */
+
+uint32 system_get_time(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint32)((ts.tv_sec * 1000000ULL) + (ts.tv_nsec / 1000));
+}
+
+uint8 user_config_get_wallbox_min_pulse()
+{
+    return 0;
+}
+
+void user_config_set_wb_calibration(int input, const wb_calibration *calibration)
+{
+}
+
+bool user_config_get_wb_calibration(int input, wb_calibration *calibration)
+{
+    return false;
+}
+
+void user_config_save(void)
+{
+}
+
+void user_wb_stats_count(int input, wb_stats_counter counter, uint32 count)
+{
+}
+
+void user_wb_stats_pulse(int input, const wb_selection_pulse *pulse,
+    const wb_selection_tally *before, const wb_selection_tally *after)
+{
+}
+
+void user_wb_stats_spike(int input, uint32 width)
+{
+}
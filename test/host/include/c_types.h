@@ -0,0 +1,6 @@
+#ifndef HOST_C_TYPES_H
+#define HOST_C_TYPES_H
+
+#include "host_shim.h"
+
+#endif /* HOST_C_TYPES_H */
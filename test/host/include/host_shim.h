@@ -0,0 +1,45 @@
+#ifndef HOST_SHIM_H
+#define HOST_SHIM_H
+
+/*
+ * Stand-in for the parts of the ESP8266 SDK used by the selection
+ * decoder, so it can be built and run on the host.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef unsigned char uint8;
+typedef signed char sint8;
+typedef unsigned short uint16;
+typedef signed short sint16;
+typedef unsigned int uint32;
+typedef signed int sint32;
+
+#define LOCAL static
+#define ICACHE_FLASH_ATTR
+#define ICACHE_RODATA_ATTR
+
+#define os_printf printf
+#define os_sprintf sprintf
+#define os_memcpy memcpy
+#define os_memmove memmove
+#define os_memset memset
+#define os_bzero(s, n) memset((s), 0, (n))
+#define os_strlen strlen
+#define os_strcmp strcmp
+#define os_strncmp strncmp
+#define os_strchr strchr
+#define os_strcpy strcpy
+
+#define os_malloc malloc
+#define os_zalloc(s) calloc(1, (s))
+#define os_free free
+
+uint32 system_get_time(void);
+
+#endif /* HOST_SHIM_H */
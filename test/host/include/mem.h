@@ -0,0 +1,6 @@
+#ifndef HOST_MEM_H
+#define HOST_MEM_H
+
+#include "host_shim.h"
+
+#endif /* HOST_MEM_H */
@@ -0,0 +1,6 @@
+#ifndef HOST_OS_TYPE_H
+#define HOST_OS_TYPE_H
+
+#include "host_shim.h"
+
+#endif /* HOST_OS_TYPE_H */
@@ -0,0 +1,6 @@
+#ifndef HOST_OSAPI_H
+#define HOST_OSAPI_H
+
+#include "host_shim.h"
+
+#endif /* HOST_OSAPI_H */
@@ -0,0 +1,6 @@
+#ifndef HOST_USER_INTERFACE_H
+#define HOST_USER_INTERFACE_H
+
+#include "host_shim.h"
+
+#endif /* HOST_USER_INTERFACE_H */
@@ -0,0 +1,147 @@
+#include <time.h>
+
+#include "user_wb_protocol.h"
+#include "user_wb_replay.h"
+
+/*
+ * Replays selection signal traces through the decoder on the host,
+ * either synthesized or downloaded from a unit, for checking decoder
+ * and threshold changes before they go to an installed unit.
+ *
+ * Usage: replay_runner [-v] [-r repeat] <trace.csv>...
+ *
+ * Each trace is replayed as the wallbox model named by the directory
+ * it is in, such as synthetic/SEEBURG_3W1_100/bounce.csv. Exits with an
+ * error if any selection does not decode to the result expected of it.
+ * Repeating the replays gives a steadier time per edge.
+ */
+
+#define RUNNER_REPORT_SIZE 4096
+
+LOCAL char *runner_read(const char *path, int *len);
+LOCAL wallbox_type runner_wallbox(const char *path);
+LOCAL bool runner_trace(const char *path, int repeat, bool verbose);
+
+int main(int argc, char *argv[])
+{
+    int repeat = 1;
+    bool verbose = false;
+    int failed = 0;
+    int count = 0;
+    int i;
+
+    for (i = 1; i < argc; i++) {
+        if (os_strcmp(argv[i], "-v") == 0) {
+            verbose = true;
+        } else if (os_strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+            repeat = atoi(argv[++i]);
+            if (repeat < 1) {
+                repeat = 1;
+            }
+        } else {
+            if (!runner_trace(argv[i], repeat, verbose)) {
+                failed++;
+            }
+            count++;
+        }
+    }
+
+    if (count == 0) {
+        fprintf(stderr, "Usage: %s [-v] [-r repeat] <trace.csv>...\n", argv[0]);
+        return 2;
+    }
+
+    os_printf("%d of %d traces passed\n", count - failed, count);
+    return (failed > 0) ? 1 : 0;
+}
+
+LOCAL bool runner_trace(const char *path, int repeat, bool verbose)
+{
+    wallbox_type wb_type = runner_wallbox(path);
+    wb_replay_summary summary;
+    struct timespec start;
+    struct timespec end;
+    char report[RUNNER_REPORT_SIZE];
+    bool passed = false;
+    char *data;
+    uint64_t elapsed;
+    int len;
+    int i;
+
+    if (wb_type == UNKNOWN_WALLBOX) {
+        os_printf("FAIL %s: no wallbox model for the directory\n", path);
+        return false;
+    }
+
+    data = runner_read(path, &len);
+    if (!data) {
+        os_printf("FAIL %s: cannot read the trace\n", path);
+        return false;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < repeat; i++) {
+        wb_replay *replay = user_wb_replay_start(0, wb_type, false);
+        if (!replay) {
+            os_free(data);
+            return false;
+        }
+        user_wb_replay_feed(replay, data, len);
+        user_wb_replay_finish(replay, report, sizeof(report));
+        passed = user_wb_replay_summary(replay, &summary);
+        user_wb_replay_free(replay);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    os_free(data);
+
+    elapsed = ((end.tv_sec - start.tv_sec) * 1000000000ULL) + end.tv_nsec - start.tv_nsec;
+
+    os_printf("%s %s: %u selections, %u correct, %u incorrect, %u unchecked, %u missed, %u bad lines, %llu ns/edge\n",
+        passed ? "PASS" : "FAIL", path,
+        summary.selections, summary.correct, summary.incorrect,
+        summary.unchecked, summary.missed, summary.bad_lines,
+        (summary.edges > 0) ? (unsigned long long)(elapsed / ((uint64_t)summary.edges * repeat)) : 0ULL);
+    if (verbose || !passed) {
+        os_printf("%s\n", report);
+    }
+    return passed;
+}
+
+LOCAL char *runner_read(const char *path, int *len)
+{
+    FILE *file = fopen(path, "rb");
+    char *data;
+    long size;
+
+    if (!file) {
+        return NULL;
+    }
+    fseek(file, 0, SEEK_END);
+    size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    data = (char *)os_malloc(size > 0 ? size : 1);
+    if (data && fread(data, 1, size, file) != (size_t)size) {
+        os_free(data);
+        data = NULL;
+    }
+    fclose(file);
+
+    *len = (int)size;
+    return data;
+}
+
+LOCAL wallbox_type runner_wallbox(const char *path)
+{
+    const char *end = strrchr(path, '/');
+    const char *start;
+
+    if (!end) {
+        return UNKNOWN_WALLBOX;
+    }
+    start = end;
+    while (start > path && start[-1] != '/') {
+        start--;
+    }
+    return wb_protocol_find(start, end - start);
+}
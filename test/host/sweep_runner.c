@@ -0,0 +1,648 @@
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/param.h>
+
+#include "user_wb_protocol.h"
+#include "user_wb_decoder.h"
+
+/*
+ * Noise robustness sweep for the selection decoder.
+ *
+ * Synthesizes the pulse trains for every valid selection of a wallbox
+ * model, perturbs them with timing jitter, contact bounce, dropped
+ * edges and noise spikes, and runs them through the same decoder used
+ * for the live signal. The result is a map of the error rate against
+ * the noise level and against one of the decoding thresholds, showing
+ * how far that threshold can be tightened before accuracy drops.
+ *
+ * Usage: sweep_runner [options] <wallbox>
+ *   -p param   threshold to sweep: commit_timeout (ms), delimiter_gap,
+ *              debounce_gap or min_pulse (us)
+ *   -a start   first threshold value, the default threshold if omitted
+ *   -b end     last threshold value, half of the start if omitted
+ *   -n steps   threshold values, from start to end
+ *   -l levels  noise levels, from none up to the amounts below
+ *   -t trials  per threshold value and noise level
+ *   -s seed    random seed, to repeat an earlier sweep
+ *   -j jobs    worker threads, one per core if omitted
+ *   -J jitter  largest change to each width, in microseconds
+ *   -B bounce  chance of contact bounce per pulse, per thousand
+ *   -D drop    chance of losing each edge, per thousand
+ *   -S spike   chance of a noise spike per gap, per thousand
+ *   -P pulse, -G gap, -L delimiter
+ *              nominal signal timing, in microseconds
+ *   -h         show this help
+ *
+ * Each threshold value and noise level is a cell of the map, with its
+ * own random sequence, so a sweep gives the same result from the same
+ * seed however many threads it runs on.
+ */
+
+/* Limits on the size of the result map */
+#define SWEEP_MAX_LEVELS 16
+#define SWEEP_MAX_STEPS  16
+
+/* Edges in one synthesized selection, including the added noise */
+#define SWEEP_MAX_EDGES 192
+
+/* Valid selections of a wallbox model */
+#define SWEEP_MAX_SELECTIONS 256
+
+/* Width ranges of the added noise, in microseconds */
+#define SWEEP_BOUNCE_MIN 300
+#define SWEEP_BOUNCE_MAX 3000
+#define SWEEP_SPIKE_MIN  200
+#define SWEEP_SPIKE_MAX  1500
+
+/* Shortest synthesized pulse or gap after jitter, in microseconds */
+#define SWEEP_WIDTH_MIN 500
+
+typedef enum sweep_param {
+    SWEEP_COMMIT_TIMEOUT = 0,
+    SWEEP_DELIMITER_GAP,
+    SWEEP_DEBOUNCE_GAP,
+    SWEEP_MIN_PULSE,
+    MAX_SWEEP_PARAMS
+} sweep_param;
+
+LOCAL const char *SWEEP_PARAM_NAMES[MAX_SWEEP_PARAMS] = {
+    [SWEEP_COMMIT_TIMEOUT] = "commit_timeout",
+    [SWEEP_DELIMITER_GAP] = "delimiter_gap",
+    [SWEEP_DEBOUNCE_GAP] = "debounce_gap",
+    [SWEEP_MIN_PULSE] = "min_pulse"
+};
+
+/*
+ * Nominal signal timing of each wallbox model, in microseconds,
+ * going by the measurements noted on the protocol table.
+ */
+typedef struct sweep_signal {
+    uint32 pulse;
+    uint32 gap;
+    uint32 delimiter;
+} sweep_signal;
+
+LOCAL const sweep_signal SWEEP_SIGNALS[MAX_WALLBOX_TYPES] = {
+    [SEEBURG_3W1_100] = {
+        .pulse = 40000,
+        .gap = 40000,
+        .delimiter = 170000
+    },
+    [SEEBURG_V3WA_200] = {
+        .pulse = 40000,
+        .gap = 40000,
+        .delimiter = 230000
+    }
+};
+
+/*
+ * Sweep settings. The noise amounts are those of the highest noise
+ * level, with the lower levels scaled down evenly to no noise at all.
+ */
+typedef struct sweep_config {
+    wallbox_type wb_type;
+    sweep_param param;
+    uint32 start;
+    uint32 end;
+    int steps;
+    int levels;
+    uint32 trials;
+    uint32 seed;
+    int jobs;
+    uint32 pulse;
+    uint32 gap;
+    uint32 delimiter;
+    uint32 jitter;
+    uint32 bounce;
+    uint32 drop;
+    uint32 spike;
+} sweep_config;
+
+typedef struct sweep_edge {
+    uint32 time;
+    int level;
+} sweep_edge;
+
+typedef struct sweep_cell {
+    uint32 trials;
+    uint32 wrong;    // decoded to another selection
+    uint32 split;    // committed early, as more than one selection
+    uint32 error;    // failed to decode
+    uint64_t latency; // total commit delay of the correct selections, in milliseconds
+} sweep_cell;
+
+typedef struct sweep_plan {
+    sweep_config config;
+    const wb_protocol *protocol;
+    uint32 values[SWEEP_MAX_STEPS];
+    wb_timing timing[SWEEP_MAX_STEPS];
+    uint8 selections[SWEEP_MAX_SELECTIONS][2]; // first and second train counts
+    int selection_count;
+    sweep_cell cells[SWEEP_MAX_LEVELS][SWEEP_MAX_STEPS];
+    volatile int next_cell; // next cell for a worker to take on
+} sweep_plan;
+
+typedef struct sweep_worker {
+    sweep_plan *plan;
+    pthread_t thread;
+    uint32 random;
+    sweep_edge edges[SWEEP_MAX_EDGES];
+    int edge_count;
+    wb_decoder decoder;
+} sweep_worker;
+
+LOCAL bool sweep_plan_init(sweep_plan *plan, const sweep_config *config);
+LOCAL void *sweep_worker_run(void *arg);
+LOCAL void sweep_trial(sweep_worker *worker, int level, int step, sweep_cell *result);
+LOCAL void sweep_synthesize(sweep_worker *worker, int p1, int p2, int level);
+LOCAL void sweep_edge_add(sweep_worker *worker, uint32 time, int level, uint32 drop);
+LOCAL uint32 sweep_jitter(sweep_worker *worker, uint32 width, uint32 jitter);
+LOCAL uint32 sweep_random(sweep_worker *worker, uint32 range);
+LOCAL uint32 sweep_level_amount(const sweep_plan *plan, uint32 amount, int level);
+LOCAL uint32 *sweep_timing_field(wb_timing *timing, sweep_param param);
+LOCAL sweep_param sweep_param_find(const char *name);
+LOCAL void sweep_report(const sweep_plan *plan, uint64_t elapsed);
+LOCAL bool sweep_number(const char *arg, uint32 *value);
+LOCAL void sweep_usage(FILE *out, const char *name);
+
+int main(int argc, char *argv[])
+{
+    sweep_config config;
+    sweep_plan *plan;
+    sweep_worker *workers;
+    struct timespec start;
+    struct timespec end;
+    uint64_t elapsed;
+    int opt;
+    int i;
+
+    os_bzero(&config, sizeof(sweep_config));
+    config.steps = 8;
+    config.levels = 8;
+    config.trials = 10000;
+    config.jitter = 10000;
+    config.bounce = 200;
+    config.drop = 5;
+    config.spike = 200;
+
+    while ((opt = getopt(argc, argv, "hp:a:b:n:l:t:s:j:J:B:D:S:P:G:L:")) != -1) {
+        uint32 value = 0;
+
+        if (opt == 'h') {
+            sweep_usage(stdout, argv[0]);
+            return 0;
+        }
+        if (opt == '?') {
+            sweep_usage(stderr, argv[0]);
+            return 2;
+        }
+        if (opt == 'p') {
+            config.param = sweep_param_find(optarg);
+            if (config.param == MAX_SWEEP_PARAMS) {
+                fprintf(stderr, "Unknown threshold: %s\n", optarg);
+                return 2;
+            }
+            continue;
+        }
+        if (!sweep_number(optarg, &value)) {
+            fprintf(stderr, "Not a number for -%c: %s\n", opt, optarg);
+            return 2;
+        }
+
+        switch (opt) {
+        case 'a': config.start = value; break;
+        case 'b': config.end = value; break;
+        case 'n': config.steps = (int)value; break;
+        case 'l': config.levels = (int)value; break;
+        case 't': config.trials = value; break;
+        case 's': config.seed = value; break;
+        case 'j': config.jobs = (int)value; break;
+        case 'J': config.jitter = value; break;
+        case 'B': config.bounce = value; break;
+        case 'D': config.drop = value; break;
+        case 'S': config.spike = value; break;
+        case 'P': config.pulse = value; break;
+        case 'G': config.gap = value; break;
+        case 'L': config.delimiter = value; break;
+        }
+    }
+
+    if (optind != argc - 1) {
+        sweep_usage(stderr, argv[0]);
+        return 2;
+    }
+
+    config.wb_type = wb_protocol_find(argv[optind], os_strlen(argv[optind]));
+    if (config.wb_type == UNKNOWN_WALLBOX) {
+        fprintf(stderr, "Unknown wallbox: %s\n", argv[optind]);
+        return 2;
+    }
+    if (config.jobs < 1) {
+        config.jobs = MAX(1, (int)sysconf(_SC_NPROCESSORS_ONLN));
+    }
+
+    plan = (sweep_plan *)os_zalloc(sizeof(sweep_plan));
+    workers = (sweep_worker *)os_zalloc(sizeof(sweep_worker) * config.jobs);
+    if (!plan || !workers || !sweep_plan_init(plan, &config)) {
+        fprintf(stderr, "Cannot set up the sweep\n");
+        os_free(plan);
+        os_free(workers);
+        return 1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < plan->config.jobs; i++) {
+        workers[i].plan = plan;
+        if (pthread_create(&workers[i].thread, NULL, sweep_worker_run, &workers[i]) != 0) {
+            // Carry on with the workers already started
+            plan->config.jobs = i;
+            break;
+        }
+    }
+    if (plan->config.jobs == 0) {
+        sweep_worker_run(&workers[0]);
+    }
+    for (i = 0; i < plan->config.jobs; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    elapsed = ((end.tv_sec - start.tv_sec) * 1000000000ULL) + end.tv_nsec - start.tv_nsec;
+    sweep_report(plan, elapsed);
+
+    os_free(workers);
+    os_free(plan);
+    return 0;
+}
+
+LOCAL bool sweep_number(const char *arg, uint32 *value)
+{
+    char *end;
+    unsigned long number;
+
+    if (*arg < '0' || *arg > '9') {
+        return false;
+    }
+    number = strtoul(arg, &end, 10);
+    if (*end != '\0' || number > INT_MAX) {
+        return false;
+    }
+    *value = (uint32)number;
+    return true;
+}
+
+LOCAL void sweep_usage(FILE *out, const char *name)
+{
+    fprintf(out, "Usage: %s [options] <wallbox>\n"
+        "  -p param   threshold to sweep: commit_timeout (ms), delimiter_gap,\n"
+        "             debounce_gap or min_pulse (us)\n"
+        "  -a start   first threshold value, the default threshold if omitted\n"
+        "  -b end     last threshold value, half of the start if omitted\n"
+        "  -n steps   threshold values, from start to end\n"
+        "  -l levels  noise levels, from none up to the amounts below\n"
+        "  -t trials  per threshold value and noise level\n"
+        "  -s seed    random seed, to repeat an earlier sweep\n"
+        "  -j jobs    worker threads, one per core if omitted\n"
+        "  -J jitter  largest change to each width, in microseconds\n"
+        "  -B bounce  chance of contact bounce per pulse, per thousand\n"
+        "  -D drop    chance of losing each edge, per thousand\n"
+        "  -S spike   chance of a noise spike per gap, per thousand\n"
+        "  -P pulse, -G gap, -L delimiter\n"
+        "             nominal signal timing, in microseconds\n"
+        "  -h         show this help\n", name);
+}
+
+LOCAL bool sweep_plan_init(sweep_plan *plan, const sweep_config *config)
+{
+    const wb_protocol *protocol = wb_protocol_get(config->wb_type);
+    wb_selection_tally tally;
+    wb_timing base;
+    int p1;
+    int p2;
+    int i;
+
+    if (!protocol) {
+        return false;
+    }
+
+    plan->protocol = protocol;
+    plan->config = *config;
+    config = &plan->config;
+    plan->config.levels = MAX(1, MIN(config->levels, SWEEP_MAX_LEVELS));
+    plan->config.steps = MAX(1, MIN(config->steps, SWEEP_MAX_STEPS));
+    plan->config.trials = MAX(1, config->trials);
+    if (plan->config.pulse == 0) {
+        plan->config.pulse = SWEEP_SIGNALS[config->wb_type].pulse;
+    }
+    if (plan->config.gap == 0) {
+        plan->config.gap = SWEEP_SIGNALS[config->wb_type].gap;
+    }
+    if (plan->config.delimiter == 0) {
+        plan->config.delimiter = SWEEP_SIGNALS[config->wb_type].delimiter;
+    }
+    if (plan->config.seed == 0) {
+        plan->config.seed = (uint32)time(NULL) | 1;
+    }
+
+    // Threshold values default to halving the default threshold
+    wb_protocol_default_timing(protocol, &base);
+    if (plan->config.start == 0) {
+        plan->config.start = *sweep_timing_field(&base, config->param);
+    }
+    if (plan->config.end == 0) {
+        plan->config.end = config->start / 2;
+    }
+    for (i = 0; i < config->steps; i++) {
+        int64_t value = config->start;
+        if (config->steps > 1) {
+            value += (((int64_t)config->end - (int64_t)config->start) * i) / (config->steps - 1);
+        }
+        plan->values[i] = (uint32)value;
+        plan->timing[i] = base;
+        *sweep_timing_field(&plan->timing[i], config->param) = (uint32)value;
+    }
+
+    // Every train count pair that decodes to a selection
+    for (p1 = protocol->p1_min; p1 <= (int)protocol->p1_max; p1++) {
+        for (p2 = protocol->p2_min; p2 <= (int)protocol->p2_max; p2++) {
+            wb_tally_state state;
+            tally.p1 = p1;
+            tally.p2 = p2;
+            tally.delimiter = true;
+            state = wb_protocol_tally_decode(protocol, &tally, NULL, NULL);
+            if ((state == TALLY_VALID || state == TALLY_COMPLETE)
+                && plan->selection_count < SWEEP_MAX_SELECTIONS) {
+                plan->selections[plan->selection_count][0] = p1;
+                plan->selections[plan->selection_count][1] = p2;
+                plan->selection_count++;
+            }
+        }
+    }
+    return plan->selection_count > 0;
+}
+
+/*
+ * Take on cells of the map until there are none left. Each cell is
+ * only ever run by one worker, so its results need no locking.
+ */
+LOCAL void *sweep_worker_run(void *arg)
+{
+    sweep_worker *worker = (sweep_worker *)arg;
+    sweep_plan *plan = worker->plan;
+    int cells = plan->config.levels * plan->config.steps;
+    int cell;
+    uint32 i;
+
+    while ((cell = __sync_fetch_and_add(&plan->next_cell, 1)) < cells) {
+        int level = cell / plan->config.steps;
+        int step = cell % plan->config.steps;
+
+        // Seed from the cell, so the thread count does not matter
+        worker->random = (plan->config.seed ^ ((uint32)(cell + 1) * 0x9E3779B9)) | 1;
+        for (i = 0; i < plan->config.trials; i++) {
+            sweep_trial(worker, level, step, &plan->cells[level][step]);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Decode one randomly chosen selection at the noise level and
+ * threshold value of a cell.
+ */
+LOCAL void sweep_trial(sweep_worker *worker, int level, int step, sweep_cell *result)
+{
+    const sweep_plan *plan = worker->plan;
+    int index = sweep_random(worker, plan->selection_count);
+    int p1 = plan->selections[index][0];
+    int p2 = plan->selections[index][1];
+    wb_decoder *decoder = &worker->decoder;
+    wb_selection_tally tally;
+    wb_tally_state decoded = TALLY_INVALID;
+    char expected_letter = 0;
+    int expected_number = 0;
+    char letter = 0;
+    int number = 0;
+    uint32 latency = 0;
+    int commits = 0;
+    int i;
+
+    tally.p1 = p1;
+    tally.p2 = p2;
+    tally.delimiter = true;
+    wb_protocol_tally_decode(plan->protocol, &tally, &expected_letter, &expected_number);
+
+    sweep_synthesize(worker, p1, p2, level);
+    wb_decoder_init(decoder, plan->protocol, &plan->timing[step], 0);
+
+    // Commit wherever the gap to the next edge would have let the
+    // timeout expire, and once it has expired after the last edge
+    for (i = 0; i <= worker->edge_count; i++) {
+        uint32 time = (i < worker->edge_count) ? worker->edges[i].time
+            : decoder->last_time + (decoder->timeout * 1000);
+
+        if (wb_decoder_expired(decoder, time)) {
+            latency = decoder->timeout;
+            decoded = wb_decoder_commit(decoder, &letter, &number, NULL);
+            commits++;
+        }
+        if (i < worker->edge_count) {
+            wb_decoder_edge(decoder, worker->edges[i].level, worker->edges[i].time);
+        }
+    }
+
+    result->trials++;
+    if (commits > 1) {
+        result->split++;
+    } else if (commits == 0 || (decoded != TALLY_VALID && decoded != TALLY_COMPLETE)) {
+        result->error++;
+    } else if (letter != expected_letter || number != expected_number) {
+        result->wrong++;
+    } else {
+        result->latency += latency;
+    }
+}
+
+/*
+ * Build the edges for a selection, with the noise of the given level.
+ * The signal starts out idle, as if the last selection was long ago.
+ */
+LOCAL void sweep_synthesize(sweep_worker *worker, int p1, int p2, int level)
+{
+    const sweep_plan *plan = worker->plan;
+    const sweep_config *config = &plan->config;
+    uint32 jitter = sweep_level_amount(plan, config->jitter, level);
+    uint32 bounce = sweep_level_amount(plan, config->bounce, level);
+    uint32 drop = sweep_level_amount(plan, config->drop, level);
+    uint32 spike = sweep_level_amount(plan, config->spike, level);
+    uint32 time = WB_TIMEOUT_IDLE * 1000;
+    int count = p1 + p2;
+    int k;
+
+    worker->edge_count = 0;
+
+    for (k = 0; k < count; k++) {
+        uint32 width = sweep_jitter(worker, config->pulse, jitter);
+        uint32 gap;
+
+        sweep_edge_add(worker, time, 1, drop);
+        if (bounce > 0 && sweep_random(worker, 1000) < bounce && width > (SWEEP_BOUNCE_MAX * 3)) {
+            // Contact chatter just after the pulse starts
+            uint32 open = time + SWEEP_BOUNCE_MIN + sweep_random(worker, SWEEP_BOUNCE_MAX - SWEEP_BOUNCE_MIN);
+            sweep_edge_add(worker, open, 0, drop);
+            sweep_edge_add(worker, open + SWEEP_BOUNCE_MIN + sweep_random(worker, SWEEP_BOUNCE_MAX - SWEEP_BOUNCE_MIN), 1, drop);
+        }
+        time += width;
+        sweep_edge_add(worker, time, 0, drop);
+
+        if (k == count - 1) {
+            break;
+        }
+
+        gap = sweep_jitter(worker, (k == p1 - 1) ? config->delimiter : config->gap, jitter);
+        if (spike > 0 && sweep_random(worker, 1000) < spike && gap > (SWEEP_SPIKE_MAX * 4)) {
+            // Noise spike somewhere in the middle of the gap
+            uint32 at = time + (gap / 4) + sweep_random(worker, gap / 2);
+            sweep_edge_add(worker, at, 1, drop);
+            sweep_edge_add(worker, at + SWEEP_SPIKE_MIN + sweep_random(worker, SWEEP_SPIKE_MAX - SWEEP_SPIKE_MIN), 0, drop);
+        }
+        time += gap;
+    }
+}
+
+LOCAL void sweep_edge_add(sweep_worker *worker, uint32 time, int level, uint32 drop)
+{
+    if (worker->edge_count >= SWEEP_MAX_EDGES) {
+        return;
+    }
+    if (drop > 0 && sweep_random(worker, 1000) < drop) {
+        return;
+    }
+    worker->edges[worker->edge_count].time = time;
+    worker->edges[worker->edge_count].level = level;
+    worker->edge_count++;
+}
+
+LOCAL uint32 sweep_jitter(sweep_worker *worker, uint32 width, uint32 jitter)
+{
+    int32_t value = width;
+    if (jitter > 0) {
+        value += (int32_t)sweep_random(worker, (jitter * 2) + 1) - (int32_t)jitter;
+    }
+    return MAX(value, SWEEP_WIDTH_MIN);
+}
+
+/*
+ * Random number below the range, from a xorshift generator so that
+ * a sweep can be repeated from its seed.
+ */
+LOCAL uint32 sweep_random(sweep_worker *worker, uint32 range)
+{
+    uint32 x = worker->random;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    worker->random = x;
+    return (range > 0) ? (x % range) : 0;
+}
+
+LOCAL uint32 sweep_level_amount(const sweep_plan *plan, uint32 amount, int level)
+{
+    if (plan->config.levels < 2) {
+        return amount;
+    }
+    return (amount * level) / (plan->config.levels - 1);
+}
+
+LOCAL uint32 *sweep_timing_field(wb_timing *timing, sweep_param param)
+{
+    switch (param) {
+    case SWEEP_DELIMITER_GAP:
+        return &timing->delimiter_gap;
+    case SWEEP_DEBOUNCE_GAP:
+        return &timing->debounce_gap;
+    case SWEEP_MIN_PULSE:
+        return &timing->min_pulse;
+    case SWEEP_COMMIT_TIMEOUT:
+    default:
+        return &timing->commit_timeout;
+    }
+}
+
+LOCAL sweep_param sweep_param_find(const char *name)
+{
+    int i;
+    for (i = 0; i < MAX_SWEEP_PARAMS; i++) {
+        if (os_strcmp(name, SWEEP_PARAM_NAMES[i]) == 0) {
+            return (sweep_param)i;
+        }
+    }
+    return MAX_SWEEP_PARAMS;
+}
+
+/*
+ * Print the error rate in parts per million and the mean commit delay
+ * of the correct selections, with a row per noise level and a column
+ * per threshold value.
+ */
+LOCAL void sweep_report(const sweep_plan *plan, uint64_t elapsed)
+{
+    const sweep_config *config = &plan->config;
+    uint64_t total = (uint64_t)config->trials * config->levels * config->steps;
+    uint32 wrong = 0;
+    uint32 split = 0;
+    uint32 error = 0;
+    int level;
+    int map;
+    int i;
+
+    os_printf("Sweep of %s on %s over %d selections\n",
+        SWEEP_PARAM_NAMES[config->param], plan->protocol->name, plan->selection_count);
+    os_printf("Signal: pulse %u us, gap %u us, delimiter %u us\n",
+        config->pulse, config->gap, config->delimiter);
+    os_printf("Noise at level %d: jitter %u us, bounce %u/1000, drop %u/1000, spike %u/1000\n",
+        config->levels - 1, config->jitter, config->bounce, config->drop, config->spike);
+    os_printf("Seed %u, %llu trials on %d threads in %llu ms, %llu trials/s\n",
+        config->seed, (unsigned long long)total, MAX(1, config->jobs),
+        (unsigned long long)(elapsed / 1000000),
+        (elapsed > 0) ? (unsigned long long)((total * 1000000000ULL) / elapsed) : 0ULL);
+
+    for (map = 0; map < 2; map++) {
+        os_printf("\n%s, by %s in %s\n",
+            (map == 0) ? "Error rate in parts per million" : "Mean latency in milliseconds",
+            SWEEP_PARAM_NAMES[config->param], (config->param == SWEEP_COMMIT_TIMEOUT) ? "ms" : "us");
+        os_printf("level ");
+        for (i = 0; i < config->steps; i++) {
+            os_printf(" %8u", plan->values[i]);
+        }
+        os_printf("\n");
+
+        for (level = 0; level < config->levels; level++) {
+            os_printf("%5d ", level);
+            for (i = 0; i < config->steps; i++) {
+                const sweep_cell *cell = &plan->cells[level][i];
+                uint32 failed = cell->wrong + cell->split + cell->error;
+                uint32 correct = cell->trials - failed;
+                if (map == 0) {
+                    os_printf(" %8llu", (cell->trials > 0)
+                        ? (unsigned long long)(((uint64_t)failed * 1000000) / cell->trials) : 0ULL);
+                } else {
+                    os_printf(" %8llu", (correct > 0)
+                        ? (unsigned long long)(cell->latency / correct) : 0ULL);
+                }
+            }
+            os_printf("\n");
+        }
+    }
+
+    for (level = 0; level < config->levels; level++) {
+        for (i = 0; i < config->steps; i++) {
+            wrong += plan->cells[level][i].wrong;
+            split += plan->cells[level][i].split;
+            error += plan->cells[level][i].error;
+        }
+    }
+    os_printf("\nFailures: %u wrong, %u split, %u not decoded\n", wrong, split, error);
+}
@@ -7,6 +7,16 @@
 #define ESP_PARAM_VERSION 1
 #define ESP_PARAM_START_SEC 0x7C
 
+/*
+ * Settings for the inputs after the first are kept in a reserved
+ * flash region past the end of the second firmware image, so they
+ * are only available on a 4MB (512KB+512KB) flash layout. Each one
+ * takes the three sectors used by a protected parameter save.
+ */
+#define ESP_INPUT_PARAM_VERSION 1
+#define ESP_INPUT_PARAM_START_SEC 0x10C
+#define ESP_INPUT_PARAM_SECTORS 3
+
 /*
  * Saved parameter struct.
  * Padded out to the maximum size of 4096 bytes using
@@ -15,17 +25,45 @@
 struct esp_saved_param_t {
     uint8 version;
     uint8 wallbox_type;
-    uint8 reserved0[254];
+    uint8 wallbox_detect_save;
+    uint8 wallbox_min_pulse;
+    wb_calibration wb_calibration;
+    uint16 credit_gap;
+    uint8 reserved1[250 - sizeof(wb_calibration)];
     char sonos_uuid[64];
     uint8 sonos_reserved[320];
     char sonos_uri_base[256];
     char sonos_track_file[200][16];
 };
 
+/*
+ * Saved settings for an input after the first.
+ * The first input keeps its settings in the main parameter struct.
+ */
+struct esp_input_param_t {
+    uint8 version;
+    uint8 wallbox_type;
+    uint8 reserved[2];
+    wb_calibration wb_calibration;
+    char sonos_uuid[64];
+    char sonos_track_file[200][16];
+};
+
+/* Flag for the settings of an input having changed since they were saved */
+#define CONFIG_DIRTY(input) (1 << (input))
+
+LOCAL void ICACHE_FLASH_ATTR config_save(int input);
+LOCAL void ICACHE_FLASH_ATTR config_update(int input, void *saved, const void *value, int len);
+
 LOCAL struct esp_saved_param_t esp_param;
+LOCAL struct esp_input_param_t esp_input_param[WB_INPUTS - 1];
+LOCAL int input_count;
+LOCAL uint32 config_dirty;
 
 void ICACHE_FLASH_ATTR user_config_init(void)
 {
+    int i;
+
     os_bzero(&esp_param, sizeof(esp_param));
 
     // Try to load existing parameter data
@@ -51,25 +89,106 @@ void ICACHE_FLASH_ATTR user_config_init(void)
             os_printf("system_param_save_with_protect error\n");
         }
     }
+
+    input_count = 1;
+    if (system_get_flash_size_map() != FLASH_SIZE_32M_MAP_512_512) {
+        os_printf("Only one wallbox input available for this flash layout\n");
+        return;
+    }
+
+    for (i = 0; i < WB_INPUTS - 1; i++) {
+        struct esp_input_param_t *param = &esp_input_param[i];
+        uint16 start_sec = ESP_INPUT_PARAM_START_SEC + (i * ESP_INPUT_PARAM_SECTORS);
+
+        os_bzero(param, sizeof(struct esp_input_param_t));
+        if (!system_param_load(start_sec, 0, param, sizeof(struct esp_input_param_t))
+            || param->version == 0 || param->version > ESP_INPUT_PARAM_VERSION) {
+            os_printf("Input %d param data is new, initializing...\n", i + 2);
+            os_bzero(param, sizeof(struct esp_input_param_t));
+            param->version = ESP_INPUT_PARAM_VERSION;
+            config_save(i + 1);
+        }
+    }
+    input_count = WB_INPUTS;
+}
+
+/*
+ * Number of wallbox inputs that have somewhere to keep their settings.
+ */
+int ICACHE_FLASH_ATTR user_config_get_input_count(void)
+{
+    return input_count;
+}
+
+/*
+ * Save the settings changed since the last save. The setters only
+ * change the settings in memory, so a batch of changes costs one
+ * sector write for each input they touch, and none if nothing changed.
+ * Settings shared by all the inputs are kept with the first one.
+ */
+void ICACHE_FLASH_ATTR user_config_save(void)
+{
+    int i;
+
+    for (i = 0; i < input_count; i++) {
+        if (config_dirty & CONFIG_DIRTY(i)) {
+            config_save(i);
+        }
+    }
+    config_dirty = 0;
+}
+
+/*
+ * Change a setting of an input, marking it to be saved if it is
+ * not already the same.
+ */
+LOCAL void ICACHE_FLASH_ATTR config_update(int input, void *saved, const void *value, int len)
+{
+    if (os_memcmp(saved, value, len) != 0) {
+        os_memcpy(saved, value, len);
+        config_dirty |= CONFIG_DIRTY(input);
+    }
+}
+
+LOCAL void ICACHE_FLASH_ATTR config_save(int input)
+{
+    if (input == 0) {
+        if (!system_param_save_with_protect(ESP_PARAM_START_SEC, &esp_param, sizeof(esp_param))) {
+            os_printf("system_param_save_with_protect error\n");
+        }
+    } else {
+        uint16 start_sec = ESP_INPUT_PARAM_START_SEC + ((input - 1) * ESP_INPUT_PARAM_SECTORS);
+        if (!system_param_save_with_protect(start_sec,
+            &esp_input_param[input - 1], sizeof(struct esp_input_param_t))) {
+            os_printf("system_param_save_with_protect error\n");
+        }
+    }
 }
 
-void ICACHE_FLASH_ATTR user_config_set_wallbox_type(wallbox_type wallbox)
+void ICACHE_FLASH_ATTR user_config_set_wallbox_type(int input, wallbox_type wallbox)
 {
+    if (input < 0 || input >= input_count) {
+        return;
+    }
+
     if (wallbox < UNKNOWN_WALLBOX || wallbox >= MAX_WALLBOX_TYPES) {
         os_printf("Invalid wallbox type\n");
         return;
     }
 
-    esp_param.wallbox_type = (uint8)wallbox;
-
-    if (!system_param_save_with_protect(ESP_PARAM_START_SEC, &esp_param, sizeof(esp_param))) {
-        os_printf("system_param_save_with_protect error\n");
-    }
+    uint8 value = (uint8)wallbox;
+    config_update(input, (input == 0)
+        ? &esp_param.wallbox_type : &esp_input_param[input - 1].wallbox_type, &value, sizeof(value));
 }
 
-wallbox_type ICACHE_FLASH_ATTR user_config_get_wallbox_type()
+wallbox_type ICACHE_FLASH_ATTR user_config_get_wallbox_type(int input)
 {
-    wallbox_type wallbox = (wallbox_type)esp_param.wallbox_type;
+    if (input < 0 || input >= input_count) {
+        return UNKNOWN_WALLBOX;
+    }
+
+    wallbox_type wallbox = (wallbox_type)((input == 0)
+        ? esp_param.wallbox_type : esp_input_param[input - 1].wallbox_type);
     if (wallbox >= UNKNOWN_WALLBOX && wallbox < MAX_WALLBOX_TYPES) {
         return wallbox;
     } else {
@@ -77,27 +196,99 @@ wallbox_type ICACHE_FLASH_ATTR user_config_get_wallbox_type()
     }
 }
 
-void ICACHE_FLASH_ATTR user_config_set_sonos_uuid(const char *uuid)
+void ICACHE_FLASH_ATTR user_config_set_wallbox_detect_save(bool save)
+{
+    uint8 value = save ? 1 : 0;
+    config_update(0, &esp_param.wallbox_detect_save, &value, sizeof(value));
+}
+
+bool ICACHE_FLASH_ATTR user_config_get_wallbox_detect_save()
+{
+    return esp_param.wallbox_detect_save != 0;
+}
+
+void ICACHE_FLASH_ATTR user_config_set_wallbox_min_pulse(uint8 min_pulse)
+{
+    config_update(0, &esp_param.wallbox_min_pulse, &min_pulse, sizeof(min_pulse));
+}
+
+uint8 ICACHE_FLASH_ATTR user_config_get_wallbox_min_pulse()
+{
+    return esp_param.wallbox_min_pulse;
+}
+
+void ICACHE_FLASH_ATTR user_config_set_credit_gap(uint16 credit_gap)
+{
+    config_update(0, &esp_param.credit_gap, &credit_gap, sizeof(credit_gap));
+}
+
+uint16 ICACHE_FLASH_ATTR user_config_get_credit_gap()
+{
+    return esp_param.credit_gap;
+}
+
+void ICACHE_FLASH_ATTR user_config_set_wb_calibration(int input, const wb_calibration *calibration)
+{
+    if (input < 0 || input >= input_count) {
+        return;
+    }
+
+    wb_calibration value;
+    if (calibration) {
+        os_memcpy(&value, calibration, sizeof(wb_calibration));
+    } else {
+        os_bzero(&value, sizeof(wb_calibration));
+    }
+
+    config_update(input, (input == 0)
+        ? &esp_param.wb_calibration : &esp_input_param[input - 1].wb_calibration,
+        &value, sizeof(wb_calibration));
+}
+
+bool ICACHE_FLASH_ATTR user_config_get_wb_calibration(int input, wb_calibration *calibration)
+{
+    if (!calibration || input < 0 || input >= input_count) {
+        return false;
+    }
+
+    const wb_calibration *saved = (input == 0)
+        ? &esp_param.wb_calibration : &esp_input_param[input - 1].wb_calibration;
+    if (saved->samples == 0) {
+        return false;
+    }
+
+    os_memcpy(calibration, saved, sizeof(wb_calibration));
+    return true;
+}
+
+void ICACHE_FLASH_ATTR user_config_set_sonos_uuid(int input, const char *uuid)
 {
+    if (input < 0 || input >= input_count) {
+        return;
+    }
+
+    char *saved = (input == 0) ? esp_param.sonos_uuid : esp_input_param[input - 1].sonos_uuid;
+    char value[sizeof(esp_param.sonos_uuid)];
     if (uuid && os_strlen(uuid) > sizeof(esp_param.sonos_uuid) - 1) {
         os_printf("UUID too long\n");
         return;
     }
 
-    os_bzero(esp_param.sonos_uuid, sizeof(esp_param.sonos_uuid));
+    os_bzero(value, sizeof(value));
 
     if (uuid && uuid[0] != '\0') {
-        os_strcpy(esp_param.sonos_uuid, uuid);
+        os_strcpy(value, uuid);
     }
 
-    if (!system_param_save_with_protect(ESP_PARAM_START_SEC, &esp_param, sizeof(esp_param))) {
-        os_printf("system_param_save_with_protect error\n");
-    }
+    config_update(input, saved, value, sizeof(value));
 }
 
-const char* ICACHE_FLASH_ATTR user_config_get_sonos_uuid()
+const char* ICACHE_FLASH_ATTR user_config_get_sonos_uuid(int input)
 {
-    return esp_param.sonos_uuid;
+    if (input < 0 || input >= input_count) {
+        return "";
+    }
+    return (input == 0) ? esp_param.sonos_uuid : esp_input_param[input - 1].sonos_uuid;
 }
 
 void ICACHE_FLASH_ATTR user_config_set_sonos_uri_base(const char *uri_base)
@@ -107,15 +298,14 @@ void ICACHE_FLASH_ATTR user_config_set_sonos_uri_base(const char *uri_base)
         return;
     }
 
-    os_bzero(esp_param.sonos_uri_base, sizeof(esp_param.sonos_uri_base));
+    char value[sizeof(esp_param.sonos_uri_base)];
+    os_bzero(value, sizeof(value));
 
     if (uri_base && uri_base[0] != '\0') {
-        os_strcpy(esp_param.sonos_uri_base, uri_base);
+        os_strcpy(value, uri_base);
     }
 
-    if (!system_param_save_with_protect(ESP_PARAM_START_SEC, &esp_param, sizeof(esp_param))) {
-        os_printf("system_param_save_with_protect error\n");
-    }
+    config_update(0, esp_param.sonos_uri_base, value, sizeof(value));
 }
 
 const char* ICACHE_FLASH_ATTR user_config_get_sonos_uri_base()
@@ -123,23 +313,29 @@ const char* ICACHE_FLASH_ATTR user_config_get_sonos_uri_base()
     return esp_param.sonos_uri_base;
 }
 
-void ICACHE_FLASH_ATTR user_config_set_sonos_track_files(char (*track_file)[200][16])
+void ICACHE_FLASH_ATTR user_config_set_sonos_track_files(int input, char (*track_file)[200][16])
 {
     int i;
-    for (i = 0; i < 200; i++) {
-        os_strncpy(esp_param.sonos_track_file[i], (*track_file)[i], 16);
-        esp_param.sonos_track_file[i][15] = '\0';
+
+    if (input < 0 || input >= input_count) {
+        return;
     }
 
-    if (!system_param_save_with_protect(ESP_PARAM_START_SEC, &esp_param, sizeof(esp_param))) {
-        os_printf("system_param_save_with_protect error\n");
+    char (*saved)[16] = (input == 0)
+        ? esp_param.sonos_track_file : esp_input_param[input - 1].sonos_track_file;
+    for (i = 0; i < 200; i++) {
+        char value[16];
+        os_bzero(value, sizeof(value));
+        os_strncpy(value, (*track_file)[i], 15);
+        config_update(input, saved[i], value, sizeof(value));
     }
 }
 
-const char* ICACHE_FLASH_ATTR user_config_get_sonos_track_file(int index)
+const char* ICACHE_FLASH_ATTR user_config_get_sonos_track_file(int input, int index)
 {
-    if (index < 0 || index > 199) {
+    if (input < 0 || input >= input_count || index < 0 || index > 199) {
         return NULL;
     }
-    return esp_param.sonos_track_file[index];
+    return (input == 0)
+        ? esp_param.sonos_track_file[index] : esp_input_param[input - 1].sonos_track_file[index];
 }
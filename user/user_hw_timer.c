@@ -0,0 +1,120 @@
+#include "user_hw_timer.h"
+
+#include <ets_sys.h>
+#include <osapi.h>
+#include <user_interface.h>
+
+/* Hardware timer driver from the SDK driver library */
+typedef enum {
+    FRC1_SOURCE = 0,
+    NMI_SOURCE = 1
+} FRC1_TIMER_SOURCE_TYPE;
+
+void hw_timer_init(FRC1_TIMER_SOURCE_TYPE source_type, u8 req);
+void hw_timer_arm(u32 val);
+void hw_timer_set_func(void (*user_hw_timer_cb_set)(void));
+
+/* Longest interval the hardware timer can be armed for, in microseconds */
+#define HW_TIMER_MAX_US 1600000
+
+/* Shortest interval the hardware timer will be armed for, in microseconds */
+#define HW_TIMER_MIN_US 50
+
+typedef struct hw_timer_entry {
+    bool armed;
+    uint32 deadline; // system time to fire at
+    user_hw_timer_func_t func;
+    void *arg;
+} hw_timer_entry;
+
+LOCAL void hw_timer_isr(void);
+LOCAL void hw_timer_schedule(uint32 now);
+
+LOCAL volatile hw_timer_entry hw_timers[HW_TIMER_SLOTS];
+
+void ICACHE_FLASH_ATTR user_hw_timer_init(void)
+{
+    os_bzero((void *)hw_timers, sizeof(hw_timers));
+
+    hw_timer_init(FRC1_SOURCE, 0);
+    hw_timer_set_func(hw_timer_isr);
+}
+
+/*
+ * Arm a timer slot to fire once after the interval in microseconds,
+ * replacing any previous arming of the slot.
+ */
+void user_hw_timer_arm(user_hw_timer_slot slot, uint32 us, user_hw_timer_func_t func, void *arg)
+{
+    user_hw_timer_arm_at(slot, system_get_time() + us, func, arg);
+}
+
+/*
+ * Arm a timer slot to fire once at the given system time, so the
+ * interval can be measured from an event that has already happened.
+ */
+void user_hw_timer_arm_at(user_hw_timer_slot slot, uint32 deadline, user_hw_timer_func_t func, void *arg)
+{
+    uint32 now = system_get_time();
+
+    ETS_INTR_LOCK();
+    hw_timers[slot].func = func;
+    hw_timers[slot].arg = arg;
+    hw_timers[slot].deadline = deadline;
+    hw_timers[slot].armed = true;
+    hw_timer_schedule(now);
+    ETS_INTR_UNLOCK();
+}
+
+void user_hw_timer_disarm(user_hw_timer_slot slot)
+{
+    // The hardware timer may still fire, but will find nothing due
+    ETS_INTR_LOCK();
+    hw_timers[slot].armed = false;
+    ETS_INTR_UNLOCK();
+}
+
+LOCAL void hw_timer_isr(void)
+{
+    uint32 now = system_get_time();
+    int i;
+
+    for (i = 0; i < HW_TIMER_SLOTS; i++) {
+        volatile hw_timer_entry *entry = &hw_timers[i];
+        if (entry->armed && (sint32)(entry->deadline - now) <= 0) {
+            entry->armed = false;
+            entry->func(entry->arg);
+        }
+    }
+
+    hw_timer_schedule(now);
+}
+
+/*
+ * Arm the hardware timer for the nearest deadline. Deadlines beyond
+ * the range of the hardware timer are reached in several steps.
+ */
+LOCAL void hw_timer_schedule(uint32 now)
+{
+    uint32 wait = HW_TIMER_MAX_US;
+    bool any = false;
+    int i;
+
+    for (i = 0; i < HW_TIMER_SLOTS; i++) {
+        volatile hw_timer_entry *entry = &hw_timers[i];
+        if (entry->armed) {
+            sint32 remaining = (sint32)(entry->deadline - now);
+            if (remaining < HW_TIMER_MIN_US) {
+                remaining = HW_TIMER_MIN_US;
+            }
+            if ((uint32)remaining < wait) {
+                wait = remaining;
+            }
+            any = true;
+        }
+    }
+
+    if (any) {
+        hw_timer_arm(wait);
+    }
+}
@@ -7,8 +7,11 @@
 
 #include "user_config.h"
 #include "user_wb_credit.h"
+#include "user_wb_ledger.h"
 #include "user_wb_selection.h"
+#include "user_hw_timer.h"
 #include "user_webserver.h"
+#include "user_pool.h"
 #include "user_sonos_discovery.h"
 #include "user_sonos_listener.h"
 #include "user_sonos_request.h"
@@ -88,10 +91,13 @@ LOCAL void ICACHE_FLASH_ATTR user_wifi_event_handler(System_Event_t *evt)
 LOCAL void ICACHE_FLASH_ATTR user_sonos_discovery_callback(
     const sonos_device *device, void *user_data)
 {
-    const char *selected_uuid = user_config_get_sonos_uuid();
+    int i;
 
-    if (os_strcmp(device->uuid, selected_uuid) == 0) {
-        user_sonos_client_set_device(selected_uuid);
+    for (i = 0; i < user_config_get_input_count(); i++) {
+        const char *selected_uuid = user_config_get_sonos_uuid(i);
+        if (os_strcmp(device->uuid, selected_uuid) == 0) {
+            user_sonos_client_set_device(i, selected_uuid);
+        }
     }
 }
 
@@ -174,6 +180,8 @@ void ICACHE_FLASH_ATTR user_rf_pre_init(void)
 
 void ICACHE_FLASH_ATTR user_init()
 {
+    int i;
+
     config_mode = false;
 
     // Initialize the serial port
@@ -208,14 +216,19 @@ void ICACHE_FLASH_ATTR user_init()
     // Initialize the application components if we're not in
     // Wi-Fi configuration mode.
     if (!config_mode) {
+        user_hw_timer_init();
+        user_wb_ledger_init();
         user_wb_credit_init();
         user_wb_selection_init();
+        user_pool_init();
         user_sonos_discovery_init();
         user_sonos_listener_init();
         user_sonos_request_init();
         user_sonos_client_init();
 
-        user_wb_set_wallbox_type(user_config_get_wallbox_type());
+        for (i = 0; i < user_config_get_input_count(); i++) {
+            user_wb_set_wallbox_type(i, user_config_get_wallbox_type(i));
+        }
 
         wifi_set_event_handler_cb(user_wifi_event_handler);
         user_sonos_discovery_set_callback(user_sonos_discovery_callback, 0);
@@ -0,0 +1,156 @@
+#include "user_pool.h"
+
+#include <ets_sys.h>
+#include <osapi.h>
+#include <mem.h>
+#include <espconn.h>
+
+typedef struct user_pool {
+    const char *name;
+    uint8 *blocks;
+    void *free_list;   // each free block starts with a pointer to the next
+    uint16 size;
+    uint16 count;
+    uint16 used;
+    uint16 peak;
+    uint32 exhausted;  // allocations refused
+} user_pool;
+
+LOCAL bool ICACHE_FLASH_ATTR pool_contains(const user_pool *pool, const void *block);
+
+LOCAL user_pool pools[MAX_POOLS];
+
+/* Buffers refused for being larger than those of the pool */
+LOCAL uint32 buffer_oversize = 0;
+
+void ICACHE_FLASH_ATTR user_pool_init(void)
+{
+    user_pool_create(POOL_ESPCONN, "espconn", sizeof(struct espconn), USER_POOL_ESPCONN_COUNT);
+    user_pool_create(POOL_TCP, "tcp", sizeof(esp_tcp), USER_POOL_ESPCONN_COUNT);
+    user_pool_create(POOL_BUFFER, "buffer", USER_POOL_BUFFER_SIZE, USER_POOL_BUFFER_COUNT);
+}
+
+/*
+ * Take the blocks for a pool from the heap. A pool that has already
+ * been created is left as it is.
+ */
+bool ICACHE_FLASH_ATTR user_pool_create(user_pool_id id, const char *name, uint16 size, uint16 count)
+{
+    user_pool *pool = &pools[id];
+    int i;
+
+    if (pool->blocks) {
+        return true;
+    }
+
+    // Keep every block aligned for the structure it holds
+    size = (size + 3) & ~3;
+
+    pool->blocks = (uint8 *)os_malloc(size * count);
+    if (!pool->blocks) {
+        os_printf("Cannot allocate pool %s: %d x %d\n", name, count, size);
+        return false;
+    }
+
+    pool->name = name;
+    pool->size = size;
+    pool->count = count;
+    pool->free_list = NULL;
+    for (i = count - 1; i >= 0; i--) {
+        void **block = (void **)(pool->blocks + (i * size));
+        *block = pool->free_list;
+        pool->free_list = block;
+    }
+    return true;
+}
+
+/*
+ * Take a zeroed block from the pool, or NULL if there are none left.
+ */
+void * ICACHE_FLASH_ATTR user_pool_alloc(user_pool_id id)
+{
+    user_pool *pool = &pools[id];
+    void **block = (void **)pool->free_list;
+
+    if (!block) {
+        pool->exhausted++;
+        os_printf("Pool %s exhausted: %d in use\n", pool->name ? pool->name : "?", pool->used);
+        return NULL;
+    }
+
+    pool->free_list = *block;
+    pool->used++;
+    if (pool->used > pool->peak) {
+        pool->peak = pool->used;
+    }
+
+    os_bzero(block, pool->size);
+    return block;
+}
+
+void ICACHE_FLASH_ATTR user_pool_free(user_pool_id id, void *block)
+{
+    user_pool *pool = &pools[id];
+
+    if (!block) {
+        return;
+    }
+    if (!pool_contains(pool, block)) {
+        os_printf("Pool %s: block %p not from the pool\n", pool->name ? pool->name : "?", block);
+        return;
+    }
+
+    *(void **)block = pool->free_list;
+    pool->free_list = block;
+    pool->used--;
+}
+
+/*
+ * Take a buffer of at least the given size. One larger than those of
+ * the pool is refused, and counted, rather than taken from the heap.
+ */
+void * ICACHE_FLASH_ATTR user_pool_buffer_alloc(int size)
+{
+    if (size > USER_POOL_BUFFER_SIZE) {
+        buffer_oversize++;
+        os_printf("Buffer larger than the pool: n=%d\n", size);
+        return NULL;
+    }
+    return user_pool_alloc(POOL_BUFFER);
+}
+
+void ICACHE_FLASH_ATTR user_pool_buffer_free(void *buf)
+{
+    user_pool_free(POOL_BUFFER, buf);
+}
+
+int ICACHE_FLASH_ATTR user_pool_json(char *buf, int buf_len)
+{
+    bool first = true;
+    int n = 0;
+    int i;
+
+    n += os_sprintf(buf + n, "{\"buffer_oversize\": %d, \"pools\": {", buffer_oversize);
+    for (i = 0; i < MAX_POOLS && buf_len - n > 128; i++) {
+        const user_pool *pool = &pools[i];
+        if (!pool->blocks) {
+            continue;
+        }
+        n += os_sprintf(buf + n,
+            "%s\"%s\": {\"size\": %d, \"count\": %d, \"used\": %d, \"peak\": %d, \"exhausted\": %d}",
+            first ? "" : ", ", pool->name, pool->size, pool->count,
+            pool->used, pool->peak, pool->exhausted);
+        first = false;
+    }
+    n += os_sprintf(buf + n, "}}");
+    return n;
+}
+
+LOCAL bool ICACHE_FLASH_ATTR pool_contains(const user_pool *pool, const void *block)
+{
+    const uint8 *ptemp = (const uint8 *)block;
+
+    return pool->blocks && ptemp >= pool->blocks
+        && ptemp < pool->blocks + (pool->size * pool->count)
+        && (ptemp - pool->blocks) % pool->size == 0;
+}
@@ -7,17 +7,53 @@
 #include <user_interface.h>
 #include <espconn.h>
 
+#include "user_config.h"
 #include "user_sonos_discovery.h"
 #include "user_sonos_listener.h"
 #include "user_sonos_request.h"
 #include "user_util.h"
+#include "user_wb_ledger.h"
+
+/* Selections each input can have waiting to be enqueued */
+#define SONOS_PENDING_MAX 4
+
+/*
+ * Ways of getting a selection playing, chosen from the state cached
+ * from the zone's events where it can be relied on.
+ */
+typedef enum sonos_enqueue_path {
+    SONOS_PATH_FULL = 0,    // state unknown, position looked up
+    SONOS_PATH_PLAYING,     // playing the queue, only added
+    SONOS_PATH_IDLE,        // stopped on the added track, played
+    SONOS_PATH_IDLE_SEEK,   // stopped on the queue, skipped to the track and played
+    SONOS_PATH_PAUSED,      // paused on the queue, skipped ahead and played
+    SONOS_PATH_SOURCE,      // on another source, switched to the queue and played
+    SONOS_PATHS
+} sonos_enqueue_path;
 
 typedef struct sonos_enqueue_data {
     sonos_device device;
     uint32 start_time;
     int num_enqueued;
+    sonos_enqueue_path path;
+    sonos_notify_info state;  // cached state the path was chosen from
+    int requests;           // made so far
 } sonos_enqueue_data;
 
+typedef struct sonos_selection {
+    char letter;
+    int number;
+} sonos_selection;
+
+/*
+ * Selections from one input, waiting for their turn to be enqueued.
+ */
+typedef struct sonos_pending_queue {
+    sonos_selection selections[SONOS_PENDING_MAX];
+    int head;
+    int count;
+} sonos_pending_queue;
+
 LOCAL void ICACHE_FLASH_ATTR sonos_listener_callback(const sonos_notify_info *info, void *user_data);
 LOCAL void ICACHE_FLASH_ATTR sonos_add_uri_callback(const sonos_add_uri_info *info, void *user_data, bool success);
 LOCAL void ICACHE_FLASH_ATTR sonos_position_callback(const sonos_position_info *info, void *user_data, bool success);
@@ -25,24 +61,53 @@ LOCAL void ICACHE_FLASH_ATTR sonos_set_transport_callback(void *user_data, bool
 LOCAL void ICACHE_FLASH_ATTR sonos_seek_callback(void *user_data, bool success);
 LOCAL void ICACHE_FLASH_ATTR sonos_play_callback(void *user_data, bool success);
 LOCAL void ICACHE_FLASH_ATTR sonos_enqueue_cleanup(sonos_enqueue_data *enqueue_data);
+LOCAL void ICACHE_FLASH_ATTR sonos_enqueue_next(void);
+LOCAL bool ICACHE_FLASH_ATTR sonos_enqueue_start(int input, char letter, int number);
 LOCAL bool ICACHE_FLASH_ATTR uuid_sid_match(const char *uuid, const char *sid);
+LOCAL sonos_enqueue_path ICACHE_FLASH_ATTR sonos_enqueue_choose_path(const sonos_device *device,
+    sonos_notify_info *state);
+LOCAL void ICACHE_FLASH_ATTR sonos_enqueue_play(sonos_enqueue_data *enqueue_data);
+LOCAL void ICACHE_FLASH_ATTR sonos_enqueue_seek(sonos_enqueue_data *enqueue_data, int track);
 
-LOCAL sonos_device device;
+LOCAL const char *enqueue_path_names[] = {
+    "full", "playing", "idle", "idle_seek", "paused", "source"
+};
+
+LOCAL sonos_device devices[WB_INPUTS];
+LOCAL bool device_set[WB_INPUTS];
 LOCAL sonos_notify_info device_notify_info;
 LOCAL uint32 device_notify_time = 0;
-LOCAL bool device_set = false;
 LOCAL bool enqueue_lock = false;
+LOCAL sonos_pending_queue pending[WB_INPUTS];
+LOCAL int pending_next = 0;
+LOCAL uint32 path_count[SONOS_PATHS];
+LOCAL uint32 path_requests[SONOS_PATHS];
 
 void ICACHE_FLASH_ATTR user_sonos_client_init(void)
 {
-    os_bzero(&device, sizeof(sonos_device));
+    os_bzero(devices, sizeof(devices));
+    os_bzero(device_set, sizeof(device_set));
     os_bzero(&device_notify_info, sizeof(sonos_notify_info));
     device_notify_time = 0;
+    os_bzero(pending, sizeof(pending));
+    os_bzero(path_count, sizeof(path_count));
+    os_bzero(path_requests, sizeof(path_requests));
+    pending_next = 0;
 }
 
-bool ICACHE_FLASH_ATTR user_sonos_client_set_device(const char *uuid)
+/*
+ * Select the zone that plays the selections from an input.
+ * Inputs without a zone of their own play on the zone of the first input.
+ */
+bool ICACHE_FLASH_ATTR user_sonos_client_set_device(int input, const char *uuid)
 {
-    if (device_set && os_strcmp(device.uuid, uuid) == 0) {
+    if (input < 0 || input >= WB_INPUTS) {
+        return false;
+    }
+
+    sonos_device *device = &devices[input];
+
+    if (device_set[input] && os_strcmp(device->uuid, uuid) == 0) {
         os_printf("Device already selected\n");
         return false;
     }
@@ -52,78 +117,131 @@ bool ICACHE_FLASH_ATTR user_sonos_client_set_device(const char *uuid)
         return false;
     }
 
-    int result = user_sonos_discovery_get_device_by_uuid(&device, uuid);
+    int result = user_sonos_discovery_get_device_by_uuid(device, uuid);
     if (result == 1) {
-        os_printf("Device selected: \"%s\" -> " IPSTR ":%d\n",
-            device.zone_name, IP2STR(device.ip), device.port);
-        device_set = true;
+        os_printf("Device selected for input %d: \"%s\" -> " IPSTR ":%d\n",
+            input + 1, device->zone_name, IP2STR(device->ip), device->port);
+        device_set[input] = true;
     } else if (result == 0) {
         os_printf("Unable to find device: \"%s\"\n", uuid);
     } else {
         os_printf("Device selection error\n");
     }
 
-    if (device_set) {
+    // The listener follows a single zone, so only the first input's
+    // zone gets the transport state used to resume paused playback.
+    if (device_set[input] && input == 0) {
         os_bzero(&device_notify_info, sizeof(sonos_notify_info));
         device_notify_time = 0;
-        user_sonos_listener_subscribe(&device);
+        user_sonos_listener_subscribe(device);
         user_sonos_listener_set_callback(sonos_listener_callback, NULL);
     }
 
-    return device_set;
+    return device_set[input];
 }
 
-bool user_sonos_client_get_device(sonos_device *device_info)
+bool ICACHE_FLASH_ATTR user_sonos_client_get_device(int input, sonos_device *device_info)
 {
-    if (!device_set || !device_info) {
+    if (input < 0 || input >= WB_INPUTS || !device_set[input] || !device_info) {
         return false;
     }
 
-    os_memcpy(device_info, &device, sizeof(sonos_device));
+    os_memcpy(device_info, &devices[input], sizeof(sonos_device));
     return true;
 }
 
-void ICACHE_FLASH_ATTR user_sonos_client_enqueue(char letter, int number)
+/*
+ * Queue a selection from an input to be enqueued on its zone.
+ * Inputs take turns, so a busy input cannot hold up the others.
+ */
+void ICACHE_FLASH_ATTR user_sonos_client_enqueue(int input, char letter, int number)
+{
+    if (input < 0 || input >= WB_INPUTS) {
+        return;
+    }
+
+    sonos_pending_queue *queue = &pending[input];
+    if (queue->count == SONOS_PENDING_MAX) {
+        os_printf("Selection queue full for input %d\n", input + 1);
+        return;
+    }
+
+    sonos_selection *selection = &queue->selections[(queue->head + queue->count) % SONOS_PENDING_MAX];
+    selection->letter = letter;
+    selection->number = number;
+    queue->count++;
+
+    user_wb_ledger_play(letter, number);
+
+    sonos_enqueue_next();
+}
+
+/*
+ * Start on the next waiting selection, if nothing is being enqueued,
+ * taking the inputs in turn.
+ */
+LOCAL void ICACHE_FLASH_ATTR sonos_enqueue_next(void)
+{
+    int idle = 0;
+
+    while (!enqueue_lock && idle < WB_INPUTS) {
+        int input = pending_next;
+        sonos_pending_queue *queue = &pending[input];
+        pending_next = (input + 1) % WB_INPUTS;
+
+        if (queue->count == 0) {
+            idle++;
+            continue;
+        }
+
+        sonos_selection selection = queue->selections[queue->head];
+        queue->head = (queue->head + 1) % SONOS_PENDING_MAX;
+        queue->count--;
+        idle = 0;
+
+        sonos_enqueue_start(input, selection.letter, selection.number);
+    }
+}
+
+LOCAL bool ICACHE_FLASH_ATTR sonos_enqueue_start(int input, char letter, int number)
 {
     LOCAL const char URI_SCHEME[] = "x-file-cifs:";
     char uri_buf[512];
     int n = 0;
 
-    if (!device_set) {
+    const sonos_device *device = device_set[input] ? &devices[input]
+        : (device_set[0] ? &devices[0] : NULL);
+    if (!device) {
         os_printf("Device not selected\n");
-        return;
-    }
-
-    if (enqueue_lock) {
-        os_printf("Track enqueue in progress\n");
-        return;
+        return false;
     }
 
     const char *uri_base = user_config_get_sonos_uri_base();
     if (!uri_base || os_strlen(uri_base) == 0) {
         os_printf("No URI base configured\n");
-        return;
+        return false;
     }
 
     const int track_index = wb_selection_to_index(letter, number);
     if (track_index < 0) {
         os_printf("Invalid track selection\n");
-        return;
+        return false;
     }
 
-    const char *track_file = user_config_get_sonos_track_file(track_index);
+    const char *track_file = user_config_get_sonos_track_file(input, track_index);
     if (!track_file || os_strlen(track_file) == 0) {
         os_printf("No configured track file\n");
-        return;
+        return false;
     }
 
     sonos_enqueue_data *enqueue_data = (sonos_enqueue_data *)os_zalloc(sizeof(sonos_enqueue_data));
     if (!enqueue_data) {
-        return;
+        return false;
     }
 
-    os_memcpy(&enqueue_data->device, &device, sizeof(sonos_device));
+    os_memcpy(&enqueue_data->device, device, sizeof(sonos_device));
     enqueue_data->start_time = system_get_time();
+    enqueue_data->path = sonos_enqueue_choose_path(device, &enqueue_data->state);
 
     // Combine the URI elements into a complete URI
     os_strcpy(uri_buf, URI_SCHEME);
@@ -137,10 +255,16 @@ void ICACHE_FLASH_ATTR user_sonos_client_enqueue(char letter, int number)
 
     os_printf("Enqueue URI: \"%s\"\n", uri_buf);
 
-    user_sonos_request_add_uri(&enqueue_data->device, uri_buf,
-        sonos_add_uri_callback, enqueue_data);
-
+    // Lock first, in case the request completes straight away
     enqueue_lock = true;
+
+    if (!user_sonos_request_add_uri(&enqueue_data->device, uri_buf,
+        sonos_add_uri_callback, enqueue_data)) {
+        os_free(enqueue_data);
+        enqueue_lock = false;
+        return false;
+    }
+    return true;
 }
 
 LOCAL void ICACHE_FLASH_ATTR sonos_listener_callback(const sonos_notify_info *info, void *user_data)
@@ -148,8 +272,26 @@ LOCAL void ICACHE_FLASH_ATTR sonos_listener_callback(const sonos_notify_info *in
     os_printf("sonos_listener_callback\n");
     if (!info) { return; }
 
-    if (uuid_sid_match(device.uuid, info->subscribe_id)) {
-        os_memcpy(&device_notify_info, info, sizeof(sonos_notify_info));
+    if (uuid_sid_match(devices[0].uuid, info->subscribe_id)) {
+        // Events only carry what changed, so keep the rest
+        if (!uuid_sid_match(devices[0].uuid, device_notify_info.subscribe_id)) {
+            os_bzero(&device_notify_info, sizeof(sonos_notify_info));
+            device_notify_info.number_of_tracks = -1;
+            device_notify_info.current_track = -1;
+        }
+        os_memcpy(device_notify_info.subscribe_id, info->subscribe_id, sizeof(info->subscribe_id));
+        if (info->transport_state != UNKNOWN) {
+            device_notify_info.transport_state = info->transport_state;
+        }
+        if (info->number_of_tracks >= 0) {
+            device_notify_info.number_of_tracks = info->number_of_tracks;
+        }
+        if (info->current_track >= 0) {
+            device_notify_info.current_track = info->current_track;
+        }
+        if (info->transport_uri[0] != '\0') {
+            os_strcpy(device_notify_info.transport_uri, info->transport_uri);
+        }
         device_notify_time = system_get_time();
     }
 }
@@ -159,6 +301,10 @@ LOCAL void ICACHE_FLASH_ATTR sonos_add_uri_callback(const sonos_add_uri_info *in
     sonos_enqueue_data *enqueue_data = (sonos_enqueue_data *)user_data;
     os_printf("sonos_add_uri_callback, success=%d\n", success);
 
+    if (enqueue_data) {
+        enqueue_data->requests++;
+    }
+
     if (!success || !info || !enqueue_data) {
         sonos_enqueue_cleanup(enqueue_data);
         return;
@@ -172,8 +318,40 @@ LOCAL void ICACHE_FLASH_ATTR sonos_add_uri_callback(const sonos_add_uri_info *in
     #endif
     enqueue_data->num_enqueued = info->first_track_num_enqueued;
 
-    user_sonos_request_get_position_info(&enqueue_data->device,
-        sonos_position_callback, enqueue_data);
+    switch (enqueue_data->path) {
+    case SONOS_PATH_PLAYING:
+        // Already playing the queue, the track will come up in turn
+        sonos_enqueue_cleanup(enqueue_data);
+        break;
+    case SONOS_PATH_IDLE:
+        if (enqueue_data->state.current_track == enqueue_data->num_enqueued) {
+            sonos_enqueue_play(enqueue_data);
+        } else {
+            enqueue_data->path = SONOS_PATH_IDLE_SEEK;
+            sonos_enqueue_seek(enqueue_data, enqueue_data->num_enqueued);
+        }
+        break;
+    case SONOS_PATH_PAUSED:
+        // Skip ahead once, same as when the position is looked up
+        if (enqueue_data->state.current_track < enqueue_data->num_enqueued) {
+            sonos_enqueue_seek(enqueue_data, enqueue_data->state.current_track + 1);
+        } else {
+            sonos_enqueue_seek(enqueue_data, enqueue_data->num_enqueued);
+        }
+        break;
+    case SONOS_PATH_SOURCE:
+        if (!user_sonos_request_set_transport(&enqueue_data->device,
+                sonos_set_transport_callback, enqueue_data)) {
+            sonos_enqueue_cleanup(enqueue_data);
+        }
+        break;
+    default:
+        if (!user_sonos_request_get_position_info(&enqueue_data->device,
+                sonos_position_callback, enqueue_data)) {
+            sonos_enqueue_cleanup(enqueue_data);
+        }
+        break;
+    }
 }
 
 LOCAL void ICACHE_FLASH_ATTR sonos_position_callback(const sonos_position_info *info, void *user_data, bool success)
@@ -181,6 +359,10 @@ LOCAL void ICACHE_FLASH_ATTR sonos_position_callback(const sonos_position_info *
     sonos_enqueue_data *enqueue_data = (sonos_enqueue_data *)user_data;
     os_printf("sonos_position_callback, success=%d\n", success);
 
+    if (enqueue_data) {
+        enqueue_data->requests++;
+    }
+
     if (!success || !info || !enqueue_data) {
         sonos_enqueue_cleanup(enqueue_data);
         return;
@@ -205,23 +387,22 @@ LOCAL void ICACHE_FLASH_ATTR sonos_position_callback(const sonos_position_info *
     }
     
     if (need_set_transport) {
-        user_sonos_request_set_transport(&enqueue_data->device,
-            sonos_set_transport_callback, enqueue_data);
+        if (!user_sonos_request_set_transport(&enqueue_data->device,
+                sonos_set_transport_callback, enqueue_data)) {
+            sonos_enqueue_cleanup(enqueue_data);
+        }
     } else {
         // Not currently playing
         if (info->track == 0 && info->track_duration == 0 && info->rel_time == 0) {
-            user_sonos_request_play(&enqueue_data->device,
-                sonos_play_callback, enqueue_data);
+            sonos_enqueue_play(enqueue_data);
         }
         // On added track, likely not currently playing
         else if (info->track == enqueue_data->num_enqueued && info->rel_time == 0) {
-            user_sonos_request_play(&enqueue_data->device,
-                sonos_play_callback, enqueue_data);
+            sonos_enqueue_play(enqueue_data);
         }
         // On a previous track, likely not currently playing
         else if(info->track < enqueue_data->num_enqueued && info->rel_time == 0) {
-            user_sonos_request_seek_track(&enqueue_data->device, enqueue_data->num_enqueued,
-                sonos_seek_callback, enqueue_data);
+            sonos_enqueue_seek(enqueue_data, enqueue_data->num_enqueued);
         }
         // On a previous track, likely paused
         else if(device_notify_time > 0 && (system_get_time() - device_notify_time < 600000000)
@@ -235,13 +416,11 @@ LOCAL void ICACHE_FLASH_ATTR sonos_position_callback(const sonos_position_info *
 
             if (info->track < enqueue_data->num_enqueued) {
                 // If the added track is greater than the paused track, skip ahead once
-                user_sonos_request_seek_track(&enqueue_data->device, info->track + 1,
-                    sonos_seek_callback, enqueue_data);
+                sonos_enqueue_seek(enqueue_data, info->track + 1);
             }
             else {
                 // Otherwise, just skip to the added track
-                user_sonos_request_seek_track(&enqueue_data->device, enqueue_data->num_enqueued,
-                    sonos_seek_callback, enqueue_data);
+                sonos_enqueue_seek(enqueue_data, enqueue_data->num_enqueued);
             }
         }
         // Likely currently playing, no need for more commands
@@ -256,12 +435,16 @@ LOCAL void ICACHE_FLASH_ATTR sonos_set_transport_callback(void *user_data, bool
     sonos_enqueue_data *enqueue_data = (sonos_enqueue_data *)user_data;
     os_printf("sonos_set_transport_callback, success=%d\n", success);
 
+    if (enqueue_data) {
+        enqueue_data->requests++;
+    }
+
     if (!success || !enqueue_data) {
         sonos_enqueue_cleanup(enqueue_data);
         return;
     }
 
-    user_sonos_request_play(&enqueue_data->device, sonos_play_callback, enqueue_data);
+    sonos_enqueue_play(enqueue_data);
 }
 
 LOCAL void ICACHE_FLASH_ATTR sonos_seek_callback(void *user_data, bool success)
@@ -269,12 +452,16 @@ LOCAL void ICACHE_FLASH_ATTR sonos_seek_callback(void *user_data, bool success)
     sonos_enqueue_data *enqueue_data = (sonos_enqueue_data *)user_data;
     os_printf("sonos_seek_callback, success=%d\n", success);
 
+    if (enqueue_data) {
+        enqueue_data->requests++;
+    }
+
     if (!success || !enqueue_data) {
         sonos_enqueue_cleanup(enqueue_data);
         return;
     }
 
-    user_sonos_request_play(&enqueue_data->device, sonos_play_callback, enqueue_data);
+    sonos_enqueue_play(enqueue_data);
 }
 
 LOCAL void ICACHE_FLASH_ATTR sonos_play_callback(void *user_data, bool success)
@@ -282,15 +469,95 @@ LOCAL void ICACHE_FLASH_ATTR sonos_play_callback(void *user_data, bool success)
     sonos_enqueue_data *enqueue_data = (sonos_enqueue_data *)user_data;
     os_printf("sonos_play_callback, success=%d\n", success);
 
+    if (enqueue_data) {
+        enqueue_data->requests++;
+    }
+
     sonos_enqueue_cleanup(enqueue_data);
 }
 
+LOCAL void ICACHE_FLASH_ATTR sonos_enqueue_play(sonos_enqueue_data *enqueue_data)
+{
+    if (!user_sonos_request_play(&enqueue_data->device, sonos_play_callback, enqueue_data)) {
+        sonos_enqueue_cleanup(enqueue_data);
+    }
+}
+
+LOCAL void ICACHE_FLASH_ATTR sonos_enqueue_seek(sonos_enqueue_data *enqueue_data, int track)
+{
+    if (!user_sonos_request_seek_track(&enqueue_data->device, track,
+            sonos_seek_callback, enqueue_data)) {
+        sonos_enqueue_cleanup(enqueue_data);
+    }
+}
+
+/*
+ * Decide up front how to get the selection playing, if the zone's
+ * events are being received and have told enough of its state.
+ */
+LOCAL sonos_enqueue_path ICACHE_FLASH_ATTR sonos_enqueue_choose_path(const sonos_device *device,
+    sonos_notify_info *state)
+{
+    char queue_uri[96];
+
+    if (!user_sonos_listener_subscribed(device->uuid)
+        || !uuid_sid_match(device->uuid, device_notify_info.subscribe_id)) {
+        return SONOS_PATH_FULL;
+    }
+
+    os_memcpy(state, &device_notify_info, sizeof(sonos_notify_info));
+    if (state->transport_state == UNKNOWN || state->transport_uri[0] == '\0'
+        || state->current_track < 0) {
+        return SONOS_PATH_FULL;
+    }
+
+    os_sprintf(queue_uri, "x-rincon-queue:%s#0", device->uuid);
+    if (os_strcmp(state->transport_uri, queue_uri) != 0) {
+        return SONOS_PATH_SOURCE;
+    }
+
+    switch (state->transport_state) {
+    case PLAYING:
+        return SONOS_PATH_PLAYING;
+    case STOPPED:
+        return SONOS_PATH_IDLE;
+    case PAUSED_PLAYBACK:
+        return SONOS_PATH_PAUSED;
+    default:
+        return SONOS_PATH_FULL;
+    }
+}
+
+/*
+ * Write the number of selections that took each path, and the
+ * requests they made, as JSON.
+ */
+int ICACHE_FLASH_ATTR user_sonos_client_paths_json(char *buf, int buf_len)
+{
+    int n = 0;
+    int i;
+
+    n += os_sprintf(buf + n, "{");
+    for (i = 0; i < SONOS_PATHS && buf_len - n > 64; i++) {
+        n += os_sprintf(buf + n, "%s\"%s\": {\"count\": %d, \"requests\": %d}",
+            (i > 0) ? ", " : "", enqueue_path_names[i], path_count[i], path_requests[i]);
+    }
+    n += os_sprintf(buf + n, "}");
+    return n;
+}
+
 LOCAL void ICACHE_FLASH_ATTR sonos_enqueue_cleanup(sonos_enqueue_data *enqueue_data)
 {
     if (enqueue_data) {
+        os_printf("Enqueue took %d requests, path %s\n",
+            enqueue_data->requests, enqueue_path_names[enqueue_data->path]);
+        path_count[enqueue_data->path]++;
+        path_requests[enqueue_data->path] += enqueue_data->requests;
         os_free(enqueue_data);
     }
-    enqueue_lock = false;    
+    enqueue_lock = false;
+
+    sonos_enqueue_next();
 }
 
 LOCAL bool ICACHE_FLASH_ATTR uuid_sid_match(const char *uuid, const char *sid)
@@ -12,28 +12,21 @@
 #include <stdlib.h>
 
 #include "user_util.h"
+#include "user_sonos_request.h"
 
 #define SSDP_PORT 1900
 #define LOCAL_PORT 53000
 #define SSDP_REQUEST_TIMEOUT 5000
-#define PACKET_SIZE (2 * 1024)
 
 struct sonos_device_node {
     sonos_device device;
     bool zp_request_sent;
-    char *zp_response_buf;
-    size_t zp_response_len;
     SLIST_ENTRY(sonos_device_node) next;
 };
 
 LOCAL void ICACHE_FLASH_ATTR ssdp_recv_callback(void *arg, char *pusrdata, unsigned short length);
 LOCAL void ICACHE_FLASH_ATTR ssdp_request_timer_callback(void);
-LOCAL void ICACHE_FLASH_ATTR zp_request_connect_callback(void *arg);
-LOCAL void ICACHE_FLASH_ATTR zp_request_disconnect_callback(void *arg);
-LOCAL void ICACHE_FLASH_ATTR zp_request_reconnect_callback(void *arg, sint8 err);
-LOCAL void ICACHE_FLASH_ATTR zp_request_sent_callback(void *arg);
-LOCAL void ICACHE_FLASH_ATTR zp_request_recv_callback(void *arg, char *pusrdata, unsigned short length);
-LOCAL void ICACHE_FLASH_ATTR free_tcp_connection(struct espconn *pespconn);
+LOCAL void ICACHE_FLASH_ATTR zp_request_callback(const sonos_zone_info *info, void *user_data, bool success);
 
 LOCAL esp_udp ssdp_listener_udp;
 LOCAL struct espconn ssdp_listener_conn;
@@ -406,117 +399,24 @@ LOCAL void ICACHE_FLASH_ATTR ssdp_recv_callback(void *arg, char *pusrdata, unsig
 
     if (np->device.zone_name[0] == '\0' && !(np->zp_request_sent)) {
         //os_printf("Requesting ZP info\n");
-        np->zp_request_sent = true;
-        struct espconn *pespconn = (struct espconn *)os_zalloc(sizeof(struct espconn));
-        pespconn->type = ESPCONN_TCP;
-        pespconn->state = ESPCONN_NONE;
-        pespconn->proto.tcp = (esp_tcp *)os_zalloc(sizeof(esp_tcp));
-        pespconn->proto.tcp->local_port = espconn_port();
-        pespconn->proto.tcp->remote_port = np->device.port;
-        os_memcpy(pespconn->proto.tcp->remote_ip, np->device.ip, 4);
-        espconn_regist_connectcb(pespconn, zp_request_connect_callback);
-        espconn_regist_disconcb(pespconn, zp_request_disconnect_callback);
-        espconn_regist_reconcb(pespconn, zp_request_reconnect_callback);
-        pespconn->reverse = np;
-        espconn_connect(pespconn);
+        // Sent behind any playback or subscription requests
+        np->zp_request_sent = user_sonos_request_get_zone_info(&np->device, zp_request_callback, np);
     }
 }
 
-LOCAL void ICACHE_FLASH_ATTR zp_request_connect_callback(void *arg)
+LOCAL void ICACHE_FLASH_ATTR zp_request_callback(const sonos_zone_info *info, void *user_data, bool success)
 {
-    struct espconn *pespconn = (struct espconn *)arg;
+    struct sonos_device_node *np = (struct sonos_device_node *)user_data;
 
-    //os_printf("zp_request_connect_callback\n");
+    np->zp_request_sent = false;
 
-    espconn_regist_sentcb(pespconn, zp_request_sent_callback);
-    espconn_regist_recvcb(pespconn, zp_request_recv_callback);
+    if (success && info && info->zone_name[0] != '\0') {
+        os_strcpy(np->device.zone_name, info->zone_name);
 
-    char *payload_buf = (char *)os_zalloc(PACKET_SIZE);
-    if (!payload_buf) {
-        return;
-    }
-
-    os_sprintf(payload_buf,
-        "GET /status/zp HTTP/1.1\r\n"
-        "Host: " IPSTR ":%d\r\n"
-        "User-Agent: lwIP/1.4.0\r\n"
-        "Connection: close\r\n"
-        "Cache-Control: no-cache\r\n"
-        "\r\n",
-        IP2STR(pespconn->proto.tcp->remote_ip),
-        pespconn->proto.tcp->remote_port);
-
-    espconn_sent(pespconn, (uint8 *)payload_buf, os_strlen(payload_buf));
-
-    os_free(payload_buf);
-}
-
-LOCAL void ICACHE_FLASH_ATTR zp_request_sent_callback(void *arg)
-{
-    //os_printf("zp_request_sent_callback\n");
-}
-
-LOCAL void ICACHE_FLASH_ATTR zp_request_recv_callback(void *arg, char *pusrdata, unsigned short length)
-{
-    struct espconn *pespconn = (struct espconn *)arg;
-    struct sonos_device_node *np = (struct sonos_device_node *)pespconn->reverse;
-
-    //os_printf("zp_request_recv_callback: len=%d\n", length);
-
-    if (pusrdata && length > 0) {
-        if (!np->zp_response_buf) {
-            np->zp_response_buf = (char *)os_malloc(PACKET_SIZE);
-            np->zp_response_len = 0;
-        }
-        int n = MIN(length, PACKET_SIZE - np->zp_response_len - 1);
-        if (n > 0) {
-            os_memcpy(np->zp_response_buf + np->zp_response_len, pusrdata, n);
-            np->zp_response_len += n;
-            np->zp_response_buf[np->zp_response_len] = '\0';
-        }
-    }
-}
-
-LOCAL void ICACHE_FLASH_ATTR zp_request_disconnect_callback(void *arg)
-{
-    struct espconn *pespconn = (struct espconn *)arg;
-    struct sonos_device_node *np = (struct sonos_device_node *)pespconn->reverse;
-    char *ptemp = NULL;
-    char *qtemp = NULL;
-
-    //os_printf("zp_request_disconnect_callback\n");
-
-    if (np && np->zp_response_buf && np->zp_response_len > 0) {
-        ptemp = np->zp_response_buf;
-        if (np->zp_response_len > 17 && os_strncmp(ptemp, "HTTP/1.1 200 OK\r\n", 17) == 0) {
-            ptemp += 17;
-            ptemp = (char *)os_strstr(ptemp, "<ZoneName>");
-            if (ptemp) {
-                ptemp += 10;
-                qtemp = (char *)os_strstr(ptemp, "</ZoneName>");
-                if (qtemp) {
-                    int n = MIN(qtemp - ptemp, 127);
-                    os_memcpy(np->device.zone_name, ptemp, n);
-                    np->device.zone_name[n] = '\0';
-                }
-            }
-        }
-
-        if(discovery_callback && os_strlen(np->device.zone_name) > 0) {
+        if (discovery_callback) {
             discovery_callback(&np->device, discovery_callback_user_data);
         }
     }
-
-    free_tcp_connection(pespconn);
-}
-
-LOCAL void ICACHE_FLASH_ATTR zp_request_reconnect_callback(void *arg, sint8 err)
-{
-    struct espconn *pespconn = (struct espconn *)arg;
-
-    os_printf("zp_request_reconnect_callback, err=%d\n", err);
-
-    free_tcp_connection(pespconn);
 }
 
 LOCAL void ICACHE_FLASH_ATTR ssdp_request_timer_callback(void)
@@ -539,22 +439,3 @@ LOCAL void ICACHE_FLASH_ATTR ssdp_request_timer_callback(void)
     }
 #endif
 }
-
-LOCAL void ICACHE_FLASH_ATTR free_tcp_connection(struct espconn *pespconn)
-{
-    if (pespconn) {
-        struct sonos_device_node *np = (struct sonos_device_node *)pespconn->reverse;
-        if (np->zp_response_buf) {
-            os_free(np->zp_response_buf);
-            np->zp_response_buf = NULL;
-        }
-        np->zp_response_len = 0;
-        np->zp_request_sent = false;
-        pespconn->reverse = NULL;
-
-        if (pespconn->proto.tcp) {
-            os_free(pespconn->proto.tcp);
-        }
-        os_free(pespconn);
-    }
-}
@@ -7,26 +7,55 @@
 #include <user_interface.h>
 #include <espconn.h>
 #include <limits.h>
-#include <sys/param.h>
+#include <stddef.h>
 #include <stdlib.h>
 
 #include "user_sonos_request.h"
-#include "user_util.h"
+#include "user_sonos_response.h"
+#include "user_pool.h"
 
 #define LISTENER_PORT 3400
 #define SUBSCRIBE_TIMEOUT_SECS 600
-#define PACKET_SIZE 1024
 
+/* Notifications that can be received at once */
+#define LISTENER_CONNECTIONS 2
+
+/*
+ * The whole notification is parsed as it arrives, so only the header
+ * values and the values wanted from the body are kept.
+ */
 typedef struct sonos_notification {
+    char request_line[32];
     char subscribe_id[64];
-    char *payload_buf;
-    int payload_len;
-    int payload_max;
+    char nt[16];
+    char nts[24];
     bool has_header;
     bool error;
+    sonos_response body;
+    sonos_notify_info info;
+    char transport_state[16];
     os_timer_t disconnect_timer;
 } sonos_notification;
 
+#define NOTIFY_OFFSET(member) offsetof(sonos_notification, member)
+
+LOCAL const sonos_response_field notify_fields[] = {
+    {"", RESPONSE_START, RESPONSE_TEXT, NOTIFY_OFFSET(request_line),
+        sizeof(((sonos_notification *)0)->request_line)},
+    {"SID:", RESPONSE_HEADER, RESPONSE_TEXT, NOTIFY_OFFSET(subscribe_id),
+        sizeof(((sonos_notification *)0)->subscribe_id)},
+    {"NT:", RESPONSE_HEADER, RESPONSE_TEXT, NOTIFY_OFFSET(nt),
+        sizeof(((sonos_notification *)0)->nt)},
+    {"NTS:", RESPONSE_HEADER, RESPONSE_TEXT, NOTIFY_OFFSET(nts),
+        sizeof(((sonos_notification *)0)->nts)},
+    {"TransportState", RESPONSE_VALUE, RESPONSE_TEXT, NOTIFY_OFFSET(transport_state),
+        sizeof(((sonos_notification *)0)->transport_state)},
+    {"NumberOfTracks", RESPONSE_VALUE, RESPONSE_INT, NOTIFY_OFFSET(info.number_of_tracks), 0},
+    {"CurrentTrack", RESPONSE_VALUE, RESPONSE_INT, NOTIFY_OFFSET(info.current_track), 0},
+    {"AVTransportURI", RESPONSE_VALUE, RESPONSE_TEXT, NOTIFY_OFFSET(info.transport_uri),
+        sizeof(((sonos_notify_info *)0)->transport_uri)}
+};
+
 LOCAL void ICACHE_FLASH_ATTR subscribe_request_callback(
     const sonos_subscribe_info *info, void *user_data, bool success);
 LOCAL void ICACHE_FLASH_ATTR resubscribe_timer_callback(void *arg);
@@ -34,6 +63,7 @@ LOCAL void ICACHE_FLASH_ATTR sonos_listener_connect_callback(void *arg);
 LOCAL void ICACHE_FLASH_ATTR sonos_listener_reconnect_callback(void *arg, sint8 err);
 LOCAL void ICACHE_FLASH_ATTR sonos_listener_disconnect_callback(void *arg);
 LOCAL void ICACHE_FLASH_ATTR sonos_listener_recv_callback(void *arg, char *pusrdata, unsigned short length);
+LOCAL bool ICACHE_FLASH_ATTR sonos_listener_header(sonos_notification *sn);
 LOCAL void ICACHE_FLASH_ATTR sonos_listener_disconnect_wait(void *arg);
 LOCAL void ICACHE_FLASH_ATTR free_listener_connection(struct espconn *pespconn);
 
@@ -51,6 +81,9 @@ void ICACHE_FLASH_ATTR user_sonos_listener_init(void)
     os_bzero(&subscribed_device, sizeof(sonos_device));
     os_bzero(&subscribe_info, sizeof(sonos_subscribe_info));
 
+    user_pool_create(POOL_SONOS_NOTIFICATION, "sonos_notification",
+        sizeof(sonos_notification), LISTENER_CONNECTIONS);
+
     // Create a listener for Sonos notifications
     os_bzero(&sonos_listener_tcp, sizeof(esp_tcp));
     sonos_listener_tcp.local_port = LISTENER_PORT;
@@ -75,8 +108,10 @@ void ICACHE_FLASH_ATTR user_sonos_listener_subscribe(const sonos_device *device)
     os_printf("user_sonos_listener_subscribe\n");
 
     if (subscribe_request_lock == 1) {
-        os_printf("Subscription in progress\n");
-        return;
+        // The zone has changed since, so the answer is of no use
+        os_printf("Cancelling subscription in progress\n");
+        user_sonos_request_cancel(&subscribed_device);
+        subscribe_request_lock = 0;
     }
 
     struct ip_info ipconfig;
@@ -95,7 +130,7 @@ void ICACHE_FLASH_ATTR user_sonos_listener_subscribe(const sonos_device *device)
 
     if (!user_sonos_request_subscribe(device,
         local_ip, LISTENER_PORT, SUBSCRIBE_TIMEOUT_SECS,
-        subscribe_request_callback, 0)) {
+        subscribe_request_callback, &subscribed_device)) {
         return;
     }
 
@@ -105,6 +140,16 @@ void ICACHE_FLASH_ATTR user_sonos_listener_subscribe(const sonos_device *device)
     subscribe_request_lock = 1;
 }
 
+/*
+ * Check whether events are being received from the zone, so the state
+ * they carried can be relied on.
+ */
+bool ICACHE_FLASH_ATTR user_sonos_listener_subscribed(const char *uuid)
+{
+    return subscribe_info.subscribe_id[0] != '\0'
+        && os_strcmp(subscribed_device.uuid, uuid) == 0;
+}
+
 LOCAL void ICACHE_FLASH_ATTR subscribe_request_callback(
     const sonos_subscribe_info *info, void *user_data, bool success)
 {
@@ -156,7 +201,7 @@ LOCAL void ICACHE_FLASH_ATTR resubscribe_timer_callback(void *arg)
 
     if (!user_sonos_request_resubscribe(&subscribed_device,
         subscribe_info.subscribe_id, SUBSCRIBE_TIMEOUT_SECS,
-        subscribe_request_callback, 0)) {
+        subscribe_request_callback, &subscribed_device)) {
         return;
     }
 
@@ -174,12 +219,19 @@ LOCAL void ICACHE_FLASH_ATTR sonos_listener_connect_callback(void *arg)
         pesp_conn->proto.tcp->remote_ip[3],
         pesp_conn->proto.tcp->remote_port);
 
-    sonos_notification *sn = (sonos_notification *)os_zalloc(sizeof(sonos_notification));
+    sonos_notification *sn = (sonos_notification *)user_pool_alloc(POOL_SONOS_NOTIFICATION);
     if (!sn) {
         return;
     }
     pesp_conn->reverse = sn;
 
+    // Only what changed is in the event, so anything else stays unknown
+    sn->info.number_of_tracks = -1;
+    sn->info.current_track = -1;
+    sonos_response_init(&sn->body, notify_fields,
+        sizeof(notify_fields) / sizeof(notify_fields[0]), sn);
+    sn->body.unescape = true;
+
     espconn_regist_recvcb(pesp_conn, sonos_listener_recv_callback);
     espconn_regist_reconcb(pesp_conn, sonos_listener_reconnect_callback);
     espconn_regist_disconcb(pesp_conn, sonos_listener_disconnect_callback);
@@ -218,83 +270,31 @@ LOCAL void ICACHE_FLASH_ATTR sonos_listener_disconnect_callback(void *arg)
         return;
     }
 
-    if (!sn->error && sn->has_header && sn->subscribe_id[0] != '\0' && sn->payload_len > 0) {
-        LOCAL const char start_tags[] =
-            "<e:propertyset xmlns:e=\"urn:schemas-upnp-org:event-1-0\"><e:property><LastChange>";
-        LOCAL const char end_tags[] =
-            "</LastChange></e:property></e:propertyset>";
-
-        char *pstart = (char *)os_strstr(sn->payload_buf, start_tags);
-        char *pend = (char *)os_strstr(sn->payload_buf, end_tags);
-        if (pstart && pend && pstart < pend) {
-            pstart += os_strlen(start_tags);
-            int n = pend - pstart;
-
-            unescape_html_entities(pstart, n);
-
-            sonos_notify_info info;
-            os_bzero(&info, sizeof(sonos_notify_info));
-
-            os_memcpy(info.subscribe_id, sn->subscribe_id, sizeof(info.subscribe_id));
-
-            char *ptemp = NULL;
-            char *qtemp = NULL;
-            ptemp = (char *)os_strstr(pstart, "<TransportState val=\"");
-            if (ptemp) {
-                ptemp += 21;
-                qtemp = (char *)os_strstr(ptemp, "\"/>");
-                if (qtemp) {
-                    n = qtemp - ptemp;
-                    if (n == 7 && os_strncmp(ptemp, "PLAYING", 7) == 0) {
-                        info.transport_state = PLAYING;
-                    }
-                    else if (n == 7 && os_strncmp(ptemp, "STOPPED", 7) == 0) {
-                        info.transport_state = STOPPED;
-                    }
-                    else if (n == 15 && os_strncmp(ptemp, "PAUSED_PLAYBACK", 15) == 0) {
-                        info.transport_state = PAUSED_PLAYBACK;
-                    }
-                    else {
-                        os_printf("TransportState invalid\n");
-                    }
-                }
-            }
+    if (!sn->error && sn->has_header) {
+        if (sn->body.state == RESPONSE_DONE) {
+            sonos_notify_info *info = &sn->info;
 
-            ptemp = (char *)os_strstr(pstart, "<NumberOfTracks val=\"");
-            if (ptemp) {
-                ptemp += 21;
-                qtemp = (char *)os_strstr(ptemp, "\"/>");
-                if (qtemp) {
-                    long int num = strtol(ptemp, NULL, 10);
-                    if (num >= 0 && num < INT_MAX) {
-                        info.number_of_tracks = num;
-                    } else {
-                        os_printf("NumberOfTracks invalid: %ld\n", num);
-                    }
-                }
-            }
+            os_memcpy(info->subscribe_id, sn->subscribe_id, sizeof(info->subscribe_id));
 
-            ptemp = (char *)os_strstr(pstart, "<CurrentTrack val=\"");
-            if (ptemp) {
-                ptemp += 19;
-                qtemp = (char *)os_strstr(ptemp, "\"/>");
-                if (qtemp) {
-                    long int num = strtol(ptemp, NULL, 10);
-                    if (num >= 0 && num < INT_MAX) {
-                        info.current_track = num;
-                    } else {
-                        os_printf("CurrentTrack invalid: %ld\n", num);
-                    }
-                }
+            if (os_strcmp(sn->transport_state, "PLAYING") == 0) {
+                info->transport_state = PLAYING;
+            }
+            else if (os_strcmp(sn->transport_state, "STOPPED") == 0) {
+                info->transport_state = STOPPED;
+            }
+            else if (os_strcmp(sn->transport_state, "PAUSED_PLAYBACK") == 0) {
+                info->transport_state = PAUSED_PLAYBACK;
+            }
+            else if (sn->transport_state[0] != '\0') {
+                os_printf("TransportState invalid\n");
             }
-
 
             if (listener_callback) {
-                listener_callback(&info, listener_callback_user_data);
+                listener_callback(info, listener_callback_user_data);
             }
         }
         else {
-            os_printf("Invalid event payload\n");
+            os_printf("Incomplete event payload\n");
         }
     }
 
@@ -312,140 +312,51 @@ LOCAL void ICACHE_FLASH_ATTR sonos_listener_recv_callback(void *arg, char *pusrd
         return;
     }
 
+    if (sonos_response_feed(&sn->body, pusrdata, length) < length) {
+        os_printf("Content payload too large: n=%d\n", length);
+        sn->error = true;
+        return;
+    }
+
     if (!sn->has_header) {
-        // Buffer and process the header section
-        if (!sn->payload_buf) {
-            sn->payload_buf = (char *)os_malloc(PACKET_SIZE * 2);
-            if (!sn->payload_buf) {
-                os_printf("Could not allocate header buffer\n");
-                sn->error = true;
-                return;
-            }
-            sn->payload_len = 0;
-            sn->payload_max = PACKET_SIZE * 2;
+        if (sn->body.state <= RESPONSE_HEADERS) {
+            return;
         }
-
-        if (length > sn->payload_max - sn->payload_len - 1) {
-            os_printf("Header payload too large: n=%d\n", length);
+        if (!sonos_listener_header(sn)) {
             sn->error = true;
             return;
         }
-        os_memcpy(sn->payload_buf + sn->payload_len, pusrdata, length);
-        sn->payload_len += length;
-        sn->payload_buf[sn->payload_len] = '\0';
-
-        // Once we've buffered enough to have the content,
-        // parse the header fields and move over.
-        char *cstart = (char *)os_strstr(sn->payload_buf, "\r\n\r\n");
-        if (cstart) {
-            bool is_notify = false;
-            bool is_event = false;
-            bool is_propchange = false;
-            int content_length = 0;
-            char *ptemp = sn->payload_buf;
-            char *qtemp = (char *)os_strstr(ptemp, "\r\n");
-            while (ptemp && qtemp && (qtemp - ptemp > 0) && ptemp != cstart) {
-                int n = qtemp - ptemp;
-                if (ptemp == sn->payload_buf && n >= 23
-                    && os_strncmp(ptemp, "NOTIFY /notify HTTP/1.1", 23) == 0) {
-                    is_notify = true;
-                }
-                else if (n > 5 && os_strncmp(ptemp, "SID: ", 5) == 0) {
-                    ptemp += 5; n -= 5;
-                    if (n > sizeof(sn->subscribe_id) - 1) {
-                        os_printf("SID too long: n=%d\n", n);
-                        sn->error = true;
-                        return;
-                    }
-                    os_memcpy(sn->subscribe_id, ptemp, n);
-                    sn->subscribe_id[n] = '\0';
-                }
-                else if (n >= 14 && os_strncmp(ptemp, "NT: upnp:event", 14) == 0) {
-                    is_event = true;
-                }
-                else if (n >= 20 && os_strncmp(ptemp, "NTS: upnp:propchange", 20) == 0) {
-                    is_propchange = true;
-                }
-                else if (n > 16 && os_strncmp(ptemp, "CONTENT-LENGTH: ", 16) == 0) {
-                    ptemp += 16; n -= 16;
-                    long int len_value = strtol(ptemp, NULL, 10);
-                    if (len_value <= 0 || len_value > INT_MAX) {
-                        os_printf("Length invalid: len=%ld\n", len_value);
-                        sn->error = true;
-                        return;
-                    }
-                    content_length = len_value;
-                }
-
-                qtemp += 2;
-                ptemp = qtemp;
-                qtemp = (char *)os_strstr(ptemp, "\r\n");
-            }
+        sn->has_header = true;
+    }
 
-            if (is_notify && is_event && is_propchange
-                && sn->subscribe_id[0] != '\0' && content_length > 0) {
-
-                os_printf("Notify message from: \"%s\"\n", sn->subscribe_id);
-                
-                if (os_strcmp(sn->subscribe_id, subscribe_info.subscribe_id) != 0) {
-                    os_printf("Notification SID does not match active subscription\n");
-                    sn->error = true;
-                    return;
-                }
-
-                char *content_buf = (char *)os_malloc(content_length + 1);
-                if (!content_buf) {
-                    os_printf("Could not allocate content buffer\n");
-                    sn->error = true;
-                    return;
-                }
-
-                // Advance the content start pointer past the delimiter
-                cstart += 4;
-                int n = sn->payload_len - (cstart - sn->payload_buf);
-                if (n < 0 || n > content_length) {
-                    os_printf("Invalid copy len: %d\n", n);
-                    os_free(content_buf);
-                    sn->error = true;
-                    return;
-                }
-
-                os_memcpy(content_buf, cstart, n);
-                content_buf[n] = '\0';
-
-                // Replace the saved buffer with the new content buffer
-                os_free(sn->payload_buf);
-                sn->payload_buf = content_buf;
-                sn->payload_len = n;
-                sn->payload_max = content_length;
-
-                sn->has_header = true;
-            }
-            else {
-                os_printf("Not a valid notify header\n");
-                sn->error = true;
-                return;
-            }
-        }
+    if (sn->body.state == RESPONSE_DONE) {
+        os_timer_disarm(&sn->disconnect_timer);
+        os_timer_setfn(&sn->disconnect_timer, (os_timer_func_t *)sonos_listener_disconnect_wait, pesp_conn);
+        os_timer_arm(&sn->disconnect_timer, 10, 0);
     }
-    else {
-        // Buffer the content section
-        if (length > sn->payload_max - sn->payload_len) {
-            os_printf("Content payload too large: n=%d\n", length);
-            sn->error = true;
-            return;
-        }
+}
 
-        os_memcpy(sn->payload_buf + sn->payload_len, pusrdata, length);
-        sn->payload_len += length;
-        sn->payload_buf[sn->payload_len] = '\0';
+/*
+ * Check the header section once it has been read. Nothing from the
+ * body is passed on unless it holds.
+ */
+LOCAL bool ICACHE_FLASH_ATTR sonos_listener_header(sonos_notification *sn)
+{
+    if (os_strcmp(sn->request_line, "NOTIFY /notify HTTP/1.1") != 0
+        || os_strcmp(sn->nt, "upnp:event") != 0
+        || os_strcmp(sn->nts, "upnp:propchange") != 0
+        || sn->subscribe_id[0] == '\0' || sn->body.content_length <= 0) {
+        os_printf("Not a valid notify header\n");
+        return false;
+    }
 
-        if (sn->payload_len == sn->payload_max) {
-            os_timer_disarm(&sn->disconnect_timer);
-            os_timer_setfn(&sn->disconnect_timer, (os_timer_func_t *)sonos_listener_disconnect_wait, pesp_conn);
-            os_timer_arm(&sn->disconnect_timer, 10, 0);
-        }
+    os_printf("Notify message from: \"%s\"\n", sn->subscribe_id);
+
+    if (os_strcmp(sn->subscribe_id, subscribe_info.subscribe_id) != 0) {
+        os_printf("Notification SID does not match active subscription\n");
+        return false;
     }
+    return true;
 }
 
 LOCAL void ICACHE_FLASH_ATTR sonos_listener_disconnect_wait(void *arg)
@@ -468,10 +379,7 @@ LOCAL void ICACHE_FLASH_ATTR free_listener_connection(struct espconn *pespconn)
         if (sn) {
             os_timer_disarm(&sn->disconnect_timer);
 
-            if (sn->payload_buf) {
-                os_free(sn->payload_buf);
-            }
-            os_free(sn);
+            user_pool_free(POOL_SONOS_NOTIFICATION, sn);
             pespconn->reverse = NULL;
         }
     }
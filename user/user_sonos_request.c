@@ -3,687 +3,1324 @@
 #include <ets_sys.h>
 #include <os_type.h>
 #include <osapi.h>
-#include <mem.h>
 #include <user_interface.h>
 #include <espconn.h>
-#include <limits.h>
-#include <sys/param.h>
-#include <stdlib.h>
+#include <stddef.h>
 
 #include "user_util.h"
-
-#define PACKET_SIZE (2 * 1024)
-
-typedef enum sonos_request_type {
-    REQUEST_ADD_URI = 0,
-    REQUEST_SET_TRANSPORT,
-    REQUEST_SEEK,
-    REQUEST_PLAY,
-    REQUEST_GET_POSITION_INFO,
-    REQUEST_SUBSCRIBE,
-    REQUEST_RESUBSCRIBE
-} sonos_request_type;
+#include "user_pool.h"
+#include "user_sonos_response.h"
+
+/* Most arguments of any action in the table */
+#define SONOS_ACTION_ARGS_MAX 6
+
+/*
+ * Room for the numbers in a request header to grow past their format
+ * specifiers, for two addresses, two ports, and two more numbers.
+ */
+#define SONOS_HEADER_NUMBERS_MAX 48
+
+#define SONOS_SERVICE_PREFIX "urn:schemas-upnp-org:service:"
+
+/* Connections kept open to the devices between requests, and
+ * connections that can be made on top of those, for one-off use */
+#define SONOS_CONN_POOL_SIZE 2
+#define SONOS_CONN_EXTRA 2
+
+/* Time an unused connection is kept open, in milliseconds */
+#define SONOS_CONN_IDLE_TIMEOUT 15000
+
+/* Deadlines for connecting, for the first of the response, and for the
+ * whole request including any retries, in milliseconds */
+#define SONOS_REQUEST_CONNECT_TIMEOUT 3000
+#define SONOS_REQUEST_RESPONSE_TIMEOUT 4000
+#define SONOS_REQUEST_TOTAL_TIMEOUT 10000
+
+/* Attempts at a request that is safe to retry, and the wait before
+ * the first retry, doubled for each one after it, in milliseconds */
+#define SONOS_REQUEST_ATTEMPTS 3
+#define SONOS_REQUEST_BACKOFF 250
+
+/* Requests in flight at once, of which some are kept for playback,
+ * and requests waiting for a turn */
+#define SONOS_REQUEST_MAX_ACTIVE 2
+#define SONOS_REQUEST_PLAYBACK_SLOTS 1
+#define SONOS_REQUEST_MAX_QUEUED 4
+
+/* Latency histogram bins are an octave wide. The first bin holds times
+ * below SONOS_STATS_BIN_MIN, and the last everything from its lower
+ * bound up. Times are in milliseconds. */
+#define SONOS_STATS_BINS 12
+#define SONOS_STATS_BIN_MIN 4
+#define SONOS_STATS_BIN_SHIFT 2
+
+#define TABLE_SIZE(table) (int)(sizeof(table) / sizeof(table[0]))
+
+typedef enum sonos_action_id {
+    ACTION_ADD_URI = 0,
+    ACTION_SET_TRANSPORT,
+    ACTION_SEEK,
+    ACTION_PLAY,
+    ACTION_PAUSE,
+    ACTION_NEXT,
+    ACTION_REMOVE_TRACK_RANGE,
+    ACTION_GET_POSITION_INFO,
+    ACTION_GET_TRANSPORT_INFO,
+    ACTION_SET_VOLUME,
+    ACTION_SUBSCRIBE,
+    ACTION_RESUBSCRIBE,
+    ACTION_GET_ZONE_INFO,
+    MAX_ACTIONS
+} sonos_action_id;
+
+/*
+ * Order in which waiting requests are sent. The playback of a selection
+ * goes ahead of keeping the event subscription, which goes ahead of
+ * looking around the network.
+ */
+typedef enum sonos_request_priority {
+    PRIORITY_PLAYBACK = 0,
+    PRIORITY_EVENTS,
+    PRIORITY_BACKGROUND
+} sonos_request_priority;
+
+/*
+ * Steps of a request that are timed: waiting for a slot, connecting,
+ * sending, waiting for the response, and receiving it. The connection
+ * steps are timed again for each attempt, and skipped for connections
+ * that are kept open.
+ */
+typedef enum sonos_stats_phase {
+    PHASE_QUEUE = 0,
+    PHASE_CONNECT,
+    PHASE_SEND,
+    PHASE_WAIT,
+    PHASE_RECEIVE,
+    PHASE_TOTAL,
+    SONOS_PHASES
+} sonos_stats_phase;
+
+typedef enum sonos_stats_counter {
+    COUNT_REQUESTS = 0,
+    COUNT_OK,           // code 200
+    COUNT_HTTP_ERROR,   // any other code
+    COUNT_TIMEOUT,      // an attempt or the whole request ran out of time
+    COUNT_CONN_ERROR,   // a connection could not be made, or was reset
+    COUNT_RETRY,        // attempts after the first, and reconnects
+    COUNT_REUSED,       // attempts sent over a kept connection
+    SONOS_COUNTERS
+} sonos_stats_counter;
+
+typedef struct sonos_action_stats {
+    uint32 counters[SONOS_COUNTERS];
+    uint16 phases[SONOS_PHASES][SONOS_STATS_BINS];
+} sonos_action_stats;
+
+typedef struct sonos_action_arg {
+    const char *name;
+    const char *value;  // NULL for the next of the values given by the caller
+} sonos_action_arg;
+
+/*
+ * Everything that differs between one request and another: where it
+ * goes, what it sends, what is picked out of the response, whether it
+ * can be retried, and how soon it is sent. Requests that are not SOAP
+ * actions have no service, and build their own requests.
+ */
+typedef struct sonos_action {
+    const char *service;
+    const char *name;
+    const sonos_action_arg *args;
+    int arg_count;
+    const sonos_response_field *fields;  // the callback takes the result if any
+    int field_count;
+    bool idempotent;    // sending it twice has the same effect as once
+    sonos_request_priority priority;
+} sonos_action;
+
+struct sonos_conn;
 
 typedef struct sonos_request {
+    struct sonos_request *next;
+    struct sonos_conn *conn;
     sonos_device device;
     char *payload;
     int payload_len;
-    os_timer_t disconnect_timer;
-    sonos_request_type request_type;
-    char *response_buf;
+    const sonos_action *action;
+    sonos_response response;
     size_t response_len;
+    union {
+        sonos_add_uri_info add_uri;
+        sonos_position_info position;
+        sonos_transport_info transport;
+        sonos_subscribe_info subscribe;
+        sonos_zone_info zone;
+    } info;
+    bool retried;   // resent after a kept connection was found closed
+    bool written;   // the current attempt was handed to a connection
+    uint8 attempts;
+    os_timer_t timer;
+    os_timer_t total_timer;
     void *callback;
     void *user_data;
     bool result_notified;
+    uint32 time_start;  // system time the request was made
+    uint32 time_mark;   // system time the current phase began
 } sonos_request;
 
-LOCAL sonos_request* ICACHE_FLASH_ATTR sonos_build_request(const sonos_device *device, const char *action, const char *content);
-LOCAL void ICACHE_FLASH_ATTR sonos_request_start(sonos_request *request);
+typedef void (* sonos_request_info_callback_t)(
+    const void *info, void *user_data, bool success);
+
+typedef enum sonos_conn_state {
+    CONN_FREE = 0,
+    CONN_CONNECTING,
+    CONN_ACTIVE,
+    CONN_IDLE,
+    CONN_RECONNECT,
+    CONN_CLOSING
+} sonos_conn_state;
+
+typedef struct sonos_conn {
+    sonos_conn_state state;
+    bool pooled;  // false if made outside of a full pool
+    bool reused;  // the current request was sent over a kept connection
+    uint8 ip[4];
+    int port;
+    struct espconn *pespconn;
+    sonos_request *request;
+    os_timer_t timer;
+} sonos_conn;
+
+LOCAL bool ICACHE_FLASH_ATTR sonos_request_action(const sonos_device *device, sonos_action_id id,
+    const char *values[], int value_count, void *callback, void *user_data);
+LOCAL sonos_request* ICACHE_FLASH_ATTR sonos_request_new(const sonos_device *device, sonos_action_id id,
+    int payload_size);
+LOCAL bool ICACHE_FLASH_ATTR sonos_build_request(sonos_request *request, const sonos_device *device,
+    const char *values[], int value_count);
+LOCAL bool ICACHE_FLASH_ATTR sonos_request_start(sonos_request *request);
+LOCAL void ICACHE_FLASH_ATTR sonos_request_schedule(void);
+LOCAL bool ICACHE_FLASH_ATTR sonos_request_unlink(sonos_request **list, sonos_request *request);
+LOCAL void ICACHE_FLASH_ATTR sonos_request_attempt(sonos_request *request);
+LOCAL void ICACHE_FLASH_ATTR sonos_request_arm(sonos_request *request, uint32 timeout_ms);
+LOCAL void ICACHE_FLASH_ATTR sonos_request_timeout(void *arg);
+LOCAL void ICACHE_FLASH_ATTR sonos_request_total_timeout(void *arg);
+LOCAL void ICACHE_FLASH_ATTR sonos_request_abort(sonos_request *request);
+LOCAL void ICACHE_FLASH_ATTR sonos_request_failed(sonos_request *request);
+LOCAL bool ICACHE_FLASH_ATTR sonos_request_resendable(const sonos_request *request);
 LOCAL void ICACHE_FLASH_ATTR sonos_request_connect_callback(void *arg);
 LOCAL void ICACHE_FLASH_ATTR sonos_request_disconnect_callback(void *arg);
 LOCAL void ICACHE_FLASH_ATTR sonos_request_reconnect_callback(void *arg, sint8 err);
 LOCAL void ICACHE_FLASH_ATTR sonos_request_sent_callback(void *arg);
 LOCAL void ICACHE_FLASH_ATTR sonos_request_recv_callback(void *arg, char *pusrdata, unsigned short length);
-LOCAL void ICACHE_FLASH_ATTR sonos_request_disconnect_wait(void *arg);
+LOCAL void ICACHE_FLASH_ATTR sonos_request_complete(sonos_request *request);
+LOCAL void ICACHE_FLASH_ATTR sonos_request_free(sonos_request *request);
 LOCAL void ICACHE_FLASH_ATTR notify_request_listener(sonos_request *request, bool is_success);
+LOCAL sonos_conn* ICACHE_FLASH_ATTR sonos_conn_find_idle(const sonos_device *device);
+LOCAL sonos_conn* ICACHE_FLASH_ATTR sonos_conn_alloc(const sonos_device *device);
+LOCAL void ICACHE_FLASH_ATTR sonos_conn_connect(sonos_conn *conn);
+LOCAL void ICACHE_FLASH_ATTR sonos_conn_send(sonos_conn *conn);
+LOCAL void ICACHE_FLASH_ATTR sonos_conn_closed(sonos_conn *conn);
+LOCAL void ICACHE_FLASH_ATTR sonos_conn_timer_func(void *arg);
+LOCAL void ICACHE_FLASH_ATTR sonos_conn_fail(sonos_conn *conn);
+LOCAL void ICACHE_FLASH_ATTR sonos_conn_release(sonos_conn *conn);
 LOCAL void ICACHE_FLASH_ATTR free_tcp_connection(struct espconn *pespconn);
+LOCAL void ICACHE_FLASH_ATTR sonos_stats_count(const sonos_request *request, sonos_stats_counter counter);
+LOCAL void ICACHE_FLASH_ATTR sonos_stats_time(sonos_request *request, sonos_stats_phase phase);
+
+LOCAL sonos_conn sonos_conn_pool[SONOS_CONN_POOL_SIZE];
+LOCAL sonos_request *active_requests = NULL;
+LOCAL sonos_request *pending_requests = NULL;
+LOCAL int active_count = 0;
+LOCAL bool scheduling = false;
+LOCAL sonos_action_stats action_stats[MAX_ACTIONS];
+
+#define INFO_OFFSET(member) (offsetof(sonos_request, info.member) - offsetof(sonos_request, info))
+
+LOCAL const sonos_response_field add_uri_fields[] = {
+    {"FirstTrackNumberEnqueued", RESPONSE_ELEMENT, RESPONSE_INT, INFO_OFFSET(add_uri.first_track_num_enqueued), 0},
+    {"NumTracksAdded", RESPONSE_ELEMENT, RESPONSE_INT, INFO_OFFSET(add_uri.num_tracks_added), 0},
+    {"NewQueueLength", RESPONSE_ELEMENT, RESPONSE_INT, INFO_OFFSET(add_uri.new_queue_length), 0}
+};
+
+LOCAL const sonos_response_field position_fields[] = {
+    {"Track", RESPONSE_ELEMENT, RESPONSE_INT, INFO_OFFSET(position.track), 0},
+    {"TrackDuration", RESPONSE_ELEMENT, RESPONSE_TIME, INFO_OFFSET(position.track_duration), 0},
+    {"TrackURI", RESPONSE_ELEMENT, RESPONSE_TEXT, INFO_OFFSET(position.track_uri),
+        sizeof(((sonos_position_info *)0)->track_uri)},
+    {"RelTime", RESPONSE_ELEMENT, RESPONSE_TIME, INFO_OFFSET(position.rel_time), 0}
+};
+
+LOCAL const sonos_response_field transport_fields[] = {
+    {"CurrentTransportState", RESPONSE_ELEMENT, RESPONSE_TEXT, INFO_OFFSET(transport.state),
+        sizeof(((sonos_transport_info *)0)->state)},
+    {"CurrentTransportStatus", RESPONSE_ELEMENT, RESPONSE_TEXT, INFO_OFFSET(transport.status),
+        sizeof(((sonos_transport_info *)0)->status)},
+    {"CurrentSpeed", RESPONSE_ELEMENT, RESPONSE_TEXT, INFO_OFFSET(transport.speed),
+        sizeof(((sonos_transport_info *)0)->speed)}
+};
+
+LOCAL const sonos_response_field subscribe_fields[] = {
+    {"SID:", RESPONSE_HEADER, RESPONSE_TEXT, INFO_OFFSET(subscribe.subscribe_id),
+        sizeof(((sonos_subscribe_info *)0)->subscribe_id)},
+    {"TIMEOUT:", RESPONSE_HEADER, RESPONSE_SECONDS, INFO_OFFSET(subscribe.timeout_secs), 0}
+};
+
+LOCAL const sonos_response_field zone_fields[] = {
+    {"ZoneName", RESPONSE_ELEMENT, RESPONSE_TEXT, INFO_OFFSET(zone.zone_name),
+        sizeof(((sonos_zone_info *)0)->zone_name)}
+};
+
+LOCAL const sonos_action_arg instance_args[] = {
+    {"InstanceID", "0"}
+};
+
+LOCAL const sonos_action_arg add_uri_args[] = {
+    {"InstanceID", "0"},
+    {"EnqueuedURI", NULL},
+    {"EnqueuedURIMetaData", ""},
+    {"DesiredFirstTrackNumberEnqueued", "0"},
+    {"EnqueueAsNext", "0"}
+};
+
+LOCAL const sonos_action_arg set_transport_args[] = {
+    {"InstanceID", "0"},
+    {"CurrentURI", NULL},
+    {"CurrentURIMetaData", ""}
+};
+
+LOCAL const sonos_action_arg seek_args[] = {
+    {"InstanceID", "0"},
+    {"Unit", "TRACK_NR"},
+    {"Target", NULL}
+};
+
+LOCAL const sonos_action_arg play_args[] = {
+    {"InstanceID", "0"},
+    {"Speed", "1"}
+};
+
+LOCAL const sonos_action_arg remove_track_range_args[] = {
+    {"InstanceID", "0"},
+    {"UpdateID", NULL},
+    {"StartingIndex", NULL},
+    {"NumberOfTracks", NULL}
+};
+
+LOCAL const sonos_action_arg set_volume_args[] = {
+    {"InstanceID", "0"},
+    {"Channel", "Master"},
+    {"DesiredVolume", NULL}
+};
+
+LOCAL const char *action_stats_names[MAX_ACTIONS] = {
+    [ACTION_ADD_URI] = "add_uri",
+    [ACTION_SET_TRANSPORT] = "set_transport",
+    [ACTION_SEEK] = "seek",
+    [ACTION_PLAY] = "play",
+    [ACTION_PAUSE] = "pause",
+    [ACTION_NEXT] = "next",
+    [ACTION_REMOVE_TRACK_RANGE] = "remove_track_range",
+    [ACTION_GET_POSITION_INFO] = "get_position_info",
+    [ACTION_GET_TRANSPORT_INFO] = "get_transport_info",
+    [ACTION_SET_VOLUME] = "set_volume",
+    [ACTION_SUBSCRIBE] = "subscribe",
+    [ACTION_RESUBSCRIBE] = "resubscribe",
+    [ACTION_GET_ZONE_INFO] = "get_zone_info"
+};
+
+LOCAL const char *phase_names[SONOS_PHASES] = {
+    "queue", "connect", "send", "wait", "receive", "total"
+};
+
+#define ACTION_ARGS(args) args, TABLE_SIZE(args)
+#define ACTION_FIELDS(fields) fields, TABLE_SIZE(fields)
+
+LOCAL const sonos_action actions[MAX_ACTIONS] = {
+    [ACTION_ADD_URI] = {"AVTransport", "AddURIToQueue",
+        ACTION_ARGS(add_uri_args), ACTION_FIELDS(add_uri_fields), false, PRIORITY_PLAYBACK},
+    [ACTION_SET_TRANSPORT] = {"AVTransport", "SetAVTransportURI",
+        ACTION_ARGS(set_transport_args), NULL, 0, true, PRIORITY_PLAYBACK},
+    [ACTION_SEEK] = {"AVTransport", "Seek",
+        ACTION_ARGS(seek_args), NULL, 0, true, PRIORITY_PLAYBACK},
+    [ACTION_PLAY] = {"AVTransport", "Play",
+        ACTION_ARGS(play_args), NULL, 0, true, PRIORITY_PLAYBACK},
+    [ACTION_PAUSE] = {"AVTransport", "Pause",
+        ACTION_ARGS(instance_args), NULL, 0, true, PRIORITY_PLAYBACK},
+    // Skipping ahead twice would skip two tracks
+    [ACTION_NEXT] = {"AVTransport", "Next",
+        ACTION_ARGS(instance_args), NULL, 0, false, PRIORITY_PLAYBACK},
+    // The update ID makes the queue refuse a second removal
+    [ACTION_REMOVE_TRACK_RANGE] = {"AVTransport", "RemoveTrackRangeFromQueue",
+        ACTION_ARGS(remove_track_range_args), NULL, 0, true, PRIORITY_PLAYBACK},
+    [ACTION_GET_POSITION_INFO] = {"AVTransport", "GetPositionInfo",
+        ACTION_ARGS(instance_args), ACTION_FIELDS(position_fields), true, PRIORITY_PLAYBACK},
+    [ACTION_GET_TRANSPORT_INFO] = {"AVTransport", "GetTransportInfo",
+        ACTION_ARGS(instance_args), ACTION_FIELDS(transport_fields), true, PRIORITY_PLAYBACK},
+    [ACTION_SET_VOLUME] = {"RenderingControl", "SetVolume",
+        ACTION_ARGS(set_volume_args), NULL, 0, true, PRIORITY_PLAYBACK},
+    [ACTION_SUBSCRIBE] = {NULL, "SUBSCRIBE",
+        NULL, 0, ACTION_FIELDS(subscribe_fields), false, PRIORITY_EVENTS},
+    [ACTION_RESUBSCRIBE] = {NULL, "SUBSCRIBE",
+        NULL, 0, ACTION_FIELDS(subscribe_fields), true, PRIORITY_EVENTS},
+    [ACTION_GET_ZONE_INFO] = {NULL, "GET",
+        NULL, 0, ACTION_FIELDS(zone_fields), true, PRIORITY_BACKGROUND}
+};
 
 void ICACHE_FLASH_ATTR user_sonos_request_init(void)
 {
+    // One request more than can be in flight and waiting, so a request
+    // can always be made to take the place of a waiting one.
+    user_pool_create(POOL_SONOS_REQUEST, "sonos_request", sizeof(sonos_request),
+        SONOS_REQUEST_MAX_ACTIVE + SONOS_REQUEST_MAX_QUEUED + 1);
+    user_pool_create(POOL_SONOS_CONN, "sonos_conn", sizeof(sonos_conn), SONOS_CONN_EXTRA);
 }
 
 bool ICACHE_FLASH_ATTR user_sonos_request_add_uri(const sonos_device *device, const char *uri,
     user_sonos_request_add_uri_callback_t callback, void *user_data)
 {
-    LOCAL const char action[] = "urn:schemas-upnp-org:service:AVTransport:1#AddURIToQueue";
-
-    char *content_buf = (char *)os_malloc(PACKET_SIZE);
-    if (!content_buf) {
-        return false;
-    }
-
     //Note: Assuming that URI is already URL-encoded
-    os_sprintf(content_buf,
-        "<s:Envelope xmlns:s=\"http://schemas.xmlsoap.org/soap/envelope/\" "
-                    "s:encodingStyle=\"http://schemas.xmlsoap.org/soap/encoding/\">"
-          "<s:Body>"
-            "<u:AddURIToQueue xmlns:u=\"urn:schemas-upnp-org:service:AVTransport:1\">"
-              "<InstanceID>0</InstanceID>"
-              "<EnqueuedURI>%s</EnqueuedURI>"
-              "<EnqueuedURIMetaData></EnqueuedURIMetaData>"
-              "<DesiredFirstTrackNumberEnqueued>0</DesiredFirstTrackNumberEnqueued>"
-              "<EnqueueAsNext>0</EnqueueAsNext>"
-            "</u:AddURIToQueue>"
-          "</s:Body>"
-        "</s:Envelope>", uri);
-
-    sonos_request *request = sonos_build_request(device, action, content_buf);
-    os_free(content_buf);
-    if (!request) {
-        return false;
-    }
-    request->request_type = REQUEST_ADD_URI;
-    request->callback = callback;
-    request->user_data = user_data;
-
-    sonos_request_start(request);
-    return true;
+    const char *values[] = { uri };
+    return sonos_request_action(device, ACTION_ADD_URI, values, TABLE_SIZE(values), callback, user_data);
 }
 
 bool ICACHE_FLASH_ATTR user_sonos_request_set_transport(const sonos_device *device,
     user_sonos_request_callback_t callback, void *user_data)
 {
-    LOCAL const char action[] = "urn:schemas-upnp-org:service:AVTransport:1#SetAVTransportURI";
-
-    char *content_buf = (char *)os_malloc(PACKET_SIZE);
-    if (!content_buf) {
-        return false;
-    }
-
-    os_sprintf(content_buf,
-        "<s:Envelope xmlns:s=\"http://schemas.xmlsoap.org/soap/envelope/\" "
-                    "s:encodingStyle=\"http://schemas.xmlsoap.org/soap/encoding/\">"
-          "<s:Body>"
-            "<u:SetAVTransportURI xmlns:u=\"urn:schemas-upnp-org:service:AVTransport:1\">"
-              "<InstanceID>0</InstanceID>"
-              "<CurrentURI>x-rincon-queue:%s#0</CurrentURI>"
-              "<CurrentURIMetaData></CurrentURIMetaData>"
-            "</u:SetAVTransportURI>"
-          "</s:Body>"
-        "</s:Envelope>",
-        device->uuid);
+    char uri[sizeof(device->uuid) + 20];
+    os_sprintf(uri, "x-rincon-queue:%s#0", device->uuid);
 
-    sonos_request *request = sonos_build_request(device, action, content_buf);
-    os_free(content_buf);
-    if (!request) {
-        return false;
-    }
-    request->request_type = REQUEST_SET_TRANSPORT;
-    request->callback = callback;
-    request->user_data = user_data;
-
-    sonos_request_start(request);
-    return true;
+    const char *values[] = { uri };
+    return sonos_request_action(device, ACTION_SET_TRANSPORT, values, TABLE_SIZE(values), callback, user_data);
 }
 
 bool ICACHE_FLASH_ATTR user_sonos_request_seek_track(const sonos_device *device, int track,
     user_sonos_request_callback_t callback, void *user_data)
 {
-    LOCAL const char action[] = "urn:schemas-upnp-org:service:AVTransport:1#Seek";
-
-    char *content_buf = (char *)os_malloc(PACKET_SIZE);
-    if (!content_buf) {
-        return false;
-    }
+    char target[12];
+    os_sprintf(target, "%d", track);
 
-    os_sprintf(content_buf,
-        "<s:Envelope xmlns:s=\"http://schemas.xmlsoap.org/soap/envelope/\" "
-                    "s:encodingStyle=\"http://schemas.xmlsoap.org/soap/encoding/\">"
-          "<s:Body>"
-            "<u:Seek xmlns:u=\"urn:schemas-upnp-org:service:AVTransport:1\">"
-              "<InstanceID>0</InstanceID>"
-              "<Unit>TRACK_NR</Unit>"
-              "<Target>%d</Target>"
-            "</u:Seek>"
-          "</s:Body>"
-        "</s:Envelope>",
-        track);
-
-    sonos_request *request = sonos_build_request(device, action, content_buf);
-    os_free(content_buf);
-    if (!request) {
-        return false;
-    }
-    request->request_type = REQUEST_SEEK;
-    request->callback = callback;
-    request->user_data = user_data;
-
-    sonos_request_start(request);
-    return true;
+    const char *values[] = { target };
+    return sonos_request_action(device, ACTION_SEEK, values, TABLE_SIZE(values), callback, user_data);
 }
 
 bool ICACHE_FLASH_ATTR user_sonos_request_play(const sonos_device *device,
     user_sonos_request_callback_t callback, void *user_data)
 {
-    LOCAL const char action[] = "urn:schemas-upnp-org:service:AVTransport:1#Play";
+    return sonos_request_action(device, ACTION_PLAY, NULL, 0, callback, user_data);
+}
 
-    LOCAL const char content[] =
-        "<s:Envelope xmlns:s=\"http://schemas.xmlsoap.org/soap/envelope/\" "
-                    "s:encodingStyle=\"http://schemas.xmlsoap.org/soap/encoding/\">"
-          "<s:Body>"
-            "<u:Play xmlns:u=\"urn:schemas-upnp-org:service:AVTransport:1\">"
-              "<InstanceID>0</InstanceID>"
-              "<Speed>1</Speed>"
-            "</u:Play>"
-          "</s:Body>"
-        "</s:Envelope>";
+bool ICACHE_FLASH_ATTR user_sonos_request_pause(const sonos_device *device,
+    user_sonos_request_callback_t callback, void *user_data)
+{
+    return sonos_request_action(device, ACTION_PAUSE, NULL, 0, callback, user_data);
+}
 
-    sonos_request *request = sonos_build_request(device, action, content);
-    if (!request) {
-        return false;
-    }
-    request->request_type = REQUEST_PLAY;
-    request->callback = callback;
-    request->user_data = user_data;
+bool ICACHE_FLASH_ATTR user_sonos_request_next(const sonos_device *device,
+    user_sonos_request_callback_t callback, void *user_data)
+{
+    return sonos_request_action(device, ACTION_NEXT, NULL, 0, callback, user_data);
+}
 
-    sonos_request_start(request);
-    return true;
+bool ICACHE_FLASH_ATTR user_sonos_request_remove_track_range(const sonos_device *device,
+    uint32 update_id, int start, int count,
+    user_sonos_request_callback_t callback, void *user_data)
+{
+    char update[12];
+    char starting[12];
+    char number[12];
+    os_sprintf(update, "%u", update_id);
+    os_sprintf(starting, "%d", start);
+    os_sprintf(number, "%d", count);
+
+    const char *values[] = { update, starting, number };
+    return sonos_request_action(device, ACTION_REMOVE_TRACK_RANGE, values, TABLE_SIZE(values),
+        callback, user_data);
 }
 
 bool ICACHE_FLASH_ATTR user_sonos_request_get_position_info(const sonos_device *device,
     user_sonos_request_position_callback_t callback, void *user_data)
 {
-    LOCAL const char action[] = "urn:schemas-upnp-org:service:AVTransport:1#GetPositionInfo";
+    return sonos_request_action(device, ACTION_GET_POSITION_INFO, NULL, 0, callback, user_data);
+}
 
-    LOCAL const char content[] =
-        "<s:Envelope xmlns:s=\"http://schemas.xmlsoap.org/soap/envelope/\" "
-                    "s:encodingStyle=\"http://schemas.xmlsoap.org/soap/encoding/\">"
-          "<s:Body>"
-            "<u:GetPositionInfo xmlns:u=\"urn:schemas-upnp-org:service:AVTransport:1\">"
-              "<InstanceID>0</InstanceID>"
-            "</u:GetPositionInfo>"
-          "</s:Body>"
-        "</s:Envelope>";
+bool ICACHE_FLASH_ATTR user_sonos_request_get_transport_info(const sonos_device *device,
+    user_sonos_request_transport_callback_t callback, void *user_data)
+{
+    return sonos_request_action(device, ACTION_GET_TRANSPORT_INFO, NULL, 0, callback, user_data);
+}
+
+bool ICACHE_FLASH_ATTR user_sonos_request_set_volume(const sonos_device *device, int volume,
+    user_sonos_request_callback_t callback, void *user_data)
+{
+    char desired[12];
+
+    if (volume < 0) {
+        volume = 0;
+    } else if (volume > 100) {
+        volume = 100;
+    }
+    os_sprintf(desired, "%d", volume);
 
-    sonos_request *request = sonos_build_request(device, action, content);
+    const char *values[] = { desired };
+    return sonos_request_action(device, ACTION_SET_VOLUME, values, TABLE_SIZE(values), callback, user_data);
+}
+
+/*
+ * Build the SOAP request for an action in the table, and start it.
+ * The values fill in the arguments left open in the table, in order.
+ */
+LOCAL bool ICACHE_FLASH_ATTR sonos_request_action(const sonos_device *device, sonos_action_id id,
+    const char *values[], int value_count, void *callback, void *user_data)
+{
+    sonos_request *request = sonos_request_new(device, id, 0);
     if (!request) {
         return false;
     }
-    request->request_type = REQUEST_GET_POSITION_INFO;
+
+    if (!sonos_build_request(request, device, values, value_count)) {
+        user_pool_free(POOL_SONOS_REQUEST, request);
+        return false;
+    }
     request->callback = callback;
     request->user_data = user_data;
 
-    sonos_request_start(request);
-    return true;
+    return sonos_request_start(request);
 }
 
-LOCAL sonos_request* ICACHE_FLASH_ATTR sonos_build_request(const sonos_device *device, const char *action, const char *content)
+/*
+ * Allocate a request for an action, with a payload buffer of the given
+ * size if it is known up front.
+ */
+LOCAL sonos_request* ICACHE_FLASH_ATTR sonos_request_new(const sonos_device *device, sonos_action_id id,
+    int payload_size)
 {
-    sonos_request *request = (sonos_request *)os_zalloc(sizeof(sonos_request));
+    sonos_request *request = (sonos_request *)user_pool_alloc(POOL_SONOS_REQUEST);
     if (!request) {
         return NULL;
     }
 
     os_memcpy(&request->device, device, sizeof(sonos_device));
+    request->action = &actions[id];
 
-    int content_len = os_strlen(content);
-
-    char *pbuf = (char *)os_malloc(PACKET_SIZE);
-    if (!pbuf) {
-        os_free(request);
-        return NULL;
+    if (payload_size > 0) {
+        request->payload = (char *)user_pool_buffer_alloc(payload_size);
+        if (!request->payload) {
+            user_pool_free(POOL_SONOS_REQUEST, request);
+            return NULL;
+        }
     }
+    return request;
+}
 
-    // Play:              /MediaRenderer/AVTransport/Control
-    // AddURIToQueue:     /MediaRenderer/AVTransport/Control
-    // SetAVTransportURI: /MediaRenderer/AVTransport/Control
-    // RemoveAllTracks:   /MediaRenderer/Queue/Control
-
-    os_sprintf(pbuf,
-        "POST /MediaRenderer/AVTransport/Control HTTP/1.1\r\n"
+/*
+ * Build the SOAP request for the action, with each argument taken from
+ * the table or from the values. The whole request is written straight
+ * into a single buffer of the size it needs.
+ */
+LOCAL bool ICACHE_FLASH_ATTR sonos_build_request(sonos_request *request, const sonos_device *device,
+    const char *values[], int value_count)
+{
+    LOCAL const char header[] =
+        "POST /MediaRenderer/%s/Control HTTP/1.1\r\n"
         "Host: " IPSTR ":%d\r\n"
-        "Connection: close\r\n"
+        "Connection: keep-alive\r\n"
         "User-Agent: lwIP/1.4.0\r\n"
         "Content-Type: text/xml; charset=\"utf-8\"\r\n"
         "Content-Length: %d\r\n"
         "X-SONOS-TARGET-UDN: uuid:%s\r\n"
-        "SOAPACTION: \"%s\"\r\n"
-        "\r\n%s",
-        IP2STR(device->ip), device->port,
-        content_len, device->uuid,
-        action, content);
-
-    request->payload_len = os_strlen(pbuf);
-    request->payload = (char *)os_malloc(request->payload_len + 1);
-    if(!request->payload) {
-        os_free(pbuf);
-        os_free(request);
-        return NULL;
-    }
+        "SOAPACTION: \"" SONOS_SERVICE_PREFIX "%s:1#%s\"\r\n"
+        "\r\n";
 
-    os_strcpy(request->payload, pbuf);
-    os_free(pbuf);
-    return request;
-}
+    LOCAL const char envelope_start[] =
+        "<s:Envelope xmlns:s=\"http://schemas.xmlsoap.org/soap/envelope/\" "
+                    "s:encodingStyle=\"http://schemas.xmlsoap.org/soap/encoding/\">"
+          "<s:Body>";
 
-bool user_sonos_request_subscribe(const sonos_device *device,
-    uint8 listener_ip[4], int listener_port, int timeout_secs,
-    user_sonos_request_subscribe_callback_t callback, void *user_data)
-{
-    sonos_request *request = (sonos_request *)os_zalloc(sizeof(sonos_request));
-    if (!request) {
+    LOCAL const char envelope_end[] =
+          "</s:Body>"
+        "</s:Envelope>";
+
+    const sonos_action *action = request->action;
+    const char *arg_values[SONOS_ACTION_ARGS_MAX];
+    int service_len = os_strlen(action->service);
+    int name_len = os_strlen(action->name);
+    int content_len;
+    int value_index = 0;
+    int i;
+    char *ptemp;
+
+    if (action->arg_count > SONOS_ACTION_ARGS_MAX) {
         return false;
     }
 
-    os_memcpy(&request->device, device, sizeof(sonos_device));
+    // <u:name xmlns:u="prefix+service:1">args</u:name>
+    content_len = (sizeof(envelope_start) - 1) + (sizeof(envelope_end) - 1)
+        + 3 + name_len + 10 + (sizeof(SONOS_SERVICE_PREFIX) - 1) + service_len + 4
+        + 4 + name_len + 1;
+    for (i = 0; i < action->arg_count; i++) {
+        const sonos_action_arg *arg = &action->args[i];
+        if (arg->value) {
+            arg_values[i] = arg->value;
+        } else if (value_index < value_count) {
+            arg_values[i] = values[value_index++];
+        } else {
+            return false;
+        }
+        // <name>value</name>
+        content_len += 2 * os_strlen(arg->name) + 5 + os_strlen(arg_values[i]);
+    }
+    if (value_index != value_count) {
+        return false;
+    }
 
-    char *pbuf = (char *)os_malloc(PACKET_SIZE);
-    if (!pbuf) {
-        os_free(request);
+    request->payload = (char *)user_pool_buffer_alloc(sizeof(header) + SONOS_HEADER_NUMBERS_MAX
+        + 2 * service_len + name_len + os_strlen(device->uuid) + content_len);
+    if (!request->payload) {
         return false;
     }
 
-    os_sprintf(pbuf,
+    ptemp = request->payload;
+    ptemp += os_sprintf(ptemp, header,
+        action->service, IP2STR(device->ip), device->port,
+        content_len, device->uuid, action->service, action->name);
+
+    os_memcpy(ptemp, envelope_start, sizeof(envelope_start) - 1);
+    ptemp += sizeof(envelope_start) - 1;
+    ptemp += os_sprintf(ptemp, "<u:%s xmlns:u=\"" SONOS_SERVICE_PREFIX "%s:1\">",
+        action->name, action->service);
+    for (i = 0; i < action->arg_count; i++) {
+        const char *name = action->args[i].name;
+        ptemp += os_sprintf(ptemp, "<%s>%s</%s>", name, arg_values[i], name);
+    }
+    ptemp += os_sprintf(ptemp, "</u:%s>", action->name);
+    os_memcpy(ptemp, envelope_end, sizeof(envelope_end));
+    ptemp += sizeof(envelope_end) - 1;
+
+    request->payload_len = ptemp - request->payload;
+    return true;
+}
+
+bool ICACHE_FLASH_ATTR user_sonos_request_subscribe(const sonos_device *device,
+    uint8 listener_ip[4], int listener_port, int timeout_secs,
+    user_sonos_request_subscribe_callback_t callback, void *user_data)
+{
+    LOCAL const char header[] =
         "SUBSCRIBE /MediaRenderer/AVTransport/Event HTTP/1.1\r\n"
         "Host: " IPSTR ":%d\r\n"
         "User-Agent: lwIP/1.4.0\r\n"
         "CALLBACK: <http://" IPSTR ":%d/notify>\r\n"
         "NT: upnp:event\r\n"
         "TIMEOUT: Second-%d\r\n"
-        "Connection: close\r\n"
+        "Connection: keep-alive\r\n"
         "Content-Length: 0\r\n"
-        "\r\n",
-        IP2STR(request->device.ip), request->device.port,
-        IP2STR(listener_ip), listener_port,
-        timeout_secs);
+        "\r\n";
 
-    request->payload_len = os_strlen(pbuf);
-    request->payload = (char *)os_malloc(request->payload_len + 1);
-    if(!request->payload) {
-        os_free(pbuf);
-        os_free(request);
+    sonos_request *request = sonos_request_new(device, ACTION_SUBSCRIBE,
+        sizeof(header) + SONOS_HEADER_NUMBERS_MAX);
+    if (!request) {
         return false;
     }
 
-    os_strcpy(request->payload, pbuf);
-    os_free(pbuf);
+    request->payload_len = os_sprintf(request->payload, header,
+        IP2STR(request->device.ip), request->device.port,
+        IP2STR(listener_ip), listener_port,
+        timeout_secs);
 
-    request->request_type = REQUEST_SUBSCRIBE;
     request->callback = callback;
     request->user_data = user_data;
 
-    sonos_request_start(request);
-    return true;
+    return sonos_request_start(request);
 }
 
-bool user_sonos_request_resubscribe(const sonos_device *device,
+bool ICACHE_FLASH_ATTR user_sonos_request_resubscribe(const sonos_device *device,
     const char *subscribe_id, int timeout_secs,
     user_sonos_request_subscribe_callback_t callback, void *user_data)
 {
-    sonos_request *request = (sonos_request *)os_zalloc(sizeof(sonos_request));
+    LOCAL const char header[] =
+        "SUBSCRIBE /MediaRenderer/AVTransport/Event HTTP/1.1\r\n"
+        "Host: " IPSTR ":%d\r\n"
+        "SID: %s\r\n"
+        "TIMEOUT: Second-%d\r\n"
+        "Connection: keep-alive\r\n"
+        "Content-Length: 0\r\n"
+        "\r\n";
+
+    sonos_request *request = sonos_request_new(device, ACTION_RESUBSCRIBE,
+        sizeof(header) + SONOS_HEADER_NUMBERS_MAX + os_strlen(subscribe_id));
     if (!request) {
         return false;
     }
 
-    os_memcpy(&request->device, device, sizeof(sonos_device));
+    request->payload_len = os_sprintf(request->payload, header,
+        IP2STR(request->device.ip), request->device.port,
+        subscribe_id, timeout_secs);
 
-    char *pbuf = (char *)os_malloc(PACKET_SIZE);
-    if (!pbuf) {
-        os_free(request);
-        return false;
-    }
+    request->callback = callback;
+    request->user_data = user_data;
 
-    os_sprintf(pbuf,
-        "SUBSCRIBE /MediaRenderer/AVTransport/Event HTTP/1.1\r\n"
+    return sonos_request_start(request);
+}
+
+bool ICACHE_FLASH_ATTR user_sonos_request_get_zone_info(const sonos_device *device,
+    user_sonos_request_zone_callback_t callback, void *user_data)
+{
+    LOCAL const char header[] =
+        "GET /status/zp HTTP/1.1\r\n"
         "Host: " IPSTR ":%d\r\n"
-        "SID: %s\r\n"
-        "TIMEOUT: Second-%d\r\n"
+        "User-Agent: lwIP/1.4.0\r\n"
         "Connection: close\r\n"
-        "Content-Length: 0\r\n"
-        "\r\n",
-        IP2STR(request->device.ip), request->device.port,
-        subscribe_id, timeout_secs);
+        "Cache-Control: no-cache\r\n"
+        "\r\n";
 
-    request->payload_len = os_strlen(pbuf);
-    request->payload = (char *)os_malloc(request->payload_len + 1);
-    if(!request->payload) {
-        os_free(pbuf);
-        os_free(request);
+    sonos_request *request = sonos_request_new(device, ACTION_GET_ZONE_INFO,
+        sizeof(header) + SONOS_HEADER_NUMBERS_MAX);
+    if (!request) {
         return false;
     }
 
-    os_strcpy(request->payload, pbuf);
-    os_free(pbuf);
+    request->payload_len = os_sprintf(request->payload, header,
+        IP2STR(request->device.ip), request->device.port);
 
-    request->request_type = REQUEST_RESUBSCRIBE;
     request->callback = callback;
     request->user_data = user_data;
-    
-    sonos_request_start(request);
+
+    return sonos_request_start(request);
+}
+
+/*
+ * Queue the request behind those of the same or a higher priority,
+ * and send it once a slot is free. If the queue is full, the request
+ * takes the place of the last one of a lower priority, or is refused
+ * and freed without its callback.
+ */
+LOCAL bool ICACHE_FLASH_ATTR sonos_request_start(sonos_request *request)
+{
+    sonos_request_priority priority = request->action->priority;
+    sonos_request **prequest = &pending_requests;
+    sonos_request *last = pending_requests;
+    int queued = 0;
+
+    while (last) {
+        queued++;
+        if (!last->next) {
+            break;
+        }
+        last = last->next;
+    }
+
+    if (queued >= SONOS_REQUEST_MAX_QUEUED) {
+        if (last->action->priority <= priority) {
+            os_printf("Request queue full\n");
+            request->result_notified = true;
+            sonos_request_free(request);
+            return false;
+        }
+        os_printf("Request dropped from the queue\n");
+        notify_request_listener(last, false);
+        sonos_request_free(last);
+    }
+
+    while (*prequest && (*prequest)->action->priority <= priority) {
+        prequest = &(*prequest)->next;
+    }
+    request->next = *prequest;
+    *prequest = request;
+
+    request->time_start = system_get_time();
+    request->time_mark = request->time_start;
+    sonos_stats_count(request, COUNT_REQUESTS);
+
+    // The whole request, waiting, retries and all, must be done by this deadline
+    os_timer_disarm(&request->total_timer);
+    os_timer_setfn(&request->total_timer, (os_timer_func_t *)sonos_request_total_timeout, request);
+    os_timer_arm(&request->total_timer, SONOS_REQUEST_TOTAL_TIMEOUT, 0);
+
+    sonos_request_schedule();
     return true;
 }
 
-LOCAL void ICACHE_FLASH_ATTR sonos_request_start(sonos_request *request)
+/*
+ * Send the waiting requests that there are slots for, in order. Only
+ * playback can use the last of the slots, so a selection never waits
+ * for background work to finish.
+ */
+LOCAL void ICACHE_FLASH_ATTR sonos_request_schedule(void)
 {
-    struct espconn *pespconn = (struct espconn *)os_zalloc(sizeof(struct espconn));
+    if (scheduling) {
+        // Picked up by the loop that is already running
+        return;
+    }
+    scheduling = true;
+
+    while (pending_requests) {
+        sonos_request *request = pending_requests;
+        int slots = SONOS_REQUEST_MAX_ACTIVE;
+
+        if (request->action->priority != PRIORITY_PLAYBACK) {
+            slots -= SONOS_REQUEST_PLAYBACK_SLOTS;
+        }
+        if (active_count >= slots) {
+            break;
+        }
+
+        pending_requests = request->next;
+        request->next = active_requests;
+        active_requests = request;
+        active_count++;
+
+        sonos_stats_time(request, PHASE_QUEUE);
+        sonos_request_attempt(request);
+    }
+
+    scheduling = false;
+}
+
+/*
+ * Cancel the requests made with the user data. Their callbacks
+ * are not called.
+ */
+void ICACHE_FLASH_ATTR user_sonos_request_cancel(void *user_data)
+{
+    sonos_request **lists[] = { &pending_requests, &active_requests };
+    int i;
+
+    for (i = 0; i < TABLE_SIZE(lists); i++) {
+        sonos_request *request = *lists[i];
+        while (request) {
+            sonos_request *next = request->next;
+            if (request->user_data == user_data) {
+                os_printf("Request cancelled\n");
+                request->result_notified = true;
+                sonos_request_abort(request);
+                sonos_request_free(request);
+            }
+            request = next;
+        }
+    }
+}
+
+/*
+ * Send the request over a kept connection to the device if there is
+ * one, or over a new connection.
+ */
+LOCAL void ICACHE_FLASH_ATTR sonos_request_attempt(sonos_request *request)
+{
+    sonos_conn *conn = sonos_conn_find_idle(&request->device);
+
+    request->written = false;
+    request->attempts++;
+    request->time_mark = system_get_time();
+    if (request->attempts > 1) {
+        sonos_stats_count(request, COUNT_RETRY);
+    }
+
+    if (conn) {
+        // Reuse a connection kept open from an earlier request
+        os_timer_disarm(&conn->timer);
+        conn->state = CONN_ACTIVE;
+        conn->request = request;
+        conn->reused = true;
+        request->conn = conn;
+        sonos_stats_count(request, COUNT_REUSED);
+        sonos_conn_send(conn);
+        return;
+    }
+
+    conn = sonos_conn_alloc(&request->device);
+    if (!conn) {
+        sonos_request_failed(request);
+        return;
+    }
+
+    conn->request = request;
+    request->conn = conn;
+    sonos_request_arm(request, SONOS_REQUEST_CONNECT_TIMEOUT);
+    sonos_conn_connect(conn);
+}
+
+/*
+ * Arm the deadline for the current step of the request.
+ */
+LOCAL void ICACHE_FLASH_ATTR sonos_request_arm(sonos_request *request, uint32 timeout_ms)
+{
+    os_timer_disarm(&request->timer);
+    os_timer_setfn(&request->timer, (os_timer_func_t *)sonos_request_timeout, request);
+    os_timer_arm(&request->timer, timeout_ms, 0);
+}
+
+LOCAL void ICACHE_FLASH_ATTR sonos_request_timeout(void *arg)
+{
+    sonos_request *request = (sonos_request *)arg;
+
+    if (!request->conn) {
+        // The wait before retrying is over
+        sonos_request_attempt(request);
+        return;
+    }
+
+    os_printf("Request timed out, attempt %d\n", request->attempts);
+    sonos_stats_count(request, COUNT_TIMEOUT);
+    sonos_request_abort(request);
+    sonos_request_failed(request);
+}
+
+LOCAL void ICACHE_FLASH_ATTR sonos_request_total_timeout(void *arg)
+{
+    sonos_request *request = (sonos_request *)arg;
+
+    os_printf("Request timed out\n");
+    sonos_stats_count(request, COUNT_TIMEOUT);
+
+    sonos_request_abort(request);
+    notify_request_listener(request, false);
+    sonos_request_free(request);
+}
+
+/*
+ * Take the request off its connection, closing the connection
+ * since it may still get the response.
+ */
+LOCAL void ICACHE_FLASH_ATTR sonos_request_abort(sonos_request *request)
+{
+    sonos_conn *conn = request->conn;
+
+    os_timer_disarm(&request->timer);
+    if (!conn) {
+        return;
+    }
+
+    conn->request = NULL;
+    request->conn = NULL;
+    os_timer_disarm(&conn->timer);
+
+    if (conn->pespconn) {
+        // The connection is let go by its callback
+        conn->state = CONN_CLOSING;
+        espconn_abort(conn->pespconn);
+    } else {
+        // Waiting to reconnect
+        sonos_conn_release(conn);
+    }
+}
+
+/*
+ * Try the request again after a short wait, if it can safely be sent
+ * again. Otherwise, or once out of attempts, let the callback know.
+ */
+LOCAL void ICACHE_FLASH_ATTR sonos_request_failed(sonos_request *request)
+{
+    request->conn = NULL;
+
+    if (request->attempts < SONOS_REQUEST_ATTEMPTS && sonos_request_resendable(request)) {
+        uint32 backoff = SONOS_REQUEST_BACKOFF << (request->attempts - 1);
+        os_printf("Request failed, retrying in %d ms\n", backoff);
+        request->retried = false;
+        sonos_request_arm(request, backoff);
+        return;
+    }
+
+    notify_request_listener(request, false);
+    sonos_request_free(request);
+}
+
+/*
+ * Whether the request can be sent again. That is always so if sending
+ * it twice has the same effect as sending it once. Otherwise it is only
+ * so if the last attempt never got as far as a connection, as one that
+ * went out may have been acted on even without a response, and adding
+ * to the queue again would add the track twice.
+ */
+LOCAL bool ICACHE_FLASH_ATTR sonos_request_resendable(const sonos_request *request)
+{
+    return request->action->idempotent || !request->written;
+}
+
+/*
+ * Find a connection to the device that is open, and not in use.
+ */
+LOCAL sonos_conn* ICACHE_FLASH_ATTR sonos_conn_find_idle(const sonos_device *device)
+{
+    int i;
+    for (i = 0; i < SONOS_CONN_POOL_SIZE; i++) {
+        sonos_conn *conn = &sonos_conn_pool[i];
+        if (conn->state == CONN_IDLE && conn->port == device->port
+            && os_memcmp(conn->ip, device->ip, 4) == 0) {
+            return conn;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Take a free slot in the pool for a new connection to the device.
+ * If the pool is full, the connection is made outside of it,
+ * and closed once its request is done.
+ */
+LOCAL sonos_conn* ICACHE_FLASH_ATTR sonos_conn_alloc(const sonos_device *device)
+{
+    sonos_conn *conn = NULL;
+    int i;
+
+    for (i = 0; i < SONOS_CONN_POOL_SIZE; i++) {
+        if (sonos_conn_pool[i].state == CONN_FREE) {
+            conn = &sonos_conn_pool[i];
+            os_bzero(conn, sizeof(sonos_conn));
+            conn->pooled = true;
+            break;
+        }
+    }
+
+    if (!conn) {
+        conn = (sonos_conn *)user_pool_alloc(POOL_SONOS_CONN);
+        if (!conn) {
+            return NULL;
+        }
+    }
+
+    os_memcpy(conn->ip, device->ip, 4);
+    conn->port = device->port;
+    return conn;
+}
+
+LOCAL void ICACHE_FLASH_ATTR sonos_conn_connect(sonos_conn *conn)
+{
+    struct espconn *pespconn = (struct espconn *)user_pool_alloc(POOL_ESPCONN);
+    if (pespconn) {
+        pespconn->proto.tcp = (esp_tcp *)user_pool_alloc(POOL_TCP);
+    }
+    if (!pespconn || !pespconn->proto.tcp) {
+        free_tcp_connection(pespconn);
+        sonos_conn_fail(conn);
+        return;
+    }
+
     pespconn->type = ESPCONN_TCP;
     pespconn->state = ESPCONN_NONE;
-    pespconn->proto.tcp = (esp_tcp *)os_zalloc(sizeof(esp_tcp));
     pespconn->proto.tcp->local_port = espconn_port();
-    pespconn->proto.tcp->remote_port = request->device.port;
-    os_memcpy(pespconn->proto.tcp->remote_ip, request->device.ip, 4);
+    pespconn->proto.tcp->remote_port = conn->port;
+    os_memcpy(pespconn->proto.tcp->remote_ip, conn->ip, 4);
     espconn_regist_connectcb(pespconn, sonos_request_connect_callback);
     espconn_regist_disconcb(pespconn, sonos_request_disconnect_callback);
     espconn_regist_reconcb(pespconn, sonos_request_reconnect_callback);
-    pespconn->reverse = request;
-    espconn_connect(pespconn);
+    pespconn->reverse = conn;
+
+    conn->pespconn = pespconn;
+    conn->state = CONN_CONNECTING;
+    conn->reused = false;
+
+    if (espconn_connect(pespconn) != ESPCONN_OK) {
+        free_tcp_connection(pespconn);
+        conn->pespconn = NULL;
+        sonos_conn_fail(conn);
+    }
+}
+
+LOCAL void ICACHE_FLASH_ATTR sonos_conn_send(sonos_conn *conn)
+{
+    sonos_request *request = conn->request;
+    int result;
+
+    request->response_len = 0;
+    request->written = true;
+    os_bzero(&request->info, sizeof(request->info));
+    sonos_response_init(&request->response, request->action->fields, request->action->field_count,
+        &request->info);
+
+    sonos_request_arm(request, SONOS_REQUEST_RESPONSE_TIMEOUT);
+
+    result = espconn_sent(conn->pespconn, (uint8 *)request->payload, request->payload_len);
+    if (result != ESPCONN_OK) {
+        os_printf("espconn_sent error: %d\n", result);
+        // Let the disconnect callback decide whether to retry
+        espconn_disconnect(conn->pespconn);
+    }
 }
 
 LOCAL void ICACHE_FLASH_ATTR sonos_request_connect_callback(void *arg)
 {
-    int result = 0;
     struct espconn *pespconn = (struct espconn *)arg;
-    sonos_request *request = (sonos_request *)pespconn->reverse;
+    sonos_conn *conn = (sonos_conn *)pespconn->reverse;
 
     //os_printf("sonos_request_connect_callback\n");
 
     espconn_regist_sentcb(pespconn, sonos_request_sent_callback);
     espconn_regist_recvcb(pespconn, sonos_request_recv_callback);
 
-    result = espconn_sent(pespconn, (uint8 *)request->payload, request->payload_len);
-    if (result != ESPCONN_OK) {
-        os_printf("espconn_sent error: %d\n", result);
+    conn->state = CONN_ACTIVE;
+    if (conn->request) {
+        sonos_stats_time(conn->request, PHASE_CONNECT);
     }
+    sonos_conn_send(conn);
 }
 
 LOCAL void ICACHE_FLASH_ATTR sonos_request_disconnect_callback(void *arg)
 {
     struct espconn *pespconn = (struct espconn *)arg;
-    sonos_request *request = (sonos_request *)pespconn->reverse;
+    sonos_conn *conn = (sonos_conn *)pespconn->reverse;
 
     //os_printf("sonos_request_disconnect_callback\n");
 
-    int response_code = 0;
-    bool is_success = false;
-    char *hstart = NULL;
-    char *pstart = NULL;
-
-    if (request && request->response_len > 9 && os_strncmp(request->response_buf, "HTTP/1.1 ", 9) == 0) {
-        long int code = strtol(request->response_buf + 9, NULL, 10);
-        if(code >= 0 && code <= 999) {
-            response_code = code;
-        }
-        hstart = (char *)os_strstr(request->response_buf + 9, "\r\n");
-        if (hstart) {
-            hstart += 2;
-            pstart = (char *)os_strstr(hstart, "\r\n\r\n");
-            if (pstart) {
-                pstart += 4;
-            }
-        }
-    }
+    sonos_conn_closed(conn);
+}
 
-    is_success = (response_code == 200);
+LOCAL void ICACHE_FLASH_ATTR sonos_request_reconnect_callback(void *arg, sint8 err)
+{
+    struct espconn *pespconn = (struct espconn *)arg;
+    sonos_conn *conn = (sonos_conn *)pespconn->reverse;
 
-    os_printf("Request complete, code=%d\n", response_code);
+    os_printf("sonos_request_reconnect_callback, err=%d\n", err);
 
-    if (is_success && pstart && request->request_type == REQUEST_ADD_URI) {
-        char *ptemp = NULL;
-        char *qtemp = NULL;
-        char buf[128];
-
-        sonos_add_uri_info info;
-        os_bzero(&info, sizeof(sonos_add_uri_info));
-
-        ptemp = (char *)os_strstr(pstart, "<FirstTrackNumberEnqueued>");
-        if (ptemp) {
-            ptemp += 26;
-            qtemp = (char *)os_strstr(ptemp, "</FirstTrackNumberEnqueued>");
-            if (qtemp) {
-                int n = MIN(qtemp - ptemp, 127);
-                os_memcpy(buf, ptemp, n);
-                buf[n] = '\0';
-                long int num = strtol(buf, NULL, 10);
-                if (num >= 0 && num < INT_MAX) {
-                    info.first_track_num_enqueued = num;
-                }
-            }
-        }
+    if (conn && conn->request) {
+        // Not one that was aborted, as that is taken off its request first
+        sonos_stats_count(conn->request, COUNT_CONN_ERROR);
+    }
 
-        ptemp = (char *)os_strstr(pstart, "<NumTracksAdded>");
-        if (ptemp) {
-            ptemp += 16;
-            qtemp = (char *)os_strstr(ptemp, "</NumTracksAdded>");
-            if (qtemp) {
-                int n = MIN(qtemp - ptemp, 127);
-                os_memcpy(buf, ptemp, n);
-                buf[n] = '\0';
-                long int num = strtol(buf, NULL, 10);
-                if (num >= 0 && num < INT_MAX) {
-                    info.num_tracks_added = num;
-                }
-            }
-        }
+    sonos_conn_closed(conn);
+}
 
-        ptemp = (char *)os_strstr(pstart, "<NewQueueLength>");
-        if (ptemp) {
-            ptemp += 16;
-            qtemp = (char *)os_strstr(ptemp, "</NewQueueLength>");
-            if (qtemp) {
-                int n = MIN(qtemp - ptemp, 127);
-                os_memcpy(buf, ptemp, n);
-                buf[n] = '\0';
-                long int num = strtol(buf, NULL, 10);
-                if (num >= 0 && num < INT_MAX) {
-                    info.new_queue_length = num;
-                }
-            }
-        }
+/*
+ * Handle the connection having been closed, by either end. A request
+ * sent over a kept connection that the device had already given up
+ * on is sent again over a new connection, before giving up on it, if
+ * it can safely be sent again.
+ */
+LOCAL void ICACHE_FLASH_ATTR sonos_conn_closed(sonos_conn *conn)
+{
+    sonos_request *request;
 
-        ((user_sonos_request_add_uri_callback_t)request->callback)(
-            &info, request->user_data, is_success);
-        request->result_notified = true;
+    if (!conn) {
+        return;
     }
-    else if (is_success && pstart && request->request_type == REQUEST_GET_POSITION_INFO) {
-        char *ptemp = NULL;
-        char *qtemp = NULL;
-        char buf[128];
-
-        sonos_position_info info;
-        os_bzero(&info, sizeof(sonos_position_info));
-
-        ptemp = (char *)os_strstr(pstart, "<Track>");
-        if (ptemp) {
-            ptemp += 7;
-            qtemp = (char *)os_strstr(ptemp, "</Track>");
-            if (qtemp) {
-                int n = MIN(qtemp - ptemp, 127);
-                os_memcpy(buf, ptemp, n);
-                buf[n] = '\0';
-                long int track_value = strtol(buf, NULL, 10);
-                if (track_value >= 0 && track_value < INT_MAX) {
-                    info.track = track_value;
-                }
-            }
-        }
-
-        ptemp = (char *)os_strstr(pstart, "<TrackDuration>");
-        if (ptemp) {
-            ptemp += 15;
-            qtemp = (char *)os_strstr(ptemp, "</TrackDuration>");
-            if (qtemp) {
-                int n = MIN(qtemp - ptemp, 127);
-                os_memcpy(buf, ptemp, n);
-                buf[n] = '\0';
-                int duration_value = str_to_seconds(buf);
-                if (duration_value >= 0) {
-                    info.track_duration = duration_value;
-                }
-            }
-        }
 
-        ptemp = (char *)os_strstr(pstart, "<TrackURI>");
-        if (ptemp) {
-            ptemp += 10;
-            qtemp = (char *)os_strstr(ptemp, "</TrackURI>");
-            if (qtemp) {
-                int n = MIN(qtemp - ptemp, sizeof(info.track_uri) - 1);
-                os_memcpy(info.track_uri, ptemp, n);
-                info.track_uri[n] = '\0';
-            }
-        }
+    os_timer_disarm(&conn->timer);
+    request = conn->request;
+    free_tcp_connection(conn->pespconn);
+    conn->pespconn = NULL;
+
+    if (request && request->response_len == 0 && conn->reused && !request->retried
+        && sonos_request_resendable(request)) {
+        os_printf("Kept connection closed, reconnecting\n");
+        request->retried = true;
+        sonos_stats_count(request, COUNT_RETRY);
+        conn->state = CONN_RECONNECT;
+
+        // Connect again once out of the callback for the old connection
+        os_timer_setfn(&conn->timer, (os_timer_func_t *)sonos_conn_timer_func, conn);
+        os_timer_arm(&conn->timer, 1, 0);
+        return;
+    }
 
-        ptemp = (char *)os_strstr(pstart, "<RelTime>");
-        if (ptemp) {
-            ptemp += 9;
-            qtemp = (char *)os_strstr(ptemp, "</RelTime>");
-            if (qtemp) {
-                int n = MIN(qtemp - ptemp, 127);
-                os_memcpy(buf, ptemp, n);
-                buf[n] = '\0';
-                int rel_value = str_to_seconds(buf);
-                if (rel_value >= 0) {
-                    info.rel_time = rel_value;
-                }
-            }
+    conn->request = NULL;
+    if (request) {
+        request->conn = NULL;
+        if (request->response_len == 0) {
+            sonos_request_failed(request);
+        } else {
+            sonos_request_complete(request);
         }
+    }
+    sonos_conn_release(conn);
+}
 
-        ((user_sonos_request_position_callback_t)request->callback)(
-            &info, request->user_data, is_success);
-        request->result_notified = true;
+/*
+ * Connection timer, for closing an idle connection, or for
+ * reconnecting a closed one.
+ */
+LOCAL void ICACHE_FLASH_ATTR sonos_conn_timer_func(void *arg)
+{
+    sonos_conn *conn = (sonos_conn *)arg;
+
+    os_timer_disarm(&conn->timer);
+
+    switch (conn->state) {
+    case CONN_RECONNECT:
+        conn->request->time_mark = system_get_time();
+        sonos_request_arm(conn->request, SONOS_REQUEST_CONNECT_TIMEOUT);
+        sonos_conn_connect(conn);
+        break;
+    case CONN_IDLE:
+    case CONN_CLOSING:
+        conn->state = CONN_CLOSING;
+        espconn_disconnect(conn->pespconn);
+        break;
+    default:
+        break;
     }
-    else if (is_success && hstart && (request->request_type == REQUEST_SUBSCRIBE
-            || request->request_type == REQUEST_RESUBSCRIBE)) {
-        sonos_subscribe_info info;
-        os_bzero(&info, sizeof(sonos_subscribe_info));
-
-        char *ptemp = hstart;
-        char *qtemp = (char *)os_strstr(ptemp, "\r\n");
-        while (ptemp && qtemp && (qtemp - ptemp > 0) && !(pstart && ptemp == pstart)) {
-            int n = qtemp - ptemp;
-            if (n > 5 && os_strncmp(ptemp, "SID: ", 5) == 0) {
-                ptemp += 5; n -= 5;
-                if (n > sizeof(info.subscribe_id) - 1) {
-                    os_printf("SID too long: n=%d\n", n);
-                    break;
-                }
-                os_memcpy(info.subscribe_id, ptemp, n);
-                info.subscribe_id[n] = '\0';
-            }
-            else if (n > 16 && os_strncmp(ptemp, "TIMEOUT: Second-", 16) == 0) {
-                ptemp += 16; n -= 16;
-                long int sec_value = strtol(ptemp, NULL, 10);
-                if (sec_value <= 0 || sec_value > INT_MAX) {
-                    os_printf("Timeout invalid: t=%ld\n", sec_value);
-                    break;
-                }
-                info.timeout_secs = sec_value;
-            }
+}
 
-            qtemp += 2;
-            ptemp = qtemp;
-            qtemp = (char *)os_strstr(ptemp, "\r\n");
-        }
+/*
+ * Let go of a connection that could not be made, and fail its request.
+ */
+LOCAL void ICACHE_FLASH_ATTR sonos_conn_fail(sonos_conn *conn)
+{
+    sonos_request *request = conn->request;
 
-        ((user_sonos_request_subscribe_callback_t)request->callback)(
-            &info, request->user_data, is_success);
-        request->result_notified = true;
-    }
-    else {
-        notify_request_listener(request, is_success);
+    conn->request = NULL;
+    sonos_conn_release(conn);
+    if (request) {
+        sonos_stats_count(request, COUNT_CONN_ERROR);
+        sonos_request_failed(request);
     }
-
-    free_tcp_connection(pespconn);
 }
 
-LOCAL void ICACHE_FLASH_ATTR sonos_request_reconnect_callback(void *arg, sint8 err)
+LOCAL void ICACHE_FLASH_ATTR sonos_conn_release(sonos_conn *conn)
 {
-    struct espconn *pespconn = (struct espconn *)arg;
-    os_printf("sonos_request_reconnect_callback, err=%d\n", err);
-    free_tcp_connection(pespconn);
+    os_timer_disarm(&conn->timer);
+    conn->state = CONN_FREE;
+    if (!conn->pooled) {
+        user_pool_free(POOL_SONOS_CONN, conn);
+    }
 }
 
 LOCAL void ICACHE_FLASH_ATTR sonos_request_sent_callback(void *arg)
 {
     struct espconn *pespconn = (struct espconn *)arg;
-    sonos_request *request = (sonos_request *)pespconn->reverse;
+    sonos_conn *conn = (sonos_conn *)pespconn->reverse;
 
-    os_printf("sonos_request_sent_callback\n");
+    //os_printf("sonos_request_sent_callback\n");
 
-    if (request->payload) {
-        os_free(request->payload);
-        request->payload = NULL;
+    if (conn && conn->request && conn->request->response_len == 0) {
+        sonos_stats_time(conn->request, PHASE_SEND);
     }
-    request->payload_len = 0;
+
+    // The payload is kept until the response arrives,
+    // in case it has to be sent again.
 }
 
 LOCAL void ICACHE_FLASH_ATTR sonos_request_recv_callback(void *arg, char *pusrdata, unsigned short length)
 {
     struct espconn *pespconn = (struct espconn *)arg;
-    sonos_request *request = (sonos_request *)pespconn->reverse;
+    sonos_conn *conn = (sonos_conn *)pespconn->reverse;
+    sonos_request *request = conn ? conn->request : NULL;
 
     //os_printf("sonos_request_recv_callback, state=%d\n", pespconn->state);
 
+    if (!request) {
+        // Nothing was asked for
+        return;
+    }
+
     if (pusrdata && length > 0) {
-        if (!request->response_buf) {
-            request->response_buf = (char *)os_malloc(PACKET_SIZE);
-            request->response_len = 0;
+        if (request->response_len == 0) {
+            // The response has started, the total deadline still holds
+            os_timer_disarm(&request->timer);
+            sonos_stats_time(request, PHASE_WAIT);
         }
-        int n = MIN(length, PACKET_SIZE - request->response_len - 1);
-        if (n > 0) {
-            os_memcpy(request->response_buf + request->response_len, pusrdata, n);
-            request->response_len += n;
-            request->response_buf[request->response_len] = '\0';
+        request->response_len += length;
+        if (sonos_response_feed(&request->response, pusrdata, length) < length) {
+            // More than was framed, the connection is out of step
+            os_printf("Response overrun, closing connection\n");
+            request->response.keep_alive = false;
         }
     }
 
-    if (request->response_len >= PACKET_SIZE - 1
-        || os_strstr(request->response_buf, "</s:Envelope>")) {
-        // Use a short timer delay for the actual disconnect call,
-        // per recommendation from the docs.
-        os_timer_disarm(&request->disconnect_timer);
-        os_timer_setfn(&request->disconnect_timer, (os_timer_func_t *)sonos_request_disconnect_wait, pespconn);
-        os_timer_arm(&request->disconnect_timer, 10, 0);
+    if (request->response.state == RESPONSE_DONE) {
+        conn->request = NULL;
+        request->conn = NULL;
+
+        // Settle the connection before the callback, so the
+        // next request it makes can reuse it.
+        if (conn->pooled && request->response.keep_alive) {
+            // Keep the connection for the next request,
+            // unless it goes unused for too long.
+            conn->state = CONN_IDLE;
+            os_timer_disarm(&conn->timer);
+            os_timer_setfn(&conn->timer, (os_timer_func_t *)sonos_conn_timer_func, conn);
+            os_timer_arm(&conn->timer, SONOS_CONN_IDLE_TIMEOUT, 0);
+        } else {
+            // Use a short timer delay for the actual disconnect call,
+            // per recommendation from the docs.
+            conn->state = CONN_CLOSING;
+            os_timer_disarm(&conn->timer);
+            os_timer_setfn(&conn->timer, (os_timer_func_t *)sonos_conn_timer_func, conn);
+            os_timer_arm(&conn->timer, 10, 0);
+        }
+
+        sonos_request_complete(request);
     }
 }
 
-LOCAL void ICACHE_FLASH_ATTR sonos_request_disconnect_wait(void *arg)
+/*
+ * Parse the response, and pass the result on to the callback.
+ * The request is freed afterwards.
+ */
+LOCAL void ICACHE_FLASH_ATTR sonos_request_complete(sonos_request *request)
 {
-    //os_printf("sonos_request_disconnect_wait\n");
-    struct espconn *pespconn = (struct espconn *)arg;
+    int response_code = request->response.code;
+    bool is_success;
+
+    if (request->response.state != RESPONSE_DONE) {
+        sonos_response_finish(&request->response);
+    }
+    if (request->response.truncated) {
+        os_printf("Response truncated, len=%d\n", request->response.body_len);
+    }
+    is_success = (response_code == 200 && !request->response.truncated);
+
+    os_printf("Request complete, code=%d\n", response_code);
+
+    sonos_stats_time(request, PHASE_RECEIVE);
+    sonos_stats_time(request, PHASE_TOTAL);
+    sonos_stats_count(request, is_success ? COUNT_OK : COUNT_HTTP_ERROR);
+
+    if (is_success && request->action->field_count > 0 && request->callback) {
+        ((sonos_request_info_callback_t)request->callback)(
+            &request->info, request->user_data, is_success);
+        request->result_notified = true;
+    }
+    else {
+        notify_request_listener(request, is_success);
+    }
+
+    sonos_request_free(request);
+}
+
+LOCAL void ICACHE_FLASH_ATTR sonos_request_free(sonos_request *request)
+{
+    bool was_active = false;
+
+    if (!sonos_request_unlink(&pending_requests, request)
+        && sonos_request_unlink(&active_requests, request)) {
+        active_count--;
+        was_active = true;
+    }
+
+    os_timer_disarm(&request->timer);
+    os_timer_disarm(&request->total_timer);
+
+    user_pool_buffer_free(request->payload);
 
-    if(pespconn) {
-        sonos_request *request = (sonos_request *)pespconn->reverse;
-        os_timer_disarm(&request->disconnect_timer);
-        espconn_disconnect(pespconn);
+    notify_request_listener(request, false);
+
+    user_pool_free(POOL_SONOS_REQUEST, request);
+
+    if (was_active) {
+        // Its slot is free for the next one
+        sonos_request_schedule();
     }
 }
 
+LOCAL bool ICACHE_FLASH_ATTR sonos_request_unlink(sonos_request **list, sonos_request *request)
+{
+    while (*list && *list != request) {
+        list = &(*list)->next;
+    }
+    if (!*list) {
+        return false;
+    }
+    *list = request->next;
+    return true;
+}
+
 LOCAL void ICACHE_FLASH_ATTR notify_request_listener(sonos_request *request, bool is_success)
 {
     if (request && !request->result_notified && request->callback) {
-        switch(request->request_type) {
-        case REQUEST_SET_TRANSPORT:
-        case REQUEST_SEEK:
-        case REQUEST_PLAY:
+        if (request->action->field_count > 0) {
+            ((sonos_request_info_callback_t)request->callback)(
+                NULL, request->user_data, is_success);
+        } else {
             ((user_sonos_request_callback_t)request->callback)(
                 request->user_data, is_success);
-            break;
-        case REQUEST_ADD_URI:
-            ((user_sonos_request_add_uri_callback_t)request->callback)(
-                NULL, request->user_data, is_success);
-            break;
-        case REQUEST_GET_POSITION_INFO:
-            ((user_sonos_request_position_callback_t)request->callback)(
-                NULL, request->user_data, is_success);
-            break;
-        case REQUEST_SUBSCRIBE:
-        case REQUEST_RESUBSCRIBE:
-            ((user_sonos_request_subscribe_callback_t)request->callback)(
-                NULL, request->user_data, is_success);
-            break;
-        default:
-            break;
         }
     }
     if (request) {
@@ -691,32 +1328,93 @@ LOCAL void ICACHE_FLASH_ATTR notify_request_listener(sonos_request *request, boo
     }
 }
 
+
 LOCAL void ICACHE_FLASH_ATTR free_tcp_connection(struct espconn *pespconn)
 {
     //os_printf("free_tcp_connection\n");
     if (pespconn) {
-        sonos_request *request = (sonos_request *)pespconn->reverse;
+        pespconn->reverse = NULL;
 
-        os_timer_disarm(&request->disconnect_timer);
+        user_pool_free(POOL_TCP, pespconn->proto.tcp);
+        user_pool_free(POOL_ESPCONN, pespconn);
+    }
+}
 
-        if (request->payload) {
-            os_free(request->payload);
-        }
+void ICACHE_FLASH_ATTR user_sonos_request_stats_reset(void)
+{
+    os_bzero(action_stats, sizeof(action_stats));
+}
 
-        if (request->response_buf) {
-            os_free(request->response_buf);
-            request->response_buf = NULL;
+/*
+ * Write part of the request statistics as JSON, one action per part,
+ * so the whole report does not have to fit in one buffer. Returns the
+ * length written, or 0 once all the parts have been written.
+ */
+int ICACHE_FLASH_ATTR user_sonos_request_stats_json(int part, char *buf, int buf_len)
+{
+    const sonos_action_stats *stats;
+    int n = 0;
+    int i;
+    int j;
+
+    if (part == 0) {
+        n += os_sprintf(buf + n, "{\"bins_ms\": [");
+        for (i = 0; i < SONOS_STATS_BINS; i++) {
+            n += os_sprintf(buf + n, "%s%d", (i > 0) ? ", " : "",
+                (i == 0) ? 0 : (SONOS_STATS_BIN_MIN << (i - 1)));
         }
-        request->response_len = 0;
+        n += os_sprintf(buf + n, "], \"actions\": {");
+        return n;
+    }
 
-        notify_request_listener(request, false);
+    if (part > MAX_ACTIONS) {
+        return 0;
+    }
 
-        os_free(request);
-        pespconn->reverse = NULL;
+    stats = &action_stats[part - 1];
+    n += os_sprintf(buf + n,
+        "%s\"%s\": {\"requests\": %d, \"ok\": %d, \"http_errors\": %d, \"timeouts\": %d, "
+        "\"conn_errors\": %d, \"retries\": %d, \"reused\": %d",
+        (part > 1) ? ", " : "", action_stats_names[part - 1],
+        stats->counters[COUNT_REQUESTS], stats->counters[COUNT_OK],
+        stats->counters[COUNT_HTTP_ERROR], stats->counters[COUNT_TIMEOUT],
+        stats->counters[COUNT_CONN_ERROR], stats->counters[COUNT_RETRY],
+        stats->counters[COUNT_REUSED]);
+    for (i = 0; i < SONOS_PHASES; i++) {
+        n += os_sprintf(buf + n, ", \"%s\": [", phase_names[i]);
+        for (j = 0; j < SONOS_STATS_BINS && buf_len - n > 16; j++) {
+            n += os_sprintf(buf + n, "%s%d", (j > 0) ? ", " : "", stats->phases[i][j]);
+        }
+        n += os_sprintf(buf + n, "]");
+    }
+    n += os_sprintf(buf + n, (part == MAX_ACTIONS) ? "}}}" : "}");
+    return n;
+}
 
-        if (pespconn->proto.tcp) {
-            os_free(pespconn->proto.tcp);
+LOCAL void ICACHE_FLASH_ATTR sonos_stats_count(const sonos_request *request, sonos_stats_counter counter)
+{
+    action_stats[request->action - actions].counters[counter]++;
+}
+
+/*
+ * Add the time since the phase began to its histogram, and start the
+ * next phase. The total is timed from when the request was made.
+ */
+LOCAL void ICACHE_FLASH_ATTR sonos_stats_time(sonos_request *request, sonos_stats_phase phase)
+{
+    uint16 *histogram = action_stats[request->action - actions].phases[phase];
+    uint32 now = system_get_time();
+    uint32 ms = (now - ((phase == PHASE_TOTAL) ? request->time_start : request->time_mark)) / 1000;
+    int bin = 0;
+
+    if (ms >= SONOS_STATS_BIN_MIN) {
+        bin = 1 + (31 - __builtin_clz(ms)) - SONOS_STATS_BIN_SHIFT;
+        if (bin >= SONOS_STATS_BINS) {
+            bin = SONOS_STATS_BINS - 1;
         }
-        os_free(pespconn);
     }
+    if (histogram[bin] < UINT16_MAX) {
+        histogram[bin]++;
+    }
+    request->time_mark = now;
 }
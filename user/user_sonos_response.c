@@ -0,0 +1,556 @@
+#include "user_sonos_response.h"
+
+#include <ets_sys.h>
+#include <osapi.h>
+#include <limits.h>
+#include <sys/param.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "user_util.h"
+
+LOCAL void ICACHE_FLASH_ATTR response_line(sonos_response *response);
+LOCAL void ICACHE_FLASH_ATTR response_header(sonos_response *response, const char *line);
+LOCAL void ICACHE_FLASH_ATTR response_headers_end(sonos_response *response);
+LOCAL void ICACHE_FLASH_ATTR response_chunk_line(sonos_response *response);
+LOCAL void ICACHE_FLASH_ATTR response_framing_error(sonos_response *response);
+LOCAL void ICACHE_FLASH_ATTR response_body_input(sonos_response *response, char c);
+LOCAL void ICACHE_FLASH_ATTR response_entity_end(sonos_response *response);
+LOCAL void ICACHE_FLASH_ATTR response_body_byte(sonos_response *response, char c);
+LOCAL void ICACHE_FLASH_ATTR response_tag_named(sonos_response *response, char c);
+LOCAL void ICACHE_FLASH_ATTR response_attribute(sonos_response *response, char c);
+LOCAL void ICACHE_FLASH_ATTR response_tag(sonos_response *response);
+LOCAL void ICACHE_FLASH_ATTR response_text(sonos_response *response, char c);
+LOCAL void ICACHE_FLASH_ATTR response_capture_end(sonos_response *response);
+LOCAL void ICACHE_FLASH_ATTR response_value(sonos_response *response,
+    const sonos_response_field *field, const char *value, int len);
+LOCAL bool ICACHE_FLASH_ATTR response_body_done(sonos_response *response);
+
+void ICACHE_FLASH_ATTR sonos_response_init(sonos_response *response,
+    const sonos_response_field *fields, int field_count, void *result)
+{
+    os_bzero(response, sizeof(sonos_response));
+    response->content_length = -1;
+    response->keep_alive = true;
+    response->fields = fields;
+    response->field_count = field_count;
+    response->result = result;
+}
+
+/*
+ * Parse the next chunk of the response, which may end anywhere.
+ * Returns the number of bytes used, which is less than the length
+ * if the response ended partway through the chunk.
+ */
+int ICACHE_FLASH_ATTR sonos_response_feed(sonos_response *response, const char *data, int len)
+{
+    int i;
+
+    for (i = 0; i < len && response->state != RESPONSE_DONE; i++) {
+        char c = data[i];
+
+        if (response->state == RESPONSE_BODY) {
+            response->body_len++;
+            response_body_input(response, c);
+            if (response_body_done(response)) {
+                response_capture_end(response);
+                response->state = RESPONSE_DONE;
+            }
+            continue;
+        }
+
+        if (response->state == RESPONSE_CHUNK_DATA) {
+            response->body_len++;
+            response_body_input(response, c);
+            if (--response->chunk_left == 0) {
+                response->state = RESPONSE_CHUNK_END;
+            }
+            continue;
+        }
+
+        if (c == '\n') {
+            // The size leads a chunk line, so one cut short still has it
+            if (!response->line_overflow || response->state == RESPONSE_CHUNK_SIZE) {
+                response->line[response->line_len] = '\0';
+                response_line(response);
+            }
+            response->line_len = 0;
+            response->line_overflow = false;
+        }
+        else if (c != '\r') {
+            if (response->line_len < SONOS_RESPONSE_LINE_MAX - 1) {
+                response->line[response->line_len++] = c;
+            } else {
+                response->line_overflow = true;
+            }
+        }
+    }
+    return i;
+}
+
+/*
+ * End the response where it is, once the connection has closed.
+ */
+void ICACHE_FLASH_ATTR sonos_response_finish(sonos_response *response)
+{
+    // An element cut off by the end of the response is not used
+    response->capture = NULL;
+    response->keep_alive = false;
+
+    if (response->state == RESPONSE_BODY) {
+        // Up to the close is all there is, unless a length was given
+        response->truncated = (response->content_length >= 0);
+    } else if (response->state != RESPONSE_DONE) {
+        response->truncated = true;
+    }
+    response->state = RESPONSE_DONE;
+}
+
+LOCAL void ICACHE_FLASH_ATTR response_line(sonos_response *response)
+{
+    int i;
+
+    if (response->state == RESPONSE_STATUS) {
+        for (i = 0; i < response->field_count; i++) {
+            const sonos_response_field *field = &response->fields[i];
+            if (field->source == RESPONSE_START) {
+                response_value(response, field, response->line, response->line_len);
+            }
+        }
+        if (os_strncmp(response->line, "HTTP/1.", 7) == 0 && response->line[8] == ' ') {
+            long int code = strtol(response->line + 9, NULL, 10);
+            if (code >= 0 && code <= 999) {
+                response->code = code;
+            }
+            if (response->line[7] == '0') {
+                // HTTP/1.0 closes the connection unless asked not to
+                response->keep_alive = false;
+            }
+        }
+        response->state = RESPONSE_HEADERS;
+        return;
+    }
+
+    if (response->state != RESPONSE_HEADERS) {
+        response_chunk_line(response);
+        return;
+    }
+
+    if (response->line_len > 0) {
+        response_header(response, response->line);
+        return;
+    }
+
+    // Blank line at the end of the headers
+    response_headers_end(response);
+}
+
+LOCAL void ICACHE_FLASH_ATTR response_headers_end(sonos_response *response)
+{
+    if (response->code >= 100 && response->code < 200) {
+        // Interim response, the real one follows it
+        response->code = 0;
+        response->content_length = -1;
+        response->chunked = false;
+        response->state = RESPONSE_STATUS;
+        return;
+    }
+
+    if (response->code == 204 || response->code == 304) {
+        // Never has a body, whatever the headers say
+        response->content_length = 0;
+        response->chunked = false;
+    }
+
+    if (response->chunked) {
+        // Takes the place of any length that was also given
+        response->content_length = -1;
+        response->state = RESPONSE_CHUNK_SIZE;
+        return;
+    }
+
+    if (response->content_length < 0) {
+        // Runs until the connection closes, which leaves nothing to reuse
+        response->keep_alive = false;
+    }
+    response->state = response_body_done(response) ? RESPONSE_DONE : RESPONSE_BODY;
+}
+
+/*
+ * Lines between the chunks of a chunked body: the size that leads
+ * each chunk, the line break that ends it, and any trailer headers
+ * after the last one.
+ */
+LOCAL void ICACHE_FLASH_ATTR response_chunk_line(sonos_response *response)
+{
+    char *ptemp = NULL;
+    long int size;
+
+    switch (response->state) {
+    case RESPONSE_CHUNK_SIZE:
+        size = strtol(response->line, &ptemp, 16);
+        if (ptemp == response->line || size < 0 || size >= INT_MAX
+            || (*ptemp != '\0' && *ptemp != ';' && *ptemp != ' ' && *ptemp != '\t')) {
+            response_framing_error(response);
+        } else if (size == 0) {
+            response_capture_end(response);
+            response->state = RESPONSE_TRAILER;
+        } else {
+            response->chunk_left = size;
+            response->state = RESPONSE_CHUNK_DATA;
+        }
+        break;
+    case RESPONSE_CHUNK_END:
+        if (response->line_len > 0) {
+            response_framing_error(response);
+        } else {
+            response->state = RESPONSE_CHUNK_SIZE;
+        }
+        break;
+    case RESPONSE_TRAILER:
+        if (response->line_len == 0) {
+            response->state = RESPONSE_DONE;
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+/*
+ * End a response whose body cannot be followed, keeping what was
+ * read of it, but not the connection.
+ */
+LOCAL void ICACHE_FLASH_ATTR response_framing_error(sonos_response *response)
+{
+    os_printf("Response framing invalid: line=%s\n", response->line);
+    response->capture = NULL;
+    response->keep_alive = false;
+    response->truncated = true;
+    response->state = RESPONSE_DONE;
+}
+
+LOCAL void ICACHE_FLASH_ATTR response_header(sonos_response *response, const char *line)
+{
+    int i;
+
+    if (strncasecmp(line, "Content-Length:", 15) == 0) {
+        char *ptemp = NULL;
+        long int value = strtol(line + 15, &ptemp, 10);
+        if (ptemp != line + 15 && value >= 0 && value < INT_MAX) {
+            response->content_length = value;
+        }
+        return;
+    }
+
+    if (strncasecmp(line, "Transfer-Encoding:", 18) == 0) {
+        const char *ptemp = line + 18;
+        while (*ptemp != '\0') {
+            if (strncasecmp(ptemp, "chunked", 7) == 0) {
+                response->chunked = true;
+                break;
+            }
+            ptemp++;
+        }
+        return;
+    }
+
+    if (strncasecmp(line, "Connection:", 11) == 0) {
+        const char *ptemp = line + 11;
+        while (*ptemp == ' ') {
+            ptemp++;
+        }
+        response->keep_alive = (strncasecmp(ptemp, "close", 5) != 0);
+        return;
+    }
+
+    for (i = 0; i < response->field_count; i++) {
+        const sonos_response_field *field = &response->fields[i];
+        int n = os_strlen(field->name);
+        if (field->source == RESPONSE_HEADER && strncasecmp(line, field->name, n) == 0) {
+            const char *ptemp = line + n;
+            while (*ptemp == ' ') {
+                ptemp++;
+            }
+            n = os_strlen(ptemp);
+            if (field->type == RESPONSE_TEXT && n > field->size - 1) {
+                // A cut short identifier would be of no use
+                os_printf("%s too long: n=%d\n", field->name, n);
+                return;
+            }
+            response_value(response, field, ptemp, n);
+            return;
+        }
+    }
+}
+
+/*
+ * Pass a byte of the body on to the tokenizer, decoding any character
+ * entities first if the body has escaped markup in it. The decoded
+ * characters are not decoded again, so markup escaped twice over is
+ * left as text.
+ */
+LOCAL void ICACHE_FLASH_ATTR response_body_input(sonos_response *response, char c)
+{
+    if (!response->unescape) {
+        response_body_byte(response, c);
+        return;
+    }
+
+    if (response->entity_len == 0) {
+        if (c == '&') {
+            response->entity[response->entity_len++] = c;
+        } else {
+            response_body_byte(response, c);
+        }
+        return;
+    }
+
+    response->entity[response->entity_len++] = c;
+    if (c == ';' || response->entity_len == SONOS_RESPONSE_ENTITY_MAX - 1) {
+        response_entity_end(response);
+    }
+}
+
+LOCAL void ICACHE_FLASH_ATTR response_entity_end(sonos_response *response)
+{
+    LOCAL const char *entities[] = { "&lt;", "&gt;", "&quot;", "&apos;", "&amp;" };
+    LOCAL const char characters[] = { '<', '>', '"', '\'', '&' };
+    int len = response->entity_len;
+    int i;
+
+    response->entity[len] = '\0';
+    response->entity_len = 0;
+
+    for (i = 0; i < sizeof(characters); i++) {
+        if (os_strcmp(response->entity, entities[i]) == 0) {
+            response_body_byte(response, characters[i]);
+            return;
+        }
+    }
+
+    // Not one that is known, so it stands as it is
+    for (i = 0; i < len; i++) {
+        response_body_byte(response, response->entity[i]);
+    }
+}
+
+/*
+ * Tokenize the body, one byte at a time. The text of an element
+ * that is wanted is kept until its next tag, as is the val attribute
+ * of an element whose value is wanted. Anything else is only looked
+ * at for the tag names.
+ */
+LOCAL void ICACHE_FLASH_ATTR response_body_byte(sonos_response *response, char c)
+{
+    if (c == '<') {
+        response_capture_end(response);
+        response->in_tag = true;
+        response->tag_named = false;
+        response->tag_len = 0;
+        response->tag_last = 0;
+        response->value_field = NULL;
+        return;
+    }
+
+    if (!response->in_tag) {
+        if (response->capture) {
+            response_text(response, c);
+        }
+        return;
+    }
+
+    if (c == '>') {
+        // A value cut off by the end of the tag is not used
+        response->capture = NULL;
+        response->value_field = NULL;
+        response->in_tag = false;
+        response_tag(response);
+        return;
+    }
+
+    if (response->value_field) {
+        response_attribute(response, c);
+    } else if (!response->tag_named) {
+        if ((c == ' ' || c == '/' || c == '\t' || c == '\r' || c == '\n') && response->tag_len > 0) {
+            response->tag_named = true;
+            response_tag_named(response, c);
+        } else if (response->tag_len < SONOS_RESPONSE_TAG_MAX - 1) {
+            response->tag[response->tag_len++] = c;
+        } else {
+            // Too long to be one of the names being looked for
+            response->tag_named = true;
+            response->tag_len = 0;
+        }
+    }
+    response->tag_last = c;
+}
+
+/*
+ * Look for the val attribute of the element just named, if its
+ * value is wanted.
+ */
+LOCAL void ICACHE_FLASH_ATTR response_tag_named(sonos_response *response, char c)
+{
+    int i;
+
+    if (response->tag_len == 0 || response->tag[0] == '/') {
+        return;
+    }
+    response->tag[response->tag_len] = '\0';
+
+    for (i = 0; i < response->field_count; i++) {
+        const sonos_response_field *field = &response->fields[i];
+        if (field->source == RESPONSE_VALUE && os_strcmp(response->tag, field->name) == 0) {
+            response->value_field = field;
+            response->value_match = (c == '/') ? 0 : 1;
+            return;
+        }
+    }
+}
+
+/*
+ * Match the attributes of a tag against the val attribute, one byte
+ * at a time, and keep its value once found.
+ */
+LOCAL void ICACHE_FLASH_ATTR response_attribute(sonos_response *response, char c)
+{
+    LOCAL const char VALUE_ATTRIBUTE[] = " val=\"";
+
+    if (response->capture) {
+        if (c == '"') {
+            response_capture_end(response);
+            response->value_field = NULL;
+        } else {
+            response_text(response, c);
+        }
+        return;
+    }
+
+    if (c == VALUE_ATTRIBUTE[response->value_match]
+        || (response->value_match == 0 && (c == '\t' || c == '\r' || c == '\n'))) {
+        response->value_match++;
+        if (VALUE_ATTRIBUTE[response->value_match] == '\0') {
+            response->capture = response->value_field;
+            response->text_len = 0;
+        }
+    } else {
+        response->value_match = (c == ' ' || c == '\t' || c == '\r' || c == '\n') ? 1 : 0;
+    }
+}
+
+LOCAL void ICACHE_FLASH_ATTR response_tag(sonos_response *response)
+{
+    int i;
+
+    if (response->tag_len == 0) {
+        return;
+    }
+    response->tag[response->tag_len] = '\0';
+
+    if (response->tag[0] == '/') {
+        if (response->state == RESPONSE_BODY && response->content_length < 0
+            && os_strcmp(response->tag, "/s:Envelope") == 0) {
+            // Without a length, the response ends with the envelope,
+            // and the connection cannot be trusted to be in step.
+            response->content_length = response->body_len;
+            response->keep_alive = false;
+        }
+        return;
+    }
+
+    for (i = 0; i < response->field_count; i++) {
+        const sonos_response_field *field = &response->fields[i];
+        if (field->source == RESPONSE_ELEMENT && os_strcmp(response->tag, field->name) == 0) {
+            response->capture = field;
+            response->text_len = 0;
+            if (response->tag_last == '/') {
+                // Empty element
+                response_capture_end(response);
+            }
+            return;
+        }
+    }
+}
+
+LOCAL void ICACHE_FLASH_ATTR response_text(sonos_response *response, char c)
+{
+    const sonos_response_field *field = response->capture;
+
+    if (field->type == RESPONSE_TEXT) {
+        char *value = (char *)response->result + field->offset;
+        if (response->text_len < field->size - 1) {
+            value[response->text_len++] = c;
+        }
+    } else if (response->text_len < SONOS_RESPONSE_TEXT_MAX - 1) {
+        response->text[response->text_len++] = c;
+    }
+}
+
+LOCAL void ICACHE_FLASH_ATTR response_capture_end(sonos_response *response)
+{
+    const sonos_response_field *field = response->capture;
+
+    if (!field) {
+        return;
+    }
+    response->capture = NULL;
+
+    if (field->type == RESPONSE_TEXT) {
+        char *value = (char *)response->result + field->offset;
+        value[response->text_len] = '\0';
+    } else {
+        response_value(response, field, response->text, response->text_len);
+    }
+}
+
+LOCAL void ICACHE_FLASH_ATTR response_value(sonos_response *response,
+    const sonos_response_field *field, const char *value, int len)
+{
+    void *target = (char *)response->result + field->offset;
+    char buf[SONOS_RESPONSE_TEXT_MAX];
+    long int num;
+
+    if (field->type == RESPONSE_TEXT) {
+        int n = MIN(len, field->size - 1);
+        os_memcpy(target, value, n);
+        ((char *)target)[n] = '\0';
+        return;
+    }
+
+    len = MIN(len, SONOS_RESPONSE_TEXT_MAX - 1);
+    os_memcpy(buf, value, len);
+    buf[len] = '\0';
+
+    switch (field->type) {
+    case RESPONSE_INT:
+        num = strtol(buf, NULL, 10);
+        if (num >= 0 && num < INT_MAX) {
+            *(int *)target = num;
+        }
+        break;
+    case RESPONSE_TIME:
+        num = str_to_seconds(buf);
+        if (num >= 0) {
+            *(int *)target = num;
+        }
+        break;
+    case RESPONSE_SECONDS:
+        if (os_strncmp(buf, "Second-", 7) == 0) {
+            num = strtol(buf + 7, NULL, 10);
+            if (num > 0 && num < INT_MAX) {
+                *(int *)target = num;
+            } else {
+                os_printf("Timeout invalid: t=%ld\n", num);
+            }
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+LOCAL bool ICACHE_FLASH_ATTR response_body_done(sonos_response *response)
+{
+    return response->content_length >= 0 && response->body_len >= (uint32)response->content_length;
+}
@@ -112,6 +112,29 @@ void ICACHE_FLASH_ATTR unescape_html_entities(char *str, int len)
     str[p] = '\0';
 }
 
+/*
+ * Update a CRC-32 (IEEE 802.3) with more data, starting from 0.
+ * Works a nibble at a time, to keep the table small.
+ */
+uint32 ICACHE_FLASH_ATTR crc32(uint32 crc, const void *data, int len)
+{
+    LOCAL const uint32 table[16] = {
+        0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC,
+        0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+        0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C,
+        0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C
+    };
+    const uint8 *p = (const uint8 *)data;
+    int i;
+
+    crc = ~crc;
+    for (i = 0; i < len; i++) {
+        crc = table[(crc ^ p[i]) & 0x0F] ^ (crc >> 4);
+        crc = table[(crc ^ (p[i] >> 4)) & 0x0F] ^ (crc >> 4);
+    }
+    return ~crc;
+}
+
 int ICACHE_FLASH_ATTR wb_selection_to_index(char letter, int number)
 {
     if (number < 1 || number > 10) {
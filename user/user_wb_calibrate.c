@@ -0,0 +1,229 @@
+#include "user_wb_calibrate.h"
+
+#include <ets_sys.h>
+#include <osapi.h>
+#include <os_type.h>
+#include <sys/param.h>
+
+/* Selections to learn from before the learned thresholds are used */
+#define CALIBRATE_MIN_SAMPLES 8
+
+/* Selections to learn from between saves of the statistics */
+#define CALIBRATE_SAVE_INTERVAL 16
+
+/* Learned values must be this many deviations from the threshold */
+#define CALIBRATE_SEPARATION 4
+
+/* Margin added to the longest expected gap or pulse for the commit timeout */
+#define CALIBRATE_COMMIT_MARGIN 50000
+
+LOCAL void ICACHE_FLASH_ATTR calibrate_stat_update(uint32 *mean, uint32 *dev, uint32 value, bool first);
+LOCAL uint32 ICACHE_FLASH_ATTR calibrate_stat_upper(uint32 mean, uint32 dev);
+LOCAL uint32 ICACHE_FLASH_ATTR calibrate_stat_lower(uint32 mean, uint32 dev);
+
+typedef struct wb_calibrate_input {
+    wb_calibration calibration;
+    uint32 delimiter_gap_samples;
+    uint32 delimiter_pulse_samples;
+} wb_calibrate_input;
+
+LOCAL wb_calibrate_input calibrate_inputs[WB_INPUTS];
+
+void ICACHE_FLASH_ATTR user_wb_calibrate_init(void)
+{
+    int input;
+
+    os_bzero(calibrate_inputs, sizeof(calibrate_inputs));
+
+    for (input = 0; input < WB_INPUTS; input++) {
+        wb_calibrate_input *state = &calibrate_inputs[input];
+        wb_calibration *calibration = &state->calibration;
+
+        if (user_config_get_wb_calibration(input, calibration)) {
+            os_printf("Loaded wallbox %d calibration, samples=%d\n", input + 1, calibration->samples);
+            if (calibration->delimiter_gap_mean > 0) {
+                state->delimiter_gap_samples = calibration->samples;
+            }
+            if (calibration->delimiter_pulse_mean > 0) {
+                state->delimiter_pulse_samples = calibration->samples;
+            }
+        }
+    }
+}
+
+/*
+ * Provide the decoding thresholds for the wallbox, tightened to fit
+ * the learned signal timing where it is clearly separated.
+ */
+void ICACHE_FLASH_ATTR user_wb_calibrate_get_timing(int input, wallbox_type wb_type, wb_timing *timing)
+{
+    const wb_calibrate_input *state = &calibrate_inputs[input];
+    const wb_calibration *calibration = &state->calibration;
+    const wb_protocol *protocol = wb_protocol_get(wb_type);
+    if (!protocol) {
+        os_bzero(timing, sizeof(wb_timing));
+        return;
+    }
+
+    wb_protocol_default_timing(protocol, timing);
+
+    if (calibration->wallbox_type != wb_type || calibration->samples < CALIBRATE_MIN_SAMPLES) {
+        return;
+    }
+
+    uint32 pulse_upper = calibrate_stat_upper(calibration->pulse_mean, calibration->pulse_dev);
+    uint32 gap_upper = calibrate_stat_upper(calibration->gap_max_mean, calibration->gap_max_dev);
+    uint32 gap_lower = calibrate_stat_lower(calibration->gap_min_mean, calibration->gap_min_dev);
+
+    // Place the gap delimiter threshold midway between the longest
+    // gap within a train and the shortest gap between trains.
+    if (state->delimiter_gap_samples >= CALIBRATE_MIN_SAMPLES) {
+        uint32 delimiter_lower = calibrate_stat_lower(
+            calibration->delimiter_gap_mean, calibration->delimiter_gap_dev);
+        if (gap_upper < delimiter_lower) {
+            timing->delimiter_gap = (gap_upper + delimiter_lower) / 2;
+        }
+    }
+
+    // Likewise for the pulse delimiter, against the longest counted pulse
+    if (protocol->delimiter == DELIMITER_GAP_OR_PULSE
+        && state->delimiter_pulse_samples >= CALIBRATE_MIN_SAMPLES) {
+        uint32 delimiter_lower = calibrate_stat_lower(
+            calibration->delimiter_pulse_mean, calibration->delimiter_pulse_dev);
+        if (pulse_upper < delimiter_lower) {
+            timing->delimiter_pulse = (pulse_upper + delimiter_lower) / 2;
+        }
+    }
+
+    // Bounces are far shorter than any real gap within a train
+    if (gap_lower > 0) {
+        uint32 debounce_gap = gap_lower / 2;
+        if (debounce_gap < DEBOUNCE_GAP / 2) { debounce_gap = DEBOUNCE_GAP / 2; }
+        if (debounce_gap > DEBOUNCE_GAP * 2) { debounce_gap = DEBOUNCE_GAP * 2; }
+        timing->debounce_gap = debounce_gap;
+    }
+
+    // A valid selection can only continue with another pulse, so the
+    // commit timeout only needs to cover the longest gap or pulse.
+    if (calibration->gap_max_mean > 0) {
+        uint32 commit_timeout = (MAX(gap_upper, pulse_upper) + CALIBRATE_COMMIT_MARGIN) / 1000;
+        if (commit_timeout < timing->commit_timeout) {
+            timing->commit_timeout = commit_timeout;
+        }
+    }
+}
+
+/*
+ * Record the timing of a pulse that can no longer be merged with
+ * a following pulse, along with the tally before and after it.
+ */
+void ICACHE_FLASH_ATTR user_wb_calibrate_train_pulse(wb_train_timing *train, const wb_selection_pulse *pulse,
+    const wb_selection_tally *before, const wb_selection_tally *after)
+{
+    if (!before->delimiter && after->delimiter) {
+        if (after->p2 == before->p2) {
+            // Uncounted delimiter pulse
+            train->delimiter_pulse = pulse->duration;
+            return;
+        }
+        train->delimiter_gap = pulse->elapsed;
+    }
+    else if ((!after->delimiter && before->p1 > 0) || (after->delimiter && before->p2 > 0)) {
+        // Gap from the previous pulse in the same train
+        if (train->gap_min == 0 || pulse->elapsed < train->gap_min) {
+            train->gap_min = pulse->elapsed;
+        }
+        if (pulse->elapsed > train->gap_max) {
+            train->gap_max = pulse->elapsed;
+        }
+    }
+
+    if (pulse->duration > train->pulse_max) {
+        train->pulse_max = pulse->duration;
+    }
+}
+
+/*
+ * Learn from the timing of a successfully decoded selection.
+ */
+void ICACHE_FLASH_ATTR user_wb_calibrate_train_commit(int input, wallbox_type wb_type, const wb_train_timing *train)
+{
+    wb_calibrate_input *state = &calibrate_inputs[input];
+    wb_calibration *calibration = &state->calibration;
+
+    if (calibration->wallbox_type != wb_type) {
+        // Statistics from another wallbox type are of no use
+        os_bzero(calibration, sizeof(wb_calibration));
+        calibration->wallbox_type = wb_type;
+        state->delimiter_gap_samples = 0;
+        state->delimiter_pulse_samples = 0;
+    }
+
+    bool first = (calibration->samples == 0);
+
+    if (train->pulse_max > 0) {
+        calibrate_stat_update(&calibration->pulse_mean, &calibration->pulse_dev,
+            train->pulse_max, first || calibration->pulse_mean == 0);
+    }
+    if (train->gap_max > 0) {
+        calibrate_stat_update(&calibration->gap_min_mean, &calibration->gap_min_dev,
+            train->gap_min, first || calibration->gap_min_mean == 0);
+        calibrate_stat_update(&calibration->gap_max_mean, &calibration->gap_max_dev,
+            train->gap_max, first || calibration->gap_max_mean == 0);
+    }
+    if (train->delimiter_gap > 0) {
+        calibrate_stat_update(&calibration->delimiter_gap_mean, &calibration->delimiter_gap_dev,
+            train->delimiter_gap, state->delimiter_gap_samples == 0);
+        state->delimiter_gap_samples++;
+    }
+    if (train->delimiter_pulse > 0) {
+        calibrate_stat_update(&calibration->delimiter_pulse_mean, &calibration->delimiter_pulse_dev,
+            train->delimiter_pulse, state->delimiter_pulse_samples == 0);
+        state->delimiter_pulse_samples++;
+    }
+
+    if (calibration->samples < UINT16_MAX) {
+        calibration->samples++;
+    }
+
+    if (calibration->samples >= CALIBRATE_MIN_SAMPLES
+        && (calibration->samples % CALIBRATE_SAVE_INTERVAL) == 0) {
+        wb_timing timing;
+        user_wb_calibrate_get_timing(input, wb_type, &timing);
+        os_printf("Wallbox %d calibration: delimiter=%dms/%dms, debounce=%dms, commit=%dms\n",
+            input + 1, timing.delimiter_gap / 1000, timing.delimiter_pulse / 1000,
+            timing.debounce_gap / 1000, timing.commit_timeout);
+        user_config_set_wb_calibration(input, calibration);
+        user_config_save();
+    }
+}
+
+/*
+ * Exponentially weighted running mean and mean absolute deviation,
+ * which let the statistics follow a mechanism as it drifts.
+ */
+LOCAL void ICACHE_FLASH_ATTR calibrate_stat_update(uint32 *mean, uint32 *dev, uint32 value, bool first)
+{
+    if (first) {
+        *mean = value;
+        *dev = value / 8;
+        return;
+    }
+
+    sint32 diff = (sint32)value - (sint32)*mean;
+    *mean = (uint32)((sint32)*mean + (diff / 8));
+
+    uint32 abs_diff = (diff < 0) ? -diff : diff;
+    *dev = (uint32)((sint32)*dev + (((sint32)abs_diff - (sint32)*dev) / 8));
+}
+
+LOCAL uint32 ICACHE_FLASH_ATTR calibrate_stat_upper(uint32 mean, uint32 dev)
+{
+    return mean + (CALIBRATE_SEPARATION * dev);
+}
+
+LOCAL uint32 ICACHE_FLASH_ATTR calibrate_stat_lower(uint32 mean, uint32 dev)
+{
+    uint32 margin = CALIBRATE_SEPARATION * dev;
+    return (margin < mean) ? (mean - margin) : 0;
+}
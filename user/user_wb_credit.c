@@ -6,10 +6,53 @@
 #include <os_type.h>
 #include <user_interface.h>
 
-LOCAL void ICACHE_FLASH_ATTR credit_coin_clear(void);
+#include "user_config.h"
+#include "user_hw_timer.h"
+#include "user_wb_ledger.h"
 
-LOCAL uint8 credit_lock = 0;
+#define CREDIT_TASK_PRIO USER_TASK_PRIO_1
+#define CREDIT_TASK_QUEUE_LEN 2
+
+#define CREDIT_SIG_PULSE_END 1
+
+#define CREDIT_GPIO_MASK \
+    (BIT(COIN_NICKEL_IO_NUM) | BIT(COIN_DIME_IO_NUM) | BIT(COIN_QUARTER_IO_NUM))
+
+/*
+ * Coin requests are kept in a ring, starting from the oldest one that
+ * is not done yet. Requests that are done stay in the ring, so their
+ * status can be checked, until their slot is needed again.
+ */
+typedef struct credit_request {
+    uint16 id;
+    uint8 coin_type;
+    uint8 count;
+    uint8 sent;
+    uint32 width_min;
+    uint32 width_max;
+} credit_request;
+
+LOCAL int ICACHE_FLASH_ATTR credit_coin_gpio(CoinType coin_type, uint32 *pulse_ms);
+LOCAL void ICACHE_FLASH_ATTR credit_coin_start(void);
+LOCAL void credit_coin_end(void *arg);
+LOCAL void ICACHE_FLASH_ATTR credit_coin_clear(uint32 width);
+LOCAL void ICACHE_FLASH_ATTR credit_task(os_event_t *event);
+
+LOCAL credit_request credit_requests[CREDIT_MAX_REQUESTS];
+LOCAL int credit_head;
+LOCAL int credit_queued;
+LOCAL int credit_pending;
+LOCAL uint16 credit_next_id = 1;
+LOCAL bool credit_busy;
 LOCAL os_timer_t credit_timer;
+LOCAL os_event_t credit_task_queue[CREDIT_TASK_QUEUE_LEN];
+
+LOCAL volatile uint32 credit_pulse_start;
+LOCAL uint32 credit_pulse_target;
+
+LOCAL wb_credit_pulse credit_pulse_log[CREDIT_PULSE_LOG];
+LOCAL int credit_pulse_next;
+LOCAL int credit_pulse_count;
 
 void ICACHE_FLASH_ATTR user_wb_credit_init(void)
 {
@@ -26,46 +69,224 @@ void ICACHE_FLASH_ATTR user_wb_credit_init(void)
         GPIO_ID_PIN(COIN_NICKEL_IO_NUM) | GPIO_ID_PIN(COIN_DIME_IO_NUM) | GPIO_ID_PIN(COIN_QUARTER_IO_NUM),
         GPIO_ID_PIN(COIN_NICKEL_IO_NUM) | GPIO_ID_PIN(COIN_DIME_IO_NUM) | GPIO_ID_PIN(COIN_QUARTER_IO_NUM),
         0);
+
+    os_bzero(credit_requests, sizeof(credit_requests));
+    os_bzero(credit_pulse_log, sizeof(credit_pulse_log));
+    credit_head = 0;
+    credit_queued = 0;
+    credit_pending = 0;
+    credit_busy = false;
+    credit_pulse_next = 0;
+    credit_pulse_count = 0;
+
+    system_os_task(credit_task, CREDIT_TASK_PRIO, credit_task_queue, CREDIT_TASK_QUEUE_LEN);
 }
 
-int ICACHE_FLASH_ATTR user_wb_credit_drop(CoinType coin_type)
+/*
+ * Queue a number of coins of the same type, to be sent after any
+ * coins already queued. Returns the request id, 0 if the queue is
+ * full, or -1 if the request is not valid.
+ */
+int ICACHE_FLASH_ATTR user_wb_credit_queue(CoinType coin_type, int count)
 {
-    int coin_gpio = -1;
-    uint32_t coin_timer = 0;
+    credit_request *request;
+    uint32 pulse_ms;
+
+    if (credit_coin_gpio(coin_type, &pulse_ms) < 0 || count < 1 || count > CREDIT_MAX_COUNT) {
+        return -1;
+    }
+
+    if (credit_queued >= CREDIT_MAX_REQUESTS || credit_pending + count > CREDIT_MAX_PENDING) {
+        return 0;
+    }
+
+    request = &credit_requests[(credit_head + credit_queued) % CREDIT_MAX_REQUESTS];
+    os_bzero(request, sizeof(credit_request));
+    request->id = credit_next_id++;
+    request->coin_type = (uint8)coin_type;
+    request->count = (uint8)count;
+    if (credit_next_id == 0) {
+        credit_next_id = 1;
+    }
+
+    credit_queued++;
+    credit_pending += count;
+
+    if (!credit_busy) {
+        credit_coin_start();
+    }
+    return request->id;
+}
+
+/*
+ * Look up the progress of a request.
+ * Returns false if the request is not known.
+ */
+bool ICACHE_FLASH_ATTR user_wb_credit_status(int id, wb_credit_status *status)
+{
+    int i;
+
+    os_bzero(status, sizeof(wb_credit_status));
+    if (id <= 0) {
+        return false;
+    }
+
+    for (i = 0; i < CREDIT_MAX_REQUESTS; i++) {
+        const credit_request *request = &credit_requests[i];
+        uint32 pulse_ms;
+        if (request->id != id) {
+            continue;
+        }
+
+        int position = (i - credit_head + CREDIT_MAX_REQUESTS) % CREDIT_MAX_REQUESTS;
+        if (position >= credit_queued) {
+            status->state = CREDIT_DONE;
+        } else {
+            status->state = (position == 0) ? CREDIT_ACTIVE : CREDIT_QUEUED;
+        }
+        status->sent = request->sent;
+        status->count = request->count;
+        credit_coin_gpio((CoinType)request->coin_type, &pulse_ms);
+        status->width_target = pulse_ms * 1000;
+        status->width_min = request->width_min;
+        status->width_max = request->width_max;
+        return true;
+    }
+
+    return false;
+}
+
+/*
+ * Copy out the measured widths of the most recent coin pulses,
+ * oldest first. Returns the number of pulses copied.
+ */
+int ICACHE_FLASH_ATTR user_wb_credit_pulses(wb_credit_pulse *pulses, int max_pulses)
+{
+    int count = (credit_pulse_count < max_pulses) ? credit_pulse_count : max_pulses;
+    int i;
+
+    for (i = 0; i < count; i++) {
+        int index = (credit_pulse_next - count + i + CREDIT_PULSE_LOG) % CREDIT_PULSE_LOG;
+        pulses[i] = credit_pulse_log[index];
+    }
+    return count;
+}
 
+LOCAL int ICACHE_FLASH_ATTR credit_coin_gpio(CoinType coin_type, uint32 *pulse_ms)
+{
     switch (coin_type) {
     case NICKEL:
-        coin_gpio = COIN_NICKEL_IO_NUM;
-        coin_timer = COIN_NICKEL_PULSE_MS;
-        break;
+        *pulse_ms = COIN_NICKEL_PULSE_MS;
+        return COIN_NICKEL_IO_NUM;
     case DIME:
-        coin_gpio = COIN_DIME_IO_NUM;
-        coin_timer = COIN_DIME_PULSE_MS;
-        break;
+        *pulse_ms = COIN_DIME_PULSE_MS;
+        return COIN_DIME_IO_NUM;
     case QUARTER:
-        coin_gpio = COIN_QUARTER_IO_NUM;
-        coin_timer = COIN_QUARTER_PULSE_MS;
-        break;
+        *pulse_ms = COIN_QUARTER_PULSE_MS;
+        return COIN_QUARTER_IO_NUM;
     default:
         return -1;
     }
+}
 
-    if (credit_lock == 1) {
-        return 0;
+/*
+ * Start the next coin pulse of the oldest request,
+ * or go idle if there is nothing left to send.
+ *
+ * The end of the pulse is timed by the hardware timer from the moment
+ * the output was set, so network activity cannot stretch it.
+ */
+LOCAL void ICACHE_FLASH_ATTR credit_coin_start(void)
+{
+    const credit_request *request;
+    uint32 pulse_ms;
+    uint32 start;
+    int coin_gpio;
+
+    if (credit_queued == 0) {
+        credit_busy = false;
+        return;
     }
 
-    credit_lock = 1;
-    GPIO_OUTPUT_SET(GPIO_ID_PIN(coin_gpio), 1);
-    os_timer_disarm(&credit_timer);
-    os_timer_setfn(&credit_timer, (os_timer_func_t *)credit_coin_clear, NULL);
-    os_timer_arm(&credit_timer, coin_timer, 0);
-    return 1;
+    request = &credit_requests[credit_head];
+    coin_gpio = credit_coin_gpio((CoinType)request->coin_type, &pulse_ms);
+
+    credit_busy = true;
+    credit_pulse_target = pulse_ms * 1000;
+
+    ETS_INTR_LOCK();
+    GPIO_REG_WRITE(GPIO_OUT_W1TS_ADDRESS, BIT(coin_gpio));
+    start = system_get_time();
+    ETS_INTR_UNLOCK();
+
+    credit_pulse_start = start;
+    user_hw_timer_arm_at(HW_TIMER_CREDIT, start + credit_pulse_target, credit_coin_end, NULL);
 }
 
-LOCAL void ICACHE_FLASH_ATTR credit_coin_clear(void)
+/*
+ * End the coin pulse, from the hardware timer interrupt.
+ */
+LOCAL void credit_coin_end(void *arg)
 {
-    GPIO_OUTPUT_SET(GPIO_ID_PIN(COIN_NICKEL_IO_NUM), 0);
-    GPIO_OUTPUT_SET(GPIO_ID_PIN(COIN_DIME_IO_NUM), 0);
-    GPIO_OUTPUT_SET(GPIO_ID_PIN(COIN_QUARTER_IO_NUM), 0);
-    credit_lock = 0;
+    GPIO_REG_WRITE(GPIO_OUT_W1TC_ADDRESS, CREDIT_GPIO_MASK);
+    uint32 width = system_get_time() - credit_pulse_start;
+
+    system_os_post(CREDIT_TASK_PRIO, CREDIT_SIG_PULSE_END, width);
+}
+
+LOCAL void ICACHE_FLASH_ATTR credit_task(os_event_t *event)
+{
+    switch (event->sig) {
+    case CREDIT_SIG_PULSE_END:
+        credit_coin_clear(event->par);
+        break;
+    default:
+        break;
+    }
+}
+
+/*
+ * Account for the coin pulse that just ended, and hold off the next
+ * one for long enough that the coin mechanism sees them as separate
+ * coins. The gap only has a lower bound, so a software timer will do.
+ */
+LOCAL void ICACHE_FLASH_ATTR credit_coin_clear(uint32 width)
+{
+    credit_request *request = &credit_requests[credit_head];
+    wb_credit_pulse *pulse = &credit_pulse_log[credit_pulse_next];
+    uint16 gap_ms = user_config_get_credit_gap();
+
+    pulse->id = request->id;
+    pulse->coin_type = request->coin_type;
+    pulse->width_target = credit_pulse_target;
+    pulse->width = width;
+    credit_pulse_next = (credit_pulse_next + 1) % CREDIT_PULSE_LOG;
+    if (credit_pulse_count < CREDIT_PULSE_LOG) {
+        credit_pulse_count++;
+    }
+
+    if (width > credit_pulse_target + CREDIT_PULSE_TOLERANCE_US) {
+        os_printf("Coin pulse %dus, expected %dus\n", width, credit_pulse_target);
+    }
+
+    if (request->sent == 0 || width < request->width_min) {
+        request->width_min = width;
+    }
+    if (width > request->width_max) {
+        request->width_max = width;
+    }
+
+    user_wb_ledger_credit((CoinType)request->coin_type);
+
+    request->sent++;
+    credit_pending--;
+    if (request->sent >= request->count) {
+        os_printf("Credit request %d done, %d coins\n", request->id, request->count);
+        credit_head = (credit_head + 1) % CREDIT_MAX_REQUESTS;
+        credit_queued--;
+    }
+
+    os_timer_disarm(&credit_timer);
+    os_timer_setfn(&credit_timer, (os_timer_func_t *)credit_coin_start, NULL);
+    os_timer_arm(&credit_timer, (gap_ms > 0) ? gap_ms : COIN_PULSE_GAP_MS, 0);
 }
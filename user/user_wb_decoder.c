@@ -0,0 +1,217 @@
+#include "user_wb_decoder.h"
+
+#include <ets_sys.h>
+#include <osapi.h>
+
+#include "user_wb_stats.h"
+
+LOCAL void ICACHE_FLASH_ATTR wb_decoder_timeout(wb_decoder *decoder, int value);
+
+void ICACHE_FLASH_ATTR wb_decoder_init(wb_decoder *decoder, const wb_protocol *protocol, const wb_timing *timing, uint32 time)
+{
+    os_bzero(decoder, sizeof(wb_decoder));
+    decoder->protocol = protocol;
+    if (timing) {
+        decoder->timing = *timing;
+    }
+    decoder->last_value = 0;
+    decoder->last_time = time;
+    decoder->gap_start = time;
+    decoder->timeout = WB_TIMEOUT_IDLE;
+}
+
+/*
+ * Switch the decoder to another wallbox protocol, discarding
+ * any selection in progress.
+ */
+void ICACHE_FLASH_ATTR wb_decoder_set_protocol(wb_decoder *decoder, const wb_protocol *protocol, const wb_timing *timing)
+{
+    decoder->protocol = protocol;
+    if (timing) {
+        decoder->timing = *timing;
+    } else {
+        os_bzero(&decoder->timing, sizeof(wb_timing));
+    }
+    if (decoder->pulse_index > 0) {
+        wb_decoder_clear(decoder);
+    }
+    decoder->pending = false;
+}
+
+void ICACHE_FLASH_ATTR wb_decoder_clear(wb_decoder *decoder)
+{
+    decoder->pulse_index = 0;
+    os_bzero(&decoder->current, sizeof(wb_selection_pulse));
+    os_bzero(&decoder->previous, sizeof(wb_selection_pulse));
+    os_bzero(&decoder->tally, sizeof(wb_selection_tally));
+    os_bzero(&decoder->tally_previous, sizeof(wb_selection_tally));
+    os_bzero(&decoder->train, sizeof(wb_train_timing));
+    decoder->spikes = 0;
+    decoder->bounces = 0;
+}
+
+/*
+ * Process a single edge from the selection signal, and update
+ * the commit timeout to apply from the last accepted edge.
+ *
+ * Pulses shorter than the minimum pulse width are rejected as noise,
+ * as if the signal had stayed low, and gaps shorter than the debounce
+ * gap merge the pulses on either side of them.
+ */
+wb_decoder_result ICACHE_FLASH_ATTR wb_decoder_edge(wb_decoder *decoder, int value, uint32 time)
+{
+    wb_decoder_result result = DECODER_EDGE_OK;
+
+    if (value == decoder->last_value) {
+        return DECODER_EDGE_NONE;
+    }
+
+    uint32 elapsed = time - decoder->last_time;
+    if (value == 1) {
+        if (decoder->current.duration == 0) {
+            decoder->current.elapsed = elapsed;
+            decoder->gap_start = decoder->last_time;
+        } else {
+            result = DECODER_EDGE_ERROR_GAP;
+        }
+    }
+    else if (value == 0) {
+        if (decoder->current.elapsed > 0 && elapsed < decoder->timing.min_pulse) {
+            // Forget the spike, so the gap runs on from the last real
+            // pulse, and the timeout stays as it was after that pulse.
+            decoder->spikes++;
+            if (decoder->stats) {
+                user_wb_stats_spike(decoder->stats_input, elapsed);
+            }
+            decoder->current.elapsed = 0;
+            decoder->last_value = 0;
+            decoder->last_time = decoder->gap_start;
+            decoder->pending = (decoder->pulse_index > 0);
+            wb_decoder_timeout(decoder, 0);
+            return DECODER_EDGE_SPIKE;
+        }
+        if (decoder->current.elapsed > 0) {
+            if (decoder->pulse_index > 0 && decoder->current.elapsed < decoder->timing.debounce_gap) {
+                // If this pulse had a negligible gap from the previous
+                // pulse, then merge them and recount the merged pulse.
+                decoder->bounces++;
+                if (decoder->stats) {
+                    user_wb_stats_count(decoder->stats_input, WB_STATS_BOUNCE, 1);
+                }
+                decoder->previous.duration += decoder->current.elapsed + elapsed;
+                decoder->tally = decoder->tally_previous;
+                wb_protocol_tally_step(decoder->protocol, &decoder->timing,
+                    &decoder->tally, &decoder->previous);
+            } else {
+                // The previous pulse can no longer be merged
+                if (decoder->pulse_index > 0) {
+                    user_wb_calibrate_train_pulse(&decoder->train, &decoder->previous,
+                        &decoder->tally_previous, &decoder->tally);
+                    if (decoder->stats) {
+                        user_wb_stats_pulse(decoder->stats_input, &decoder->previous,
+                            &decoder->tally_previous, &decoder->tally);
+                    }
+                }
+
+                decoder->current.duration = elapsed;
+                decoder->tally_previous = decoder->tally;
+                wb_protocol_tally_step(decoder->protocol, &decoder->timing,
+                    &decoder->tally, &decoder->current);
+                decoder->previous = decoder->current;
+                decoder->pulse_index++;
+            }
+            os_bzero(&decoder->current, sizeof(wb_selection_pulse));
+        } else {
+            result = DECODER_EDGE_ERROR_PULSE;
+        }
+    }
+
+    if (decoder->pulse_index >= MAX_WB_SELECTION_PULSES) {
+        decoder->timeout = WB_TIMEOUT_IDLE;
+        result = DECODER_EDGE_ERROR_MAX;
+        wb_decoder_clear(decoder);
+    } else if (!decoder->protocol) {
+        decoder->timeout = WB_TIMEOUT_IDLE;
+        result = DECODER_EDGE_UNKNOWN;
+        wb_decoder_clear(decoder);
+    } else {
+        wb_decoder_timeout(decoder, value);
+    }
+
+    decoder->last_value = value;
+    decoder->last_time = time;
+    decoder->pending = true;
+    return result;
+}
+
+/*
+ * Set the commit timeout for the selection so far, following
+ * an edge to the given level.
+ */
+LOCAL void ICACHE_FLASH_ATTR wb_decoder_timeout(wb_decoder *decoder, int value)
+{
+    decoder->timeout = WB_TIMEOUT_IDLE;
+    if (decoder->pulse_index == 0 || !decoder->protocol) {
+        return;
+    }
+
+    switch (wb_protocol_tally_decode(decoder->protocol, &decoder->tally, NULL, NULL)) {
+    case TALLY_VALID:
+        decoder->timeout = decoder->timing.commit_timeout;
+        break;
+    case TALLY_COMPLETE:
+        if (value == 0) {
+            // Nothing else can legally follow, so only wait long enough
+            // for a bounce on the final pulse to be merged into it.
+            decoder->timeout = (decoder->timing.debounce_gap + 999) / 1000 + WB_TIMEOUT_COMPLETE;
+        } else {
+            // A bounce that stays high has to end before it can be
+            // told apart from an extra pulse.
+            decoder->timeout = decoder->timing.commit_timeout;
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+/*
+ * Whether the selection would have been committed by the given time,
+ * had a timer been armed with the timeout after the last edge.
+ */
+bool ICACHE_FLASH_ATTR wb_decoder_expired(const wb_decoder *decoder, uint32 time)
+{
+    return decoder->pending && time - decoder->last_time >= decoder->timeout * 1000;
+}
+
+/*
+ * Decode the selection once its timeout has elapsed, and clear the
+ * decoder for the next one. If the selection is valid, the timing
+ * observed over the selection is also provided.
+ */
+wb_tally_state ICACHE_FLASH_ATTR wb_decoder_commit(wb_decoder *decoder, char *letter, int *number, wb_train_timing *train)
+{
+    wb_tally_state result;
+
+    if (decoder->protocol) {
+        result = wb_protocol_tally_decode(decoder->protocol, &decoder->tally, letter, number);
+    } else {
+        result = TALLY_INVALID;
+    }
+
+    if (decoder->stats && decoder->pulse_index > 0) {
+        user_wb_stats_pulse(decoder->stats_input, &decoder->previous,
+            &decoder->tally_previous, &decoder->tally);
+    }
+
+    if (train && (result == TALLY_VALID || result == TALLY_COMPLETE)) {
+        user_wb_calibrate_train_pulse(&decoder->train, &decoder->previous,
+            &decoder->tally_previous, &decoder->tally);
+        *train = decoder->train;
+    }
+
+    wb_decoder_clear(decoder);
+    decoder->timeout = WB_TIMEOUT_IDLE;
+    decoder->pending = false;
+    return result;
+}
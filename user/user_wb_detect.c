@@ -0,0 +1,201 @@
+#include "user_wb_detect.h"
+
+#include <ets_sys.h>
+#include <osapi.h>
+
+#include "user_wb_protocol.h"
+#include "user_wb_decoder.h"
+
+/* Consecutive valid selections needed to lock onto a wallbox model */
+#define DETECT_LOCK_SELECTIONS 3
+
+#define DETECT_CANDIDATES (MAX_WALLBOX_TYPES - 1)
+
+typedef struct wb_detect_candidate {
+    wb_decoder decoder;
+    int commits;      // selections committed during this round
+    bool valid;       // last selection committed was valid
+    bool error;       // signal error seen during this round
+    char letter;
+    int number;
+    int streak;       // consecutive rounds with one valid selection
+} wb_detect_candidate;
+
+LOCAL void ICACHE_FLASH_ATTR detect_candidate_commit(wb_detect_candidate *candidate);
+
+LOCAL wb_detect_candidate detect_candidates[WB_INPUTS][DETECT_CANDIDATES];
+LOCAL wallbox_type detect_locked[WB_INPUTS];
+
+/*
+ * Start detection over, with every wallbox model equally likely.
+ */
+void ICACHE_FLASH_ATTR user_wb_detect_reset(int input, uint32 time)
+{
+    wb_detect_candidate *candidates = detect_candidates[input];
+    int i;
+    for (i = 0; i < DETECT_CANDIDATES; i++) {
+        const wb_protocol *protocol = wb_protocol_get((wallbox_type)(i + 1));
+        wb_timing timing;
+
+        // Calibration only applies once the model is known
+        wb_protocol_default_timing(protocol, &timing);
+
+        os_bzero(&candidates[i], sizeof(wb_detect_candidate));
+        wb_decoder_init(&candidates[i].decoder, protocol, &timing, time);
+    }
+    detect_locked[input] = UNKNOWN_WALLBOX;
+}
+
+/*
+ * Feed an edge to every candidate decoder.
+ * Returns true if the edge was a level transition.
+ */
+bool ICACHE_FLASH_ATTR user_wb_detect_edge(int input, int value, uint32 time)
+{
+    wb_detect_candidate *candidates = detect_candidates[input];
+    bool transition = false;
+    int i;
+
+    for (i = 0; i < DETECT_CANDIDATES; i++) {
+        wb_detect_candidate *candidate = &candidates[i];
+
+        // Candidates with a shorter timeout than the one the timer
+        // was armed with would already have committed by now.
+        if (wb_decoder_expired(&candidate->decoder, time)) {
+            detect_candidate_commit(candidate);
+        }
+
+        switch (wb_decoder_edge(&candidate->decoder, value, time)) {
+        case DECODER_EDGE_NONE:
+            continue;
+        case DECODER_EDGE_OK:
+        case DECODER_EDGE_SPIKE:
+            break;
+        default:
+            candidate->error = true;
+            break;
+        }
+        transition = true;
+    }
+
+    return transition;
+}
+
+/*
+ * Timeout to wait after the last edge for every candidate to commit,
+ * in milliseconds.
+ */
+uint32 ICACHE_FLASH_ATTR user_wb_detect_timeout(int input)
+{
+    const wb_detect_candidate *candidates = detect_candidates[input];
+    uint32 timeout = 0;
+    int i;
+
+    for (i = 0; i < DETECT_CANDIDATES; i++) {
+        if (candidates[i].decoder.pending && candidates[i].decoder.timeout > timeout) {
+            timeout = candidates[i].decoder.timeout;
+        }
+    }
+    return (timeout > 0) ? timeout : WB_TIMEOUT_IDLE;
+}
+
+/*
+ * Commit the selection on every candidate and score the round.
+ * Returns true if the candidates decoded a selection to play, either
+ * because one model is clearly ahead or because every model that
+ * found a valid selection agrees on it.
+ */
+bool ICACHE_FLASH_ATTR user_wb_detect_commit(int input, char *letter, int *number)
+{
+    wb_detect_candidate *candidates = detect_candidates[input];
+    wb_detect_candidate *leader = NULL;
+    wb_detect_candidate *agreed = NULL;
+    bool any_valid = false;
+    bool agree = true;
+    int i;
+
+    for (i = 0; i < DETECT_CANDIDATES; i++) {
+        wb_detect_candidate *candidate = &candidates[i];
+        if (candidate->decoder.pending) {
+            detect_candidate_commit(candidate);
+        }
+
+        // One valid selection per round is the only good fit
+        candidate->valid = candidate->valid && candidate->commits == 1 && !candidate->error;
+        if (candidate->valid) {
+            if (agreed && (agreed->letter != candidate->letter || agreed->number != candidate->number)) {
+                agree = false;
+            }
+            agreed = candidate;
+            any_valid = true;
+        }
+    }
+
+    // A round no candidate could decode is noise or a misfire,
+    // and says nothing about which model is attached.
+    if (any_valid) {
+        for (i = 0; i < DETECT_CANDIDATES; i++) {
+            wb_detect_candidate *candidate = &candidates[i];
+            candidate->streak = candidate->valid ? candidate->streak + 1 : 0;
+        }
+
+        // The leader must have decoded at least one selection
+        // that the other candidates could not.
+        bool tied = false;
+        for (i = 0; i < DETECT_CANDIDATES; i++) {
+            wb_detect_candidate *candidate = &candidates[i];
+            if (!leader || candidate->streak > leader->streak) {
+                leader = candidate;
+                tied = false;
+            } else if (candidate->streak == leader->streak) {
+                tied = true;
+            }
+        }
+        if (tied || !leader->valid) {
+            leader = NULL;
+        }
+
+        if (leader && leader->streak >= DETECT_LOCK_SELECTIONS) {
+            detect_locked[input] = (wallbox_type)((leader - candidates) + 1);
+            os_printf("Detected wallbox %d: %s\n", input + 1,
+                wb_protocol_get(detect_locked[input])->description);
+        }
+    }
+
+    if (!leader && agree) {
+        leader = agreed;
+    }
+    if (leader) {
+        *letter = leader->letter;
+        *number = leader->number;
+    } else if (any_valid) {
+        os_printf("--> Ambiguous selection during wallbox detection\r\n");
+    }
+
+    for (i = 0; i < DETECT_CANDIDATES; i++) {
+        candidates[i].commits = 0;
+        candidates[i].valid = false;
+        candidates[i].error = false;
+    }
+
+    return leader != NULL;
+}
+
+wallbox_type ICACHE_FLASH_ATTR user_wb_detect_locked(int input)
+{
+    return detect_locked[input];
+}
+
+LOCAL void ICACHE_FLASH_ATTR detect_candidate_commit(wb_detect_candidate *candidate)
+{
+    switch (wb_decoder_commit(&candidate->decoder, &candidate->letter, &candidate->number, NULL)) {
+    case TALLY_VALID:
+    case TALLY_COMPLETE:
+        candidate->valid = true;
+        break;
+    default:
+        candidate->valid = false;
+        break;
+    }
+    candidate->commits++;
+}
@@ -0,0 +1,227 @@
+#include "user_wb_ledger.h"
+
+#include <ets_sys.h>
+#include <osapi.h>
+#include <os_type.h>
+#include <mem.h>
+#include <user_interface.h>
+#include <spi_flash.h>
+#include <stddef.h>
+
+#include "user_util.h"
+
+/*
+ * Reserved flash region for the ledger, following the trace ring
+ * on a 4MB (512KB+512KB) flash layout.
+ */
+#define LEDGER_START_SEC    0x104
+#define LEDGER_SECTORS      8
+#define LEDGER_SLOT_SIZE    1024
+#define LEDGER_SLOTS_PER_SEC (SPI_FLASH_SEC_SIZE / LEDGER_SLOT_SIZE)
+#define LEDGER_SLOTS        (LEDGER_SECTORS * LEDGER_SLOTS_PER_SEC)
+
+#define LEDGER_MAGIC 0x47444C57 // "WLDG"
+
+/* Delay from the first change to saving a snapshot, in milliseconds */
+#define LEDGER_FLUSH_DELAY 60000
+
+/* Selections listed in each part of the JSON export */
+#define LEDGER_JSON_SELECTIONS 40
+
+typedef struct wb_ledger_record {
+    uint32 magic;
+    uint32 sequence;
+    uint32 coins[WB_LEDGER_COINS];
+    uint32 plays[WB_LEDGER_SELECTIONS];
+    uint32 crc;        // of everything before it
+} wb_ledger_record;
+
+LOCAL void ICACHE_FLASH_ATTR ledger_changed(void);
+LOCAL void ICACHE_FLASH_ATTR ledger_flush_arm(void);
+LOCAL void ICACHE_FLASH_ATTR ledger_flush_timer_func(void *arg);
+LOCAL uint32 ICACHE_FLASH_ATTR ledger_slot_addr(int slot);
+
+LOCAL bool ledger_enabled;
+LOCAL bool ledger_dirty;
+LOCAL wb_ledger_record ledger;
+LOCAL int ledger_next_slot;
+LOCAL os_timer_t ledger_flush_timer;
+
+void ICACHE_FLASH_ATTR user_wb_ledger_init(void)
+{
+    wb_ledger_record *record;
+    int newest = -1;
+    int i;
+
+    os_bzero(&ledger, sizeof(ledger));
+    os_bzero(&ledger_flush_timer, sizeof(ledger_flush_timer));
+    ledger_dirty = false;
+    ledger_next_slot = 0;
+
+    // The region is only known to be free on the 4MB flash layout
+    ledger_enabled = (system_get_flash_size_map() == FLASH_SIZE_32M_MAP_512_512);
+    if (!ledger_enabled) {
+        os_printf("Ledger not saved for this flash layout\n");
+        return;
+    }
+
+    record = (wb_ledger_record *)os_malloc(sizeof(wb_ledger_record));
+    if (!record) {
+        return;
+    }
+
+    // Load the newest snapshot that was completely written
+    for (i = 0; i < LEDGER_SLOTS; i++) {
+        if (spi_flash_read(ledger_slot_addr(i), (uint32 *)record, sizeof(wb_ledger_record)) != SPI_FLASH_RESULT_OK) {
+            continue;
+        }
+        if (record->magic != LEDGER_MAGIC
+            || record->crc != crc32(0, record, offsetof(wb_ledger_record, crc))) {
+            continue;
+        }
+        if (newest < 0 || (sint32)(record->sequence - ledger.sequence) > 0) {
+            ledger = *record;
+            newest = i;
+        }
+    }
+    os_free(record);
+
+    if (newest >= 0) {
+        ledger_next_slot = (newest + 1) % LEDGER_SLOTS;
+    }
+
+    os_printf("Ledger at slot %d, sequence %d\n", ledger_next_slot, ledger.sequence);
+}
+
+void ICACHE_FLASH_ATTR user_wb_ledger_credit(CoinType coin_type)
+{
+    if (coin_type < 0 || coin_type >= WB_LEDGER_COINS) {
+        return;
+    }
+    ledger.coins[coin_type]++;
+    ledger_changed();
+}
+
+void ICACHE_FLASH_ATTR user_wb_ledger_play(char letter, int number)
+{
+    int index = wb_selection_to_index(letter, number);
+    if (index < 0 || index >= WB_LEDGER_SELECTIONS) {
+        return;
+    }
+    ledger.plays[index]++;
+    ledger_changed();
+}
+
+/*
+ * Start the flush timer on the first change since the last snapshot,
+ * so a burst of activity only costs one flash write.
+ */
+LOCAL void ICACHE_FLASH_ATTR ledger_changed(void)
+{
+    if (!ledger_enabled || ledger_dirty) {
+        return;
+    }
+
+    ledger_dirty = true;
+    ledger_flush_arm();
+}
+
+LOCAL void ICACHE_FLASH_ATTR ledger_flush_arm(void)
+{
+    os_timer_disarm(&ledger_flush_timer);
+    os_timer_setfn(&ledger_flush_timer, (os_timer_func_t *)ledger_flush_timer_func, NULL);
+    os_timer_arm(&ledger_flush_timer, LEDGER_FLUSH_DELAY, 0);
+}
+
+/*
+ * Save a snapshot to the next slot. The ledger stays dirty until one
+ * is written, so a failed flush is tried again on the next timeout.
+ */
+LOCAL void ICACHE_FLASH_ATTR ledger_flush_timer_func(void *arg)
+{
+    int slot = ledger_next_slot;
+
+    // Entering a sector reclaims the oldest snapshots
+    if ((slot % LEDGER_SLOTS_PER_SEC) == 0) {
+        if (spi_flash_erase_sector(LEDGER_START_SEC + (slot / LEDGER_SLOTS_PER_SEC)) != SPI_FLASH_RESULT_OK) {
+            os_printf("Ledger sector erase error\n");
+            ledger_flush_arm();
+            return;
+        }
+    }
+
+    ledger.magic = LEDGER_MAGIC;
+    ledger.sequence++;
+    ledger.crc = crc32(0, &ledger, offsetof(wb_ledger_record, crc));
+
+    // A slot that failed to write may be partly programmed,
+    // so the retry goes to the one after it.
+    ledger_next_slot = (slot + 1) % LEDGER_SLOTS;
+
+    if (spi_flash_write(ledger_slot_addr(slot), (uint32 *)&ledger, sizeof(wb_ledger_record)) != SPI_FLASH_RESULT_OK) {
+        os_printf("Ledger write error\n");
+        ledger_flush_arm();
+        return;
+    }
+
+    ledger_dirty = false;
+}
+
+LOCAL uint32 ICACHE_FLASH_ATTR ledger_slot_addr(int slot)
+{
+    return (LEDGER_START_SEC * SPI_FLASH_SEC_SIZE) + (slot * LEDGER_SLOT_SIZE);
+}
+
+/*
+ * Write part of the ledger as JSON, so the whole export does not have
+ * to fit in one buffer. Only selections that have been played are
+ * listed. Returns the length written, or 0 once all the parts have
+ * been written.
+ */
+int ICACHE_FLASH_ATTR user_wb_ledger_json(int part, char *buf, int buf_len)
+{
+    int parts = (WB_LEDGER_SELECTIONS + LEDGER_JSON_SELECTIONS - 1) / LEDGER_JSON_SELECTIONS;
+    int n = 0;
+    int i;
+
+    if (part == 0) {
+        return os_sprintf(buf,
+            "{\"sequence\": %d, \"saved\": %s, "
+            "\"coins\": {\"nickel\": %d, \"dime\": %d, \"quarter\": %d}, \"plays\": {",
+            ledger.sequence, (ledger_enabled && !ledger_dirty) ? "true" : "false",
+            ledger.coins[NICKEL], ledger.coins[DIME], ledger.coins[QUARTER]);
+    }
+
+    if (part > parts) {
+        return 0;
+    }
+
+    // Only the first played selection goes without a separator
+    bool first = true;
+    for (i = 0; i < (part - 1) * LEDGER_JSON_SELECTIONS; i++) {
+        if (ledger.plays[i] > 0) {
+            first = false;
+            break;
+        }
+    }
+
+    for (i = (part - 1) * LEDGER_JSON_SELECTIONS;
+        i < part * LEDGER_JSON_SELECTIONS && i < WB_LEDGER_SELECTIONS && buf_len - n > 32; i++) {
+        char letter;
+        int number;
+        if (ledger.plays[i] == 0 || !wb_index_to_selection(i, &letter, &number)) {
+            continue;
+        }
+        n += os_sprintf(buf + n, "%s\"%c%d\": %d", first ? "" : ", ", letter, number, ledger.plays[i]);
+        first = false;
+    }
+    if (part == parts) {
+        n += os_sprintf(buf + n, "}}");
+    }
+
+    // An empty part would end the export early
+    if (n == 0) {
+        buf[n++] = ' ';
+    }
+    return n;
+}
@@ -0,0 +1,167 @@
+#include "user_wb_protocol.h"
+
+#include <ets_sys.h>
+#include <osapi.h>
+#include <os_type.h>
+
+#include "user_util.h"
+
+/*
+ * Wallbox protocol descriptors, indexed by wallbox type.
+ *
+ * Supporting another wallbox model should only require adding
+ * a new wallbox type and a row in this table.
+ *
+ * Rows are only added for models whose timing has been measured
+ * on a real unit.
+ */
+LOCAL const wb_protocol WB_PROTOCOLS[MAX_WALLBOX_TYPES] ICACHE_RODATA_ATTR = {
+    [SEEBURG_3W1_100] = {
+        .name = "SEEBURG_3W1_100",
+        .description = "Seeburg Wall-O-Matic 3W-1 \"100\"",
+        .delimiter = DELIMITER_GAP_OR_PULSE,
+        .delimiter_gap = 100000,   // ~170ms, so use 100 to be safe
+        .delimiter_pulse = 500000, // ~800ms, so use 500 to be safe
+        .p1_min = 1,
+        .p1_max = 21,
+        .p1_skip = 11,
+        .p2_min = 1,
+        .p2_max = 5,
+        .layout = LAYOUT_NUMBER_LETTER,
+        .letter_count = 10,
+        .commit_timeout = 250
+    },
+    [SEEBURG_V3WA_200] = {
+        .name = "SEEBURG_V3WA_200",
+        .description = "Seeburg Wall-O-Matic V-3WA \"200\"",
+        .delimiter = DELIMITER_GAP,
+        .delimiter_gap = 125000,   // ~230ms, so use 125 to be safe
+        .delimiter_pulse = 0,
+        .p1_min = 2,
+        .p1_max = 21,
+        .p1_skip = 0,
+        .p2_min = 1,
+        .p2_max = 10,
+        .layout = LAYOUT_LETTER_NUMBER,
+        .letter_count = 20,
+        .commit_timeout = 250
+    }
+};
+
+const wb_protocol* ICACHE_FLASH_ATTR wb_protocol_get(wallbox_type wb_type)
+{
+    if (wb_type <= UNKNOWN_WALLBOX || wb_type >= MAX_WALLBOX_TYPES) {
+        return NULL;
+    }
+    return &WB_PROTOCOLS[wb_type];
+}
+
+wallbox_type ICACHE_FLASH_ATTR wb_protocol_find(const char *name, int len)
+{
+    int i;
+    for (i = UNKNOWN_WALLBOX + 1; i < MAX_WALLBOX_TYPES; i++) {
+        const char *protocol_name = WB_PROTOCOLS[i].name;
+        if (len == os_strlen(protocol_name) && os_strncmp(name, protocol_name, len) == 0) {
+            return (wallbox_type)i;
+        }
+    }
+    return UNKNOWN_WALLBOX;
+}
+
+void ICACHE_FLASH_ATTR wb_protocol_default_timing(const wb_protocol *protocol, wb_timing *timing)
+{
+    timing->delimiter_gap = protocol->delimiter_gap;
+    timing->delimiter_pulse = protocol->delimiter_pulse;
+    timing->debounce_gap = DEBOUNCE_GAP;
+
+    uint32 min_pulse = user_config_get_wallbox_min_pulse();
+    timing->min_pulse = (min_pulse > 0) ? (min_pulse * 1000) : GLITCH_PULSE;
+    timing->commit_timeout = protocol->commit_timeout;
+}
+
+/*
+ * Count the next signal pulse.
+ */
+void ICACHE_FLASH_ATTR wb_protocol_tally_step(const wb_protocol *protocol, const wb_timing *timing,
+    wb_selection_tally *tally, const wb_selection_pulse *pulse)
+{
+    if (tally->p1 > 0 && !tally->delimiter) {
+        if (protocol->delimiter == DELIMITER_GAP_OR_PULSE
+            && pulse->duration > timing->delimiter_pulse) {
+            // Delimiter pulses are not counted
+            tally->delimiter = true;
+            //os_printf("----DELIMITER (PULSE)----\r\n");
+            return;
+        }
+        if (pulse->elapsed > timing->delimiter_gap) {
+            tally->delimiter = true;
+            //os_printf("----DELIMITER (GAP)----\r\n");
+        }
+    }
+
+    if (!tally->delimiter) {
+        tally->p1++;
+    }
+    else {
+        tally->p2++;
+    }
+}
+
+/*
+ * Decode the pulse counts, and if they form a valid selection,
+ * provide the letter and number.
+ */
+wb_tally_state ICACHE_FLASH_ATTR wb_protocol_tally_decode(const wb_protocol *protocol,
+    const wb_selection_tally *tally, char *letter, int *number)
+{
+    int p1_max = protocol->p1_max;
+    int p2_max = protocol->p2_max;
+    int letter_count = protocol->letter_count;
+    int p1_index;
+    int p2_index;
+    int letter_index;
+    int number_val;
+
+    if (tally->p1 > p1_max || tally->p2 > p2_max
+        || (tally->delimiter && tally->p1 < (int)protocol->p1_min)) {
+        // No further pulses can make this valid
+        return TALLY_INVALID;
+    }
+
+    if (tally->p2 < (int)protocol->p2_min) {
+        // Reject incomplete values
+        return TALLY_INCOMPLETE;
+    }
+
+    if (protocol->p1_skip != 0 && tally->p1 == (int)protocol->p1_skip) {
+        // Reject invalid pulse 1 value
+        return TALLY_INVALID;
+    }
+
+    p1_index = tally->p1 - protocol->p1_min;
+    if (protocol->p1_skip != 0 && tally->p1 > (int)protocol->p1_skip) {
+        p1_index--;
+    }
+    p2_index = tally->p2 - protocol->p2_min;
+
+    if (protocol->layout == LAYOUT_NUMBER_LETTER) {
+        // Each group of 10 first train values selects the next letter
+        int banks = letter_count / (p2_max - protocol->p2_min + 1);
+        number_val = (p1_index % 10) + 1;
+        letter_index = (p2_index * banks) + (p1_index / 10);
+    }
+    else {
+        letter_index = p1_index;
+        number_val = p2_index + 1;
+    }
+
+    if (letter_index >= letter_count || number_val > 10) {
+        return TALLY_INVALID;
+    }
+
+    if (letter && number) {
+        wb_index_to_selection((letter_index * 10) + (number_val - 1), letter, number);
+    }
+
+    return (tally->p2 == p2_max) ? TALLY_COMPLETE : TALLY_VALID;
+}
@@ -0,0 +1,381 @@
+#include "user_wb_replay.h"
+
+#include <ets_sys.h>
+#include <osapi.h>
+#include <mem.h>
+#include <user_interface.h>
+#include <stdlib.h>
+
+#include "user_wb_protocol.h"
+#include "user_wb_decoder.h"
+#include "user_wb_calibrate.h"
+
+/* Longest trace line that will be parsed */
+#define REPLAY_LINE_MAX 32
+
+/* Edges parsed before being timed through the decoder */
+#define REPLAY_BATCH_SIZE 32
+
+/* Expected results that can be waiting for their selection */
+#define REPLAY_MAX_EXPECT 16
+
+/* Selection results kept for the report */
+#define REPLAY_MAX_RESULTS 16
+
+typedef struct wb_replay_edge {
+    uint32 time;
+    int level;
+} wb_replay_edge;
+
+typedef struct wb_replay_song {
+    char letter; // zero for a decode error
+    uint8 number;
+} wb_replay_song;
+
+typedef struct wb_replay_result {
+    wb_replay_song song;
+    wb_replay_song expected;
+    bool checked;
+    uint32 latency; // from the last edge to the commit, in milliseconds
+} wb_replay_result;
+
+struct wb_replay {
+    wallbox_type wb_type;
+    wb_timing timing;
+    wb_decoder decoder;
+    bool started;
+
+    char line[REPLAY_LINE_MAX];
+    int line_len;
+    bool line_overflow;
+
+    wb_replay_edge batch[REPLAY_BATCH_SIZE];
+    int batch_len;
+
+    wb_replay_song expect[REPLAY_MAX_EXPECT];
+    int expect_head;
+    int expect_count;
+
+    wb_replay_result results[REPLAY_MAX_RESULTS];
+    int result_count;
+
+    uint32 edges;
+    uint32 selections;
+    uint32 correct;
+    uint32 incorrect;
+    uint32 bad_lines;
+    uint32 error_gap;
+    uint32 error_pulse;
+    uint32 error_max;
+    uint32 error_decode;
+    uint32 spikes;
+    uint32 bounces;
+    uint32 latency_min;
+    uint32 latency_max;
+    uint32 decode_time; // total time spent in the decoder, in microseconds
+};
+
+LOCAL void ICACHE_FLASH_ATTR replay_line(wb_replay *replay);
+LOCAL void ICACHE_FLASH_ATTR replay_batch_run(wb_replay *replay);
+LOCAL void ICACHE_FLASH_ATTR replay_commit(wb_replay *replay);
+LOCAL int ICACHE_FLASH_ATTR replay_song_json(char *buf, const wb_replay_song *song);
+
+wb_replay * ICACHE_FLASH_ATTR user_wb_replay_start(int input, wallbox_type wb_type, bool calibrated)
+{
+    const wb_protocol *protocol = wb_protocol_get(wb_type);
+    if (!protocol || input < 0 || input >= WB_INPUTS) {
+        return NULL;
+    }
+
+    wb_replay *replay = (wb_replay *)os_zalloc(sizeof(wb_replay));
+    if (!replay) {
+        os_printf("Cannot allocate replay state\n");
+        return NULL;
+    }
+
+    replay->wb_type = wb_type;
+    if (calibrated) {
+        user_wb_calibrate_get_timing(input, wb_type, &replay->timing);
+    } else {
+        wb_protocol_default_timing(protocol, &replay->timing);
+    }
+    replay->latency_min = UINT32_MAX;
+    return replay;
+}
+
+/*
+ * Parse the next chunk of the trace, which may end partway through a line.
+ */
+bool ICACHE_FLASH_ATTR user_wb_replay_feed(wb_replay *replay, const char *data, int len)
+{
+    int i;
+
+    if (!data) {
+        return false;
+    }
+
+    for (i = 0; i < len; i++) {
+        char c = data[i];
+        if (c == '\n') {
+            if (replay->line_overflow) {
+                // Comments of any length are fine, as in downloaded traces
+                if (replay->line[0] != '#') {
+                    replay->bad_lines++;
+                }
+            } else {
+                replay->line[replay->line_len] = '\0';
+                replay_line(replay);
+            }
+            replay->line_len = 0;
+            replay->line_overflow = false;
+        }
+        else if (c != '\r') {
+            if (replay->line_len < REPLAY_LINE_MAX - 1) {
+                replay->line[replay->line_len++] = c;
+            } else {
+                replay->line_overflow = true;
+            }
+        }
+    }
+    return true;
+}
+
+/*
+ * Decode whatever remains of the trace, and write the report as JSON.
+ * Returns the length of the report.
+ */
+int ICACHE_FLASH_ATTR user_wb_replay_finish(wb_replay *replay, char *buf, int buf_len)
+{
+    const wb_protocol *protocol = wb_protocol_get(replay->wb_type);
+    int i;
+    int n;
+
+    // A final line without a newline
+    if (replay->line_len > 0 && !replay->line_overflow) {
+        replay->line[replay->line_len] = '\0';
+        replay_line(replay);
+        replay->line_len = 0;
+    }
+
+    replay_batch_run(replay);
+
+    // The trace ending stands in for the selection timing out
+    if (replay->decoder.pending) {
+        uint32 start = system_get_time();
+        replay_commit(replay);
+        replay->decode_time += system_get_time() - start;
+    }
+
+    n = os_sprintf(buf,
+        "{\"wallbox\": \"%s\", \"edges\": %d, \"selections\": %d, "
+        "\"correct\": %d, \"incorrect\": %d, \"unchecked\": %d, \"bad_lines\": %d, "
+        "\"errors\": {\"gap\": %d, \"pulse\": %d, \"max\": %d, \"decode\": %d}, "
+        "\"noise\": {\"spikes\": %d, \"bounces\": %d}, "
+        "\"timing\": {\"delimiter_gap\": %d, \"delimiter_pulse\": %d, \"debounce_gap\": %d, "
+        "\"min_pulse\": %d, \"commit_timeout\": %d}, "
+        "\"latency_ms\": {\"min\": %d, \"max\": %d}, \"ns_per_edge\": %d, \"results\": [",
+        protocol->name, replay->edges, replay->selections,
+        replay->correct, replay->incorrect,
+        replay->selections - replay->correct - replay->incorrect, replay->bad_lines,
+        replay->error_gap, replay->error_pulse, replay->error_max, replay->error_decode,
+        replay->spikes, replay->bounces,
+        replay->timing.delimiter_gap, replay->timing.delimiter_pulse,
+        replay->timing.debounce_gap, replay->timing.min_pulse, replay->timing.commit_timeout,
+        replay->selections > 0 ? replay->latency_min : 0, replay->latency_max,
+        replay->edges > 0 ? (replay->decode_time * 1000) / replay->edges : 0);
+
+    for (i = 0; i < replay->result_count && buf_len - n > 80; i++) {
+        const wb_replay_result *result = &replay->results[i];
+        n += os_sprintf(buf + n, "%s{\"song\": ", (i > 0) ? ", " : "");
+        n += replay_song_json(buf + n, &result->song);
+        n += os_sprintf(buf + n, ", \"expected\": ");
+        if (result->checked) {
+            n += replay_song_json(buf + n, &result->expected);
+        } else {
+            n += os_sprintf(buf + n, "null");
+        }
+        n += os_sprintf(buf + n, ", \"latency_ms\": %d}", result->latency);
+    }
+    n += os_sprintf(buf + n, "]}");
+
+    return n;
+}
+
+/*
+ * Provide the outcome of a finished replay.
+ * Returns true if the trace passed.
+ */
+bool ICACHE_FLASH_ATTR user_wb_replay_summary(const wb_replay *replay, wb_replay_summary *summary)
+{
+    summary->edges = replay->edges;
+    summary->selections = replay->selections;
+    summary->correct = replay->correct;
+    summary->incorrect = replay->incorrect;
+    summary->unchecked = replay->selections - replay->correct - replay->incorrect;
+    summary->missed = replay->expect_count;
+    summary->bad_lines = replay->bad_lines;
+
+    return summary->incorrect == 0 && summary->unchecked == 0
+        && summary->missed == 0 && summary->bad_lines == 0;
+}
+
+void ICACHE_FLASH_ATTR user_wb_replay_free(wb_replay *replay)
+{
+    os_free(replay);
+}
+
+LOCAL void ICACHE_FLASH_ATTR replay_line(wb_replay *replay)
+{
+    char *ptemp = replay->line;
+    char *qtemp = NULL;
+
+    if (*ptemp == '\0' || *ptemp == '#') {
+        return;
+    }
+
+    if (os_strncmp(ptemp, "expect,", 7) == 0) {
+        wb_replay_song song;
+        ptemp += 7;
+        if (os_strcmp(ptemp, "error") == 0) {
+            song.letter = 0;
+            song.number = 0;
+        } else if (*ptemp >= 'A' && *ptemp <= 'Z') {
+            song.letter = *ptemp;
+            song.number = strtol(ptemp + 1, NULL, 10);
+        } else {
+            replay->bad_lines++;
+            return;
+        }
+
+        // Run the edges parsed so far, so their selections take
+        // their expectations off the queue before this one is added.
+        replay_batch_run(replay);
+
+        if (replay->expect_count < REPLAY_MAX_EXPECT) {
+            int index = (replay->expect_head + replay->expect_count) % REPLAY_MAX_EXPECT;
+            replay->expect[index] = song;
+            replay->expect_count++;
+        } else {
+            replay->bad_lines++;
+        }
+        return;
+    }
+
+    uint32 time = strtoul(ptemp, &qtemp, 10);
+    if (qtemp == ptemp || *qtemp != ',' || (qtemp[1] != '0' && qtemp[1] != '1')) {
+        replay->bad_lines++;
+        return;
+    }
+
+    wb_replay_edge *edge = &replay->batch[replay->batch_len++];
+    edge->time = time;
+    edge->level = qtemp[1] - '0';
+
+    if (replay->batch_len == REPLAY_BATCH_SIZE) {
+        replay_batch_run(replay);
+    }
+}
+
+/*
+ * Feed the parsed edges through the decoder, committing selections
+ * wherever the gap to the next edge would have let the timeout expire.
+ */
+LOCAL void ICACHE_FLASH_ATTR replay_batch_run(wb_replay *replay)
+{
+    int i;
+    uint32 start = system_get_time();
+
+    for (i = 0; i < replay->batch_len; i++) {
+        const wb_replay_edge *edge = &replay->batch[i];
+
+        if (!replay->started) {
+            // Start out as if the signal had been idle
+            wb_decoder_init(&replay->decoder, wb_protocol_get(replay->wb_type), &replay->timing,
+                edge->time - (WB_TIMEOUT_IDLE * 1000));
+            replay->started = true;
+        }
+        else if (wb_decoder_expired(&replay->decoder, edge->time)) {
+            replay_commit(replay);
+        }
+
+        switch (wb_decoder_edge(&replay->decoder, edge->level, edge->time)) {
+        case DECODER_EDGE_NONE:
+            continue;
+        case DECODER_EDGE_SPIKE:
+            break;
+        case DECODER_EDGE_ERROR_GAP:
+            replay->error_gap++;
+            break;
+        case DECODER_EDGE_ERROR_PULSE:
+            replay->error_pulse++;
+            break;
+        case DECODER_EDGE_ERROR_MAX:
+            replay->error_max++;
+            break;
+        default:
+            break;
+        }
+        replay->edges++;
+    }
+
+    replay->decode_time += system_get_time() - start;
+    replay->batch_len = 0;
+}
+
+LOCAL void ICACHE_FLASH_ATTR replay_commit(wb_replay *replay)
+{
+    wb_replay_result result;
+    char letter;
+    int number;
+
+    os_bzero(&result, sizeof(wb_replay_result));
+    result.latency = replay->decoder.timeout;
+    replay->spikes += replay->decoder.spikes;
+    replay->bounces += replay->decoder.bounces;
+
+    switch (wb_decoder_commit(&replay->decoder, &letter, &number, NULL)) {
+    case TALLY_VALID:
+    case TALLY_COMPLETE:
+        result.song.letter = letter;
+        result.song.number = number;
+        break;
+    default:
+        replay->error_decode++;
+        break;
+    }
+    replay->selections++;
+
+    if (replay->expect_count > 0) {
+        result.expected = replay->expect[replay->expect_head];
+        result.checked = true;
+        replay->expect_head = (replay->expect_head + 1) % REPLAY_MAX_EXPECT;
+        replay->expect_count--;
+
+        if (result.song.letter == result.expected.letter
+            && result.song.number == result.expected.number) {
+            replay->correct++;
+        } else {
+            replay->incorrect++;
+        }
+    }
+
+    if (result.latency < replay->latency_min) {
+        replay->latency_min = result.latency;
+    }
+    if (result.latency > replay->latency_max) {
+        replay->latency_max = result.latency;
+    }
+
+    if (replay->result_count < REPLAY_MAX_RESULTS) {
+        replay->results[replay->result_count++] = result;
+    }
+}
+
+LOCAL int ICACHE_FLASH_ATTR replay_song_json(char *buf, const wb_replay_song *song)
+{
+    if (song->letter) {
+        return os_sprintf(buf, "\"%c%d\"", song->letter, song->number);
+    } else {
+        return os_sprintf(buf, "\"error\"");
+    }
+}
@@ -9,327 +9,495 @@
 #include <libesphttpd/espmissingincludes.h>
 
 #include "user_sonos_client.h"
+#include "user_wb_protocol.h"
+#include "user_wb_decoder.h"
+#include "user_wb_detect.h"
+#include "user_wb_calibrate.h"
+#include "user_wb_trace.h"
+#include "user_wb_stats.h"
+#include "user_hw_timer.h"
 
-/* Definition of GPIO pin parameters */
-#define SELECTION_SIGNAL_IO_MUX  PERIPHS_IO_MUX_GPIO4_U
-#define SELECTION_SIGNAL_IO_NUM  4
-#define SELECTION_SIGNAL_IO_FUNC FUNC_GPIO4
+/* Number of edges the interrupt handler can queue, must be a power of 2 */
+#define WB_EDGE_QUEUE_SIZE 128
 
-/* Maximum accumulated length of a pulse stream */
-#define MAX_WB_SELECTION_PULSES 64
+/* Task used to process queued edges outside of interrupt context */
+#define SELECTION_TASK_PRIO USER_TASK_PRIO_2
+#define SELECTION_TASK_QUEUE_LEN (2 + (2 * WB_INPUTS))
 
-/* Minimum allowable pulse gap, in microseconds */
-#define DEBOUNCE_GAP 10000
+/* Selection task signals */
+#define SELECTION_SIG_EDGE    0 // edges have been queued
+#define SELECTION_SIG_TIMEOUT 1 // selection timeout expired, plus the input number
 
-typedef struct wb_selection_pulse {
-    uint32 elapsed; // time since the end of the last pulse
-    uint32 duration; // duration of the current pulse
-} wb_selection_pulse;
+/*
+ * Longest interval measured with the cycle counter, in microseconds.
+ * Kept within the time the counter takes to wrap at 160MHz.
+ */
+#define WB_CCOUNT_SPAN_US 20000000
 
-LOCAL void wb_pulse_list_clear();
-LOCAL bool wb_pulse_list_tally_3w1_100(char *letter, int *number);
-LOCAL bool wb_pulse_list_tally_v3wa_200(char *letter, int *number);
-LOCAL void wp_pulse_gpio_intr_handler(void *arg);
-LOCAL void wb_pulse_timer_func(void *arg);
+typedef struct wb_input_pin {
+    uint32 mux;
+    uint32 num;
+    uint32 func;
+    uint32 strap; // boot strapping pin, which must be low at reset
+} wb_input_pin;
 
-LOCAL volatile wallbox_type wb_selected_type;
-LOCAL volatile wallbox_type wb_active_type;
-LOCAL int wb_pulse_last_value;
-LOCAL uint32 wb_pulse_last_time;
-LOCAL wb_selection_pulse wb_pulse_list[MAX_WB_SELECTION_PULSES];
-LOCAL int wb_pulse_index;
-LOCAL os_timer_t wb_pulse_timer;
+/*
+ * Definition of GPIO pin parameters, one per selection input.
+ *
+ * The pins left free are the UART, GPIO16, which has no edge
+ * interrupts, and the boot strapping pins, so the second input is on
+ * GPIO15 (MTDO). That pin picks the boot mode, and the module only
+ * boots from flash if it is low at reset. It needs a pull-down of 10K
+ * or less to ground, and the wallbox signal on it must idle low, only
+ * going high during a pulse. The input is left off if it is found high
+ * at startup, since the next reset would then not boot.
+ */
+LOCAL const wb_input_pin wb_input_pins[WB_INPUTS] = {
+    {PERIPHS_IO_MUX_GPIO4_U, 4, FUNC_GPIO4, 0},
+    {PERIPHS_IO_MUX_MTDO_U, 15, FUNC_GPIO15, 1}
+};
+
+typedef struct wb_selection_edge {
+    uint32 cycles; // cycle counter at the start of the interrupt
+    uint32 time; // system time of the edge, for long intervals
+    uint16 input; // input the edge was seen on
+    uint16 level; // signal level after the edge
+} wb_selection_edge;
 
-void wb_pulse_list_clear()
-{
-    wb_pulse_index = 0;
-    os_bzero(wb_pulse_list, sizeof(wb_pulse_list));
-}
+/*
+ * Decoding state for one selection input.
+ */
+typedef struct wb_input {
+    wallbox_type selected_type;
+    wallbox_type active_type;
+    bool timing_changed;
+    wb_decoder decoder;
+    volatile uint32 timeout_seq;
+} wb_input;
+
+LOCAL void wp_pulse_gpio_intr_handler(void *arg);
+LOCAL void wb_selection_task(os_event_t *event);
+LOCAL void wb_edge_queue_drain();
+LOCAL uint32 wb_edge_time(uint32 cycles, uint32 time);
+LOCAL bool wb_pulse_edge(int index, int currentPulseValue, uint32 currentPulseTime);
+LOCAL void wb_pulse_timeout_intr_handler(void *arg);
+LOCAL void wb_pulse_timeout(int index);
+LOCAL void wb_pulse_detect_commit(int index);
+
+LOCAL wb_input wb_inputs[WB_INPUTS];
+LOCAL int wb_input_count;
+LOCAL uint32 wb_input_mask;
+
+/* Edge clock, derived from the cycle counter */
+LOCAL uint32 wb_edge_last_cycles;
+LOCAL uint32 wb_edge_last_system;
+LOCAL uint32 wb_edge_last_time;
+LOCAL uint32 wb_edge_cycle_rem;
 
 /*
- * Count the signal pulses.
- * Wallbox: Seeburg Wall-O-Matic 3W-1 100
+ * Single-producer/single-consumer edge queue, shared by all the inputs.
+ * The head is only written by the interrupt handler, and the tail is
+ * only written by the selection task.
  */
-bool wb_pulse_list_tally_3w1_100(char *letter, int *number)
+LOCAL volatile wb_selection_edge wb_edge_queue[WB_EDGE_QUEUE_SIZE];
+LOCAL volatile uint32 wb_edge_head;
+LOCAL volatile uint32 wb_edge_tail;
+LOCAL volatile uint32 wb_edge_overflow;
+LOCAL uint32 wb_edge_overflow_reported;
+LOCAL volatile bool wb_edge_task_posted;
+LOCAL os_event_t wb_selection_task_queue[SELECTION_TASK_QUEUE_LEN];
+
+static inline uint32 wb_get_ccount(void)
 {
+    uint32 ccount;
+    __asm__ __volatile__("rsr %0, ccount" : "=a"(ccount));
+    return ccount;
+}
+
+LOCAL void wp_pulse_gpio_intr_handler(void *arg)
+{
+    // Capture the edge time before anything else, so the time spent
+    // getting here and reading registers does not add jitter.
+    uint32 cycles = wb_get_ccount();
+    uint32 gpio_status = GPIO_REG_READ(GPIO_STATUS_ADDRESS) & wb_input_mask;
     int i;
-    int p1 = 0;
-    int p2 = 0;
-    bool delimiter = false;
-    char letter_val;
-    int number_val;
-
-    for (i = 0; i < wb_pulse_index; i++) {
-        // Pulse delimiter is ~800ms, so use 500 to be safe
-        if (p1 > 0 && !delimiter && wb_pulse_list[i].duration > 500000) {
-            delimiter = true;
-            //os_printf("----DELIMITER (PULSE)----\r\n");
-        }
-        else {
-            // Gap delimiter is ~170ms, so use 100 to be safe
-            if (p1 > 0 && !delimiter && wb_pulse_list[i].elapsed > 100000) {
-                delimiter = true;
-                //os_printf("----DELIMITER (GAP)----\r\n");
-            }
-            if (!delimiter) {
-                p1++;
+
+    // If the interrupt was by one of the selection inputs
+    if (gpio_status) {
+        // Clear interrupt status for the inputs before sampling the pins, so
+        // an edge that arrives while we're in here raises a new interrupt.
+        GPIO_REG_WRITE(GPIO_STATUS_W1TC_ADDRESS, gpio_status);
+
+        uint32 time = system_get_time();
+        uint32 levels = GPIO_REG_READ(GPIO_IN_ADDRESS);
+
+        for (i = 0; i < wb_input_count; i++) {
+            uint32 pin = wb_input_pins[i].num;
+            if (!(gpio_status & BIT(pin))) {
+                continue;
             }
-            else {
-                p2++;
+
+            uint32 head = wb_edge_head;
+            if (head - wb_edge_tail < WB_EDGE_QUEUE_SIZE) {
+                volatile wb_selection_edge *edge = &wb_edge_queue[head & (WB_EDGE_QUEUE_SIZE - 1)];
+                edge->cycles = cycles;
+                edge->time = time;
+                edge->input = i;
+                edge->level = (levels >> pin) & 1;
+                wb_edge_head = head + 1;
+            } else {
+                wb_edge_overflow++;
             }
         }
-    }
 
-    if (p2 < 1 || p2 > 5) {
-        // Reject invalid or incomplete values
-        return false;
+        // If the task queue is full, the next edge tries again
+        if (!wb_edge_task_posted) {
+            wb_edge_task_posted = system_os_post(SELECTION_TASK_PRIO, SELECTION_SIG_EDGE, 0);
+        }
     }
+}
 
-    if (p1 >= 1 && p1 <= 10) {
-        number_val = p1;
-        letter_val = 'A' + (p2 - 1) * 2;
-    }
-    else if (p1 >= 12 && p1 <= 21) {
-        number_val = p1 - 11;
-        letter_val = 'A' + ((p2 - 1) * 2) + 1;
+LOCAL void wb_pulse_timeout_intr_handler(void *arg)
+{
+    wb_input *input = (wb_input *)arg;
+    system_os_post(SELECTION_TASK_PRIO, SELECTION_SIG_TIMEOUT + (input - wb_inputs), input->timeout_seq);
+}
+
+LOCAL void wb_selection_task(os_event_t *event)
+{
+    if (event->sig >= SELECTION_SIG_TIMEOUT && event->sig < SELECTION_SIG_TIMEOUT + wb_input_count) {
+        int index = event->sig - SELECTION_SIG_TIMEOUT;
+
+        // Ignore a timeout that was rearmed after it was posted
+        if (event->par == wb_inputs[index].timeout_seq) {
+            wb_pulse_timeout(index);
+        }
+    } else {
+        wb_edge_queue_drain();
     }
-    else {
-        // Reject invalid pulse 1 value
-        return false;
+}
+
+/*
+ * Process all edges captured by the interrupt handler since the last call.
+ */
+LOCAL void wb_edge_queue_drain()
+{
+    // Clear the flag first, so an edge captured while we're draining
+    // posts a new task event rather than being left in the queue.
+    wb_edge_task_posted = false;
+
+    while (wb_edge_tail != wb_edge_head) {
+        volatile wb_selection_edge *edge = &wb_edge_queue[wb_edge_tail & (WB_EDGE_QUEUE_SIZE - 1)];
+        int index = edge->input;
+        int value = edge->level;
+        uint32 time = wb_edge_time(edge->cycles, edge->time);
+        wb_edge_tail++;
+
+        wb_pulse_edge(index, value, time);
     }
 
-    // This wallbox skips the letter 'I'
-    if (letter_val > 'H') { letter_val++; }
+    if (wb_edge_overflow != wb_edge_overflow_reported) {
+        // The queue is shared, so overflows are counted against the first input
+        os_printf("--> Edge queue overflow: %d\r\n", wb_edge_overflow - wb_edge_overflow_reported);
+        user_wb_stats_count(0, WB_STATS_OVERFLOW, wb_edge_overflow - wb_edge_overflow_reported);
+        wb_edge_overflow_reported = wb_edge_overflow;
+    }
+}
 
-    if (letter && number) {
-        *letter = letter_val;
-        *number = number_val;
+/*
+ * Convert the captured cycle counter to a time in microseconds.
+ * Fractions of a microsecond are carried over to the next edge, so
+ * errors do not accumulate over the edges of a selection.
+ */
+LOCAL uint32 wb_edge_time(uint32 cycles, uint32 time)
+{
+    if (time - wb_edge_last_system < WB_CCOUNT_SPAN_US) {
+        uint32 cpu_freq = system_get_cpu_freq();
+        uint32 elapsed = (cycles - wb_edge_last_cycles) + wb_edge_cycle_rem;
+        wb_edge_last_time += elapsed / cpu_freq;
+        wb_edge_cycle_rem = elapsed % cpu_freq;
+    } else {
+        // The cycle counter may have wrapped since the last edge
+        wb_edge_last_time += time - wb_edge_last_system;
+        wb_edge_cycle_rem = 0;
     }
 
-    return true;
+    wb_edge_last_cycles = cycles;
+    wb_edge_last_system = time;
+    return wb_edge_last_time;
 }
 
 /*
- * Count the signal pulses.
- * Wallbox: Seeburg Wall-O-Matic V-3WA 200
+ * Process a single edge from the selection signal of an input.
+ * Returns true if the edge was a level transition.
  */
-LOCAL bool wb_pulse_list_tally_v3wa_200(char *letter, int *number)
+LOCAL bool wb_pulse_edge(int index, int currentPulseValue, uint32 currentPulseTime)
 {
-    LOCAL const char WB_LETTERS[] = "ABCDEFGHJKLMNPQRSTUV";
-    int i;
-    int p1 = 0;
-    int p2 = 0;
-    bool delimiter = false;
-    char letter_val;
-    int number_val;
-
-    for (i = 0; i < wb_pulse_index; i++) {
-        // Gap delimiter is ~230ms, so use 125 to be safe
-        if (p1 > 0 && !delimiter && wb_pulse_list[i].elapsed > 125000) {
-            delimiter = true;
-            //os_printf("----DELIMITER (GAP)----\r\n");
-        }
-        if (!delimiter) {
-            p1++;
-        }
-        else {
-            p2++;
+    wb_input *input = &wb_inputs[index];
+    uint32 timeout;
+    uint32 since;
+
+    if (input->active_type != input->selected_type || input->timing_changed) {
+        wb_timing timing;
+        input->active_type = input->selected_type;
+        input->timing_changed = false;
+        user_wb_calibrate_get_timing(index, input->active_type, &timing);
+        wb_decoder_set_protocol(&input->decoder, wb_protocol_get(input->active_type), &timing);
+        if (input->active_type == UNKNOWN_WALLBOX) {
+            user_wb_detect_reset(index, input->decoder.last_time);
         }
     }
 
-    if (p1 < 2 || p1 > 21 || p2 < 1 || p2 > 10) {
-        // Reject invalid or incomplete values
+    // The selection decoder always follows the signal, so it is in step
+    // with the signal level once detection settles on a wallbox type.
+    wb_decoder_result result = wb_decoder_edge(&input->decoder, currentPulseValue, currentPulseTime);
+    if (result == DECODER_EDGE_NONE) {
         return false;
     }
 
-    letter_val = WB_LETTERS[p1 - 2];
-    number_val = p2;
+    // Any timeout already posted is now stale
+    input->timeout_seq++;
+
+    user_wb_trace_edge(index, currentPulseValue, currentPulseTime);
 
-    if (letter && number) {
-        *letter = letter_val;
-        *number = number_val;
+    if (input->active_type == UNKNOWN_WALLBOX) {
+        user_wb_detect_edge(index, currentPulseValue, currentPulseTime);
+        timeout = user_wb_detect_timeout(index);
+        since = 0;
+    } else {
+        // The timeout runs from the last accepted edge, which is
+        // earlier than this one if this edge ended a spike.
+        timeout = input->decoder.timeout;
+        since = currentPulseTime - input->decoder.last_time;
     }
 
+    switch (result) {
+    case DECODER_EDGE_SPIKE:
+        if (input->decoder.pulse_index == 0) {
+            // Nothing to wait for if the spike was all there was
+            user_hw_timer_disarm(HW_TIMER_SELECTION + index);
+            user_wb_trace_discard(index);
+            return true;
+        }
+        break;
+    case DECODER_EDGE_ERROR_GAP:
+        os_printf("--> Error 1 (input %d)\r\n", index + 1);
+        user_wb_stats_count(index, WB_STATS_ERROR_GAP, 1);
+        break;
+    case DECODER_EDGE_ERROR_PULSE:
+        os_printf("--> Error 2 (input %d)\r\n", index + 1);
+        user_wb_stats_count(index, WB_STATS_ERROR_PULSE, 1);
+        break;
+    case DECODER_EDGE_ERROR_MAX:
+        os_printf("--> Error MAX (input %d)\r\n", index + 1);
+        user_wb_stats_count(index, WB_STATS_ERROR_MAX, 1);
+        break;
+    default:
+        break;
+    }
+
+    user_hw_timer_arm(HW_TIMER_SELECTION + index,
+        (timeout * 1000 > since) ? (timeout * 1000 - since) : 0,
+        wb_pulse_timeout_intr_handler, input);
     return true;
 }
 
-LOCAL void wp_pulse_gpio_intr_handler(void *arg)
+LOCAL void wb_pulse_timeout(int index)
 {
-    uint32 gpio_status = GPIO_REG_READ(GPIO_STATUS_ADDRESS);
-
-    // If the interrupt was by GPIO4
-    if (gpio_status & BIT(SELECTION_SIGNAL_IO_NUM)) {
-        uint32_t timeout = 3000;
-
-        // Disable interrupt for GPIO4
-        gpio_pin_intr_state_set(
-            GPIO_ID_PIN(SELECTION_SIGNAL_IO_NUM),
-            GPIO_PIN_INTR_DISABLE);
+    wb_input *input = &wb_inputs[index];
+    char letter;
+    int number;
+    wb_train_timing train;
+    wb_tally_state result;
+    uint32 spikes;
+    uint32 bounces;
+    uint32 seq = input->timeout_seq;
+
+    // Edges may have been captured after the timer expired but before
+    // it got to run. If so, they have restarted the timer.
+    wb_edge_queue_drain();
+    if (input->timeout_seq != seq) {
+        return;
+    }
 
-        int currentPulseValue = GPIO_INPUT_GET(GPIO_ID_PIN(SELECTION_SIGNAL_IO_NUM));
-        uint32 currentPulseTime = system_get_time();
+    if (input->active_type == UNKNOWN_WALLBOX) {
+        wb_decoder_clear(&input->decoder);
+        wb_pulse_detect_commit(index);
+        return;
+    }
 
-        if (wb_active_type != wb_selected_type) {
-            wb_active_type = wb_selected_type;
-            if (wb_pulse_index > 0) {
-                wb_pulse_list_clear();
-            }            
-        }
+    spikes = input->decoder.spikes;
+    bounces = input->decoder.bounces;
+    result = wb_decoder_commit(&input->decoder, &letter, &number, &train);
 
-        // Do something
-        if(currentPulseValue != wb_pulse_last_value) {
-            os_timer_disarm(&wb_pulse_timer);
-
-            uint32 elapsed = currentPulseTime - wb_pulse_last_time;
-            if (currentPulseValue == 1) {
-                //os_printf("--> Gap: %dms\r\n", (elapsed / 1000));
-                if (wb_pulse_list[wb_pulse_index].duration == 0) {
-                    wb_pulse_list[wb_pulse_index].elapsed = elapsed;
-                } else {
-                    // Error
-                    os_printf("--> Error 1\r\n");
-                }
-            }
-            else if (currentPulseValue == 0) {
-                //os_printf("--> Pulse: %dms\r\n", (elapsed / 1000));
-                if (wb_pulse_list[wb_pulse_index].elapsed > 0) {
-                    if (wb_pulse_index > 0 && wb_pulse_list[wb_pulse_index].elapsed < DEBOUNCE_GAP) {
-                        // If this pulse had a negligible gap from the previous
-                        // pulse, then merge them.
-                        wb_pulse_list[wb_pulse_index - 1].duration +=
-                            wb_pulse_list[wb_pulse_index].elapsed + elapsed;
-
-                        wb_pulse_list[wb_pulse_index].elapsed = 0;
-                        wb_pulse_list[wb_pulse_index].duration = 0;
-                        //os_printf("-->Debounce\n");
-                    } else {
-                        wb_pulse_list[wb_pulse_index].duration = elapsed;
-                        wb_pulse_index++;
-                    }
-                } else {
-                    // Error
-                    os_printf("--> Error 2\r\n");
-                }
-            }
-            if (wb_pulse_index >= MAX_WB_SELECTION_PULSES) {
-                os_printf("--> Error MAX\r\n");
-                wb_pulse_list_clear();
-            } else {
-                // Count existing pulses
-                if (wb_active_type == SEEBURG_3W1_100) {
-                    if (wb_pulse_list_tally_3w1_100(0, 0)) {
-                        timeout = 250;
-                    }
-                } else if(wb_active_type == SEEBURG_V3WA_200) {
-                    if (wb_pulse_list_tally_v3wa_200(0, 0)) {
-                        timeout = 250;
-                    }
-                } else {
-                    // Unknown wallbox type
-                    os_printf("Unknown wallbox\n");
-                    wb_pulse_list_clear();
-                }
-            }
-            wb_pulse_last_value = currentPulseValue;
-            wb_pulse_last_time = currentPulseTime;
-
-            os_timer_setfn(&wb_pulse_timer, (os_timer_func_t *)wb_pulse_timer_func, /*arg*/NULL);
-            os_timer_arm(&wb_pulse_timer, timeout, 0);
-        }
+    if (spikes > 0 || bounces > 0) {
+        os_printf("--> Noise (input %d): %d spikes, %d bounces\r\n", index + 1, spikes, bounces);
+    }
 
-        // Clear interrupt status for GPIO4
-        GPIO_REG_WRITE(GPIO_STATUS_W1TC_ADDRESS, gpio_status & BIT(SELECTION_SIGNAL_IO_NUM));
+    if (result == TALLY_VALID || result == TALLY_COMPLETE) {
+        // Learn from the selection, and pick up any tightened thresholds
+        user_wb_calibrate_train_commit(index, input->active_type, &train);
+        user_wb_calibrate_get_timing(index, input->active_type, &input->decoder.timing);
 
-        // Reactivate interrupts for GPIO4
-        gpio_pin_intr_state_set(
-            GPIO_ID_PIN(SELECTION_SIGNAL_IO_NUM),
-            GPIO_PIN_INTR_ANYEDGE);
+        os_printf("--> Song (input %d): %c%d\r\n", index + 1, letter, number);
+        user_wb_stats_count(index, WB_STATS_SELECTION, 1);
+        user_wb_trace_commit(index, input->active_type, WB_TRACE_SONG, letter, number, spikes, bounces);
+        user_sonos_client_enqueue(index, letter, number);
+    } else {
+        os_printf("--> Timeout decode error (input %d)\r\n", index + 1);
+        user_wb_stats_count(index, WB_STATS_ERROR_DECODE, 1);
+        user_wb_trace_commit(index, input->active_type, WB_TRACE_ERROR, 0, 0, spikes, bounces);
     }
 }
 
-void wb_pulse_timer_func(void *arg)
+/*
+ * Finish a selection received while the wallbox type is being detected.
+ */
+LOCAL void wb_pulse_detect_commit(int index)
 {
     char letter;
     int number;
-    bool result;
-
-    // Disable interrupts while we process the results
-    gpio_pin_intr_state_set(GPIO_ID_PIN(4), GPIO_PIN_INTR_DISABLE);
-
-    os_timer_disarm(&wb_pulse_timer);
 
-    if (wb_active_type == SEEBURG_3W1_100) {
-        result = wb_pulse_list_tally_3w1_100(&letter, &number);
-    } else if(wb_active_type == SEEBURG_V3WA_200) {
-        result = wb_pulse_list_tally_v3wa_200(&letter, &number);
+    if (user_wb_detect_commit(index, &letter, &number)) {
+        os_printf("--> Song (input %d): %c%d\r\n", index + 1, letter, number);
+        user_wb_stats_count(index, WB_STATS_SELECTION, 1);
+        user_wb_trace_commit(index, UNKNOWN_WALLBOX, WB_TRACE_SONG, letter, number, 0, 0);
+        user_sonos_client_enqueue(index, letter, number);
     } else {
-        result = false;
+        os_printf("--> Timeout decode error (input %d)\r\n", index + 1);
+        user_wb_stats_count(index, WB_STATS_ERROR_DECODE, 1);
+        user_wb_trace_commit(index, UNKNOWN_WALLBOX, WB_TRACE_ERROR, 0, 0, 0, 0);
     }
 
-#if 0
-    int i;
-    os_printf("----BEGIN PULSES----\n");
-    for (i = 0; i < wb_pulse_index; i++) {
-        os_printf("%d, %d\n", wb_pulse_list[i].elapsed / 1000, wb_pulse_list[i].duration / 1000);
+    wallbox_type detected = user_wb_detect_locked(index);
+    if (detected != UNKNOWN_WALLBOX) {
+        wb_inputs[index].selected_type = detected;
+        if (user_config_get_wallbox_detect_save()) {
+            os_printf("Saving detected wallbox type\n");
+            user_config_set_wallbox_type(index, detected);
+            user_config_save();
+        }
     }
-    os_printf("----END PULSES----\n");
-#endif
+}
 
-    wb_pulse_list_clear();
+void ICACHE_FLASH_ATTR user_wb_set_wallbox_type(int index, wallbox_type wb_type)
+{
+    if (index < 0 || index >= wb_input_count) {
+        return;
+    }
 
-    // Reenable interrupts
-    gpio_pin_intr_state_set(GPIO_ID_PIN(4), GPIO_PIN_INTR_ANYEDGE);
+    wb_inputs[index].selected_type = wb_type;
 
-    if (result) {
-        os_printf("--> Song: %c%d\r\n", letter, number);
-        user_sonos_client_enqueue(letter, number);
-    } else {
-        os_printf("--> Timeout decode error\r\n");
+    // Pick up any change to the configured timing
+    wb_inputs[index].timing_changed = true;
+}
+
+/*
+ * Pick up a change to the timing settings shared by every input.
+ */
+void ICACHE_FLASH_ATTR user_wb_reload_timing(void)
+{
+    int i;
+
+    for (i = 0; i < wb_input_count; i++) {
+        wb_inputs[i].timing_changed = true;
     }
 }
 
-void ICACHE_FLASH_ATTR user_wb_set_wallbox_type(wallbox_type wb_type)
+wallbox_type ICACHE_FLASH_ATTR user_wb_get_wallbox_type(int index)
 {
-    wb_selected_type = wb_type;
+    if (index < 0 || index >= wb_input_count) {
+        return UNKNOWN_WALLBOX;
+    }
+    return wb_inputs[index].selected_type;
 }
 
 void ICACHE_FLASH_ATTR user_wb_selection_init(void)
 {
+    int i;
+
     // Initialize state variables
-    wb_pulse_last_value = 0;
-    wb_pulse_last_time = system_get_time();
-    os_bzero(&wb_pulse_timer, sizeof(wb_pulse_timer));
-    wb_pulse_list_clear();
-    wb_selected_type = UNKNOWN_WALLBOX;
-    wb_active_type = UNKNOWN_WALLBOX;
+    wb_edge_last_cycles = wb_get_ccount();
+    wb_edge_last_system = system_get_time();
+    wb_edge_last_time = wb_edge_last_system;
+    wb_edge_cycle_rem = 0;
+    wb_input_count = user_config_get_input_count();
+    for (i = 0; i < wb_input_count; i++) {
+        const wb_input_pin *pin = &wb_input_pins[i];
+        if (!pin->strap) {
+            continue;
+        }
+
+        PIN_FUNC_SELECT(pin->mux, pin->func);
+        PIN_PULLUP_DIS(pin->mux);
+        gpio_output_set(0, 0, 0, GPIO_ID_PIN(pin->num));
+        if (GPIO_INPUT_GET(GPIO_ID_PIN(pin->num)) != 0) {
+            os_printf("Input %d on GPIO%d idles high, which stops it booting, so it is disabled\n",
+                i + 1, pin->num);
+            wb_input_count = i;
+            break;
+        }
+    }
+    wb_input_mask = 0;
+    os_bzero(wb_inputs, sizeof(wb_inputs));
+    for (i = 0; i < wb_input_count; i++) {
+        wb_input *input = &wb_inputs[i];
+        wb_decoder_init(&input->decoder, NULL, NULL, wb_edge_last_time);
+        input->decoder.stats = true;
+        input->decoder.stats_input = i;
+        input->selected_type = UNKNOWN_WALLBOX;
+        input->active_type = UNKNOWN_WALLBOX;
+        user_wb_detect_reset(i, input->decoder.last_time);
+        user_wb_stats_reset(i);
+        wb_input_mask |= BIT(wb_input_pins[i].num);
+    }
+    user_wb_calibrate_init();
+    user_wb_trace_init();
+    wb_edge_head = 0;
+    wb_edge_tail = 0;
+    wb_edge_overflow = 0;
+    wb_edge_overflow_reported = 0;
+    wb_edge_task_posted = false;
+
+    // Create the task that decodes the captured edges
+    system_os_task(wb_selection_task, SELECTION_TASK_PRIO,
+        wb_selection_task_queue, SELECTION_TASK_QUEUE_LEN);
 
     // Disable interrupts by GPIO
     ETS_GPIO_INTR_DISABLE();
 
-    // Set signal pin as GPIO
-    PIN_FUNC_SELECT(SELECTION_SIGNAL_IO_MUX, SELECTION_SIGNAL_IO_FUNC);
-    PIN_PULLUP_DIS(SELECTION_SIGNAL_IO_MUX);
+    for (i = 0; i < wb_input_count; i++) {
+        const wb_input_pin *pin = &wb_input_pins[i];
 
-    // Set signal pin as input
-    gpio_output_set(0, 0, 0, GPIO_ID_PIN(SELECTION_SIGNAL_IO_NUM));
+        // Set signal pin as GPIO
+        PIN_FUNC_SELECT(pin->mux, pin->func);
+        PIN_PULLUP_DIS(pin->mux);
 
-    // Attach interrupt handler
-    ETS_GPIO_INTR_ATTACH(wp_pulse_gpio_intr_handler, /*arg*/NULL);
+        // Set signal pin as input
+        gpio_output_set(0, 0, 0, GPIO_ID_PIN(pin->num));
 
-    // Set GPIO register
-    gpio_register_set(GPIO_PIN_ADDR(SELECTION_SIGNAL_IO_NUM),
-                      GPIO_PIN_INT_TYPE_SET(GPIO_PIN_INTR_DISABLE)  |
-                      GPIO_PIN_PAD_DRIVER_SET(GPIO_PAD_DRIVER_DISABLE) |
-                      GPIO_PIN_SOURCE_SET(GPIO_AS_PIN_SOURCE));
+        // Set GPIO register
+        gpio_register_set(GPIO_PIN_ADDR(pin->num),
+                          GPIO_PIN_INT_TYPE_SET(GPIO_PIN_INTR_DISABLE)  |
+                          GPIO_PIN_PAD_DRIVER_SET(GPIO_PAD_DRIVER_DISABLE) |
+                          GPIO_PIN_SOURCE_SET(GPIO_AS_PIN_SOURCE));
+    }
+
+    // Attach the interrupt handler, which dispatches edges for all the inputs
+    ETS_GPIO_INTR_ATTACH(wp_pulse_gpio_intr_handler, /*arg*/NULL);
 
     // Clear GPIO status
-    GPIO_REG_WRITE(GPIO_STATUS_W1TC_ADDRESS, BIT(SELECTION_SIGNAL_IO_NUM));
+    GPIO_REG_WRITE(GPIO_STATUS_W1TC_ADDRESS, wb_input_mask);
 
     // Enable interrupt on any edge transition
-    gpio_pin_intr_state_set(
-        GPIO_ID_PIN(SELECTION_SIGNAL_IO_NUM),
-        GPIO_PIN_INTR_ANYEDGE);
+    for (i = 0; i < wb_input_count; i++) {
+        gpio_pin_intr_state_set(
+            GPIO_ID_PIN(wb_input_pins[i].num),
+            GPIO_PIN_INTR_ANYEDGE);
+    }
 
     // Enable interrupts by GPIO
     ETS_GPIO_INTR_ENABLE();
+
+    os_printf("Wallbox inputs: %d\n", wb_input_count);
 }
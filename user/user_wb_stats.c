@@ -0,0 +1,163 @@
+#include "user_wb_stats.h"
+
+#include <ets_sys.h>
+#include <osapi.h>
+#include <os_type.h>
+#include <user_interface.h>
+#include <stddef.h>
+
+#include "user_wb_selection.h"
+#include "user_wb_calibrate.h"
+
+/* Bit position of WB_STATS_BIN_MIN */
+#define STATS_BIN_SHIFT 7
+
+typedef struct wb_stats_histogram_def {
+    const char *name;
+    uint32 offset; // of the histogram within wb_stats
+} wb_stats_histogram_def;
+
+LOCAL const wb_stats_histogram_def stats_histograms[] = {
+    {"pulse", offsetof(wb_stats, pulse)},
+    {"gap", offsetof(wb_stats, gap)},
+    {"delimiter_gap", offsetof(wb_stats, delimiter_gap)},
+    {"spike", offsetof(wb_stats, spike)}
+};
+
+#define STATS_HISTOGRAMS (int)(sizeof(stats_histograms) / sizeof(stats_histograms[0]))
+
+LOCAL void ICACHE_FLASH_ATTR stats_bin_add(uint32 *histogram, uint32 width);
+LOCAL uint32 ICACHE_FLASH_ATTR stats_bin_lower(int bin);
+
+LOCAL wb_stats stats[WB_INPUTS];
+
+void ICACHE_FLASH_ATTR user_wb_stats_reset(int input)
+{
+    os_bzero(&stats[input], sizeof(wb_stats));
+}
+
+void ICACHE_FLASH_ATTR user_wb_stats_count(int input, wb_stats_counter counter, uint32 count)
+{
+    stats[input].counters[counter] += count;
+}
+
+/*
+ * Record a pulse once it can no longer be merged with the next one,
+ * along with the gap that came before it. The tallies from before and
+ * after the pulse tell which kind of gap that was.
+ */
+void ICACHE_FLASH_ATTR user_wb_stats_pulse(int input, const wb_selection_pulse *pulse,
+    const wb_selection_tally *before, const wb_selection_tally *after)
+{
+    wb_stats *input_stats = &stats[input];
+
+    stats_bin_add(input_stats->pulse, pulse->duration);
+
+    if (before->p1 == 0) {
+        // The gap before the first pulse is just idle time
+        return;
+    }
+
+    // Classified as calibration does, so the two agree on which
+    // gaps are within a pulse train and which are between them.
+    if (!before->delimiter && after->delimiter) {
+        // Ahead of the second train, or of an uncounted delimiter pulse
+        stats_bin_add(input_stats->delimiter_gap, pulse->elapsed);
+    } else if ((!after->delimiter && before->p1 > 0) || (after->delimiter && before->p2 > 0)) {
+        stats_bin_add(input_stats->gap, pulse->elapsed);
+    }
+    // Otherwise the gap followed an uncounted delimiter pulse,
+    // and is part of neither train.
+}
+
+void ICACHE_FLASH_ATTR user_wb_stats_spike(int input, uint32 width)
+{
+    stats[input].counters[WB_STATS_SPIKE]++;
+    stats_bin_add(stats[input].spike, width);
+}
+
+/*
+ * Take a copy of the statistics, along with the thresholds
+ * they are to be compared against.
+ */
+void ICACHE_FLASH_ATTR user_wb_stats_get(int input, wb_stats *copy)
+{
+    *copy = stats[input];
+    copy->input = input;
+    copy->wallbox_type = user_wb_get_wallbox_type(input);
+    user_wb_calibrate_get_timing(input, copy->wallbox_type, &copy->timing);
+}
+
+/*
+ * Write part of the statistics as JSON, so the whole report does not
+ * have to fit in one buffer. Returns the length written, or 0 once
+ * all the parts have been written.
+ */
+int ICACHE_FLASH_ATTR user_wb_stats_json(const wb_stats *copy, int part, char *buf, int buf_len)
+{
+    const wb_protocol *protocol = wb_protocol_get(copy->wallbox_type);
+    const uint32 *histogram;
+    int n = 0;
+    int i;
+
+    if (part == 0) {
+        n += os_sprintf(buf + n,
+            "{\"input\": %d, \"wallbox\": \"%s\", \"selections\": %d, "
+            "\"errors\": {\"gap\": %d, \"pulse\": %d, \"max\": %d, \"decode\": %d}, "
+            "\"noise\": {\"spikes\": %d, \"bounces\": %d}, \"overflow\": %d, "
+            "\"timing\": {\"delimiter_gap\": %d, \"delimiter_pulse\": %d, \"debounce_gap\": %d, "
+            "\"min_pulse\": %d, \"commit_timeout\": %d}, \"bins_us\": [",
+            copy->input + 1, protocol ? protocol->name : "UNKNOWN_WALLBOX",
+            copy->counters[WB_STATS_SELECTION],
+            copy->counters[WB_STATS_ERROR_GAP], copy->counters[WB_STATS_ERROR_PULSE],
+            copy->counters[WB_STATS_ERROR_MAX], copy->counters[WB_STATS_ERROR_DECODE],
+            copy->counters[WB_STATS_SPIKE], copy->counters[WB_STATS_BOUNCE],
+            copy->counters[WB_STATS_OVERFLOW],
+            copy->timing.delimiter_gap, copy->timing.delimiter_pulse,
+            copy->timing.debounce_gap, copy->timing.min_pulse, copy->timing.commit_timeout);
+        for (i = 0; i < WB_STATS_BINS && buf_len - n > 16; i++) {
+            n += os_sprintf(buf + n, "%s%d", (i > 0) ? ", " : "", stats_bin_lower(i));
+        }
+        n += os_sprintf(buf + n, "]");
+        return n;
+    }
+
+    if (part > STATS_HISTOGRAMS) {
+        return 0;
+    }
+
+    histogram = (const uint32 *)((const uint8 *)copy + stats_histograms[part - 1].offset);
+    n += os_sprintf(buf + n, ", \"%s\": [", stats_histograms[part - 1].name);
+    for (i = 0; i < WB_STATS_BINS && buf_len - n > 16; i++) {
+        n += os_sprintf(buf + n, "%s%d", (i > 0) ? ", " : "", histogram[i]);
+    }
+    n += os_sprintf(buf + n, (part == STATS_HISTOGRAMS) ? "]}" : "]");
+    return n;
+}
+
+LOCAL void ICACHE_FLASH_ATTR stats_bin_add(uint32 *histogram, uint32 width)
+{
+    int bin = 0;
+
+    if (width >= WB_STATS_BIN_MIN) {
+        int octave = 31 - __builtin_clz(width);
+        int half = (width >> (octave - 1)) & 1;
+        bin = 1 + ((octave - STATS_BIN_SHIFT) * 2) + half;
+        if (bin >= WB_STATS_BINS) {
+            bin = WB_STATS_BINS - 1;
+        }
+    }
+    histogram[bin]++;
+}
+
+/*
+ * Smallest width that falls into the bin, in microseconds.
+ */
+LOCAL uint32 ICACHE_FLASH_ATTR stats_bin_lower(int bin)
+{
+    if (bin == 0) {
+        return 0;
+    }
+    int octave = STATS_BIN_SHIFT + ((bin - 1) / 2);
+    return (1 << octave) + (((bin - 1) & 1) << (octave - 1));
+}
@@ -0,0 +1,320 @@
+#include "user_wb_trace.h"
+
+#include <ets_sys.h>
+#include <osapi.h>
+#include <os_type.h>
+#include <mem.h>
+#include <user_interface.h>
+#include <spi_flash.h>
+
+#include "user_wb_protocol.h"
+
+/*
+ * Reserved flash region for the trace ring, past the end of the
+ * second firmware image on a 4MB (512KB+512KB) flash layout.
+ */
+#define TRACE_START_SEC   0x100
+#define TRACE_SECTORS     4
+#define TRACE_SLOTS_PER_SEC (SPI_FLASH_SEC_SIZE / WB_TRACE_SLOT_SIZE)
+#define TRACE_SLOTS       (TRACE_SECTORS * TRACE_SLOTS_PER_SEC)
+
+#define TRACE_MAGIC 0x52544257 // "WBTR"
+
+#define TRACE_DATA_MAX (WB_TRACE_SLOT_SIZE - sizeof(wb_trace_header))
+
+/* Completed records waiting to be written to flash */
+#define TRACE_PENDING_MAX 2
+
+/* Delay before writing completed records, in milliseconds */
+#define TRACE_WRITE_DELAY 100
+
+typedef struct wb_trace_record {
+    wb_trace_header header;
+    uint8 data[TRACE_DATA_MAX];
+} wb_trace_record;
+
+LOCAL void ICACHE_FLASH_ATTR trace_write_timer_func(void *arg);
+LOCAL uint32 ICACHE_FLASH_ATTR trace_slot_addr(int slot);
+LOCAL bool ICACHE_FLASH_ATTR trace_reader_load(wb_trace_reader *reader);
+
+LOCAL bool trace_enabled;
+LOCAL wb_trace_record trace_current[WB_INPUTS];
+LOCAL uint32 trace_last_time[WB_INPUTS];
+LOCAL wb_trace_record trace_pending[TRACE_PENDING_MAX];
+LOCAL int trace_pending_count;
+LOCAL uint32 trace_dropped;
+LOCAL int trace_next_slot;
+LOCAL uint32 trace_sequence;
+LOCAL os_timer_t trace_write_timer;
+
+void ICACHE_FLASH_ATTR user_wb_trace_init(void)
+{
+    wb_trace_header header;
+    int newest = -1;
+    int i;
+
+    os_bzero(trace_current, sizeof(trace_current));
+    os_bzero(&trace_write_timer, sizeof(trace_write_timer));
+    trace_pending_count = 0;
+    trace_dropped = 0;
+    trace_next_slot = 0;
+    trace_sequence = 1;
+
+    // The region is only known to be free on the 4MB flash layout
+    trace_enabled = (system_get_flash_size_map() == FLASH_SIZE_32M_MAP_512_512);
+    if (!trace_enabled) {
+        os_printf("Trace recorder disabled for this flash layout\n");
+        return;
+    }
+
+    // Continue the ring after the newest record
+    for (i = 0; i < TRACE_SLOTS; i++) {
+        if (spi_flash_read(trace_slot_addr(i), (uint32 *)&header, sizeof(header)) != SPI_FLASH_RESULT_OK) {
+            continue;
+        }
+        if (header.magic == TRACE_MAGIC && header.sequence >= trace_sequence) {
+            trace_sequence = header.sequence + 1;
+            newest = i;
+        }
+    }
+    if (newest >= 0) {
+        trace_next_slot = (newest + 1) % TRACE_SLOTS;
+    }
+
+    os_printf("Trace recorder at slot %d, sequence %d\n", trace_next_slot, trace_sequence);
+}
+
+/*
+ * Record an edge of the selection attempt in progress.
+ */
+void ICACHE_FLASH_ATTR user_wb_trace_edge(int input, int value, uint32 time)
+{
+    wb_trace_record *record = &trace_current[input];
+    wb_trace_header *header = &record->header;
+
+    if (!trace_enabled || (header->flags & WB_TRACE_FLAG_TRUNCATED)) {
+        return;
+    }
+
+    if (header->edge_count == 0) {
+        header->start_time = time;
+        header->flags = input << WB_TRACE_FLAG_INPUT_SHIFT;
+        trace_last_time[input] = time;
+    }
+
+    uint32 code = ((time - trace_last_time[input]) << 1) | (value ? 1 : 0);
+    uint8 encoded[5];
+    int len = 0;
+    do {
+        encoded[len] = code & 0x7F;
+        code >>= 7;
+        if (code) {
+            encoded[len] |= 0x80;
+        }
+        len++;
+    } while (code);
+
+    if (header->data_len + len > TRACE_DATA_MAX) {
+        header->flags |= WB_TRACE_FLAG_TRUNCATED;
+        return;
+    }
+
+    os_memcpy(record->data + header->data_len, encoded, len);
+    header->data_len += len;
+    header->edge_count++;
+    trace_last_time[input] = time;
+}
+
+/*
+ * Finish the selection attempt in progress, and queue it
+ * to be written to flash in the background.
+ */
+void ICACHE_FLASH_ATTR user_wb_trace_commit(int input, wallbox_type wb_type, wb_trace_result result, char letter, int number,
+    uint32 spikes, uint32 bounces)
+{
+    wb_trace_record *record = &trace_current[input];
+    wb_trace_header *header = &record->header;
+
+    if (!trace_enabled || header->edge_count == 0) {
+        return;
+    }
+
+    if (trace_pending_count < TRACE_PENDING_MAX) {
+        header->magic = TRACE_MAGIC;
+        header->wallbox_type = (uint8)wb_type;
+        header->result = (uint8)result;
+        header->letter = (result == WB_TRACE_SONG) ? letter : 0;
+        header->number = (result == WB_TRACE_SONG) ? (uint8)number : 0;
+        header->spikes = (spikes < 0xFF) ? spikes : 0xFF;
+        header->bounces = (bounces < 0xFFFF) ? bounces : 0xFFFF;
+        os_memcpy(&trace_pending[trace_pending_count++], record, sizeof(wb_trace_record));
+
+        os_timer_disarm(&trace_write_timer);
+        os_timer_setfn(&trace_write_timer, (os_timer_func_t *)trace_write_timer_func, NULL);
+        os_timer_arm(&trace_write_timer, TRACE_WRITE_DELAY, 0);
+    } else {
+        trace_dropped++;
+    }
+
+    os_bzero(record, sizeof(wb_trace_record));
+}
+
+/*
+ * Drop the edges recorded since the last commit, when they turned out
+ * to be noise rather than the start of a selection attempt.
+ */
+void ICACHE_FLASH_ATTR user_wb_trace_discard(int input)
+{
+    os_bzero(&trace_current[input], sizeof(wb_trace_record));
+}
+
+LOCAL void ICACHE_FLASH_ATTR trace_write_timer_func(void *arg)
+{
+    int i;
+
+    for (i = 0; i < trace_pending_count; i++) {
+        wb_trace_record *record = &trace_pending[i];
+        int slot = trace_next_slot;
+
+        // Entering a sector reclaims the oldest records
+        if ((slot % TRACE_SLOTS_PER_SEC) == 0) {
+            if (spi_flash_erase_sector(TRACE_START_SEC + (slot / TRACE_SLOTS_PER_SEC)) != SPI_FLASH_RESULT_OK) {
+                os_printf("Trace sector erase error\n");
+                break;
+            }
+        }
+
+        record->header.sequence = trace_sequence;
+        uint32 len = (sizeof(wb_trace_header) + record->header.data_len + 3) & ~3;
+        if (spi_flash_write(trace_slot_addr(slot), (uint32 *)record, len) != SPI_FLASH_RESULT_OK) {
+            os_printf("Trace write error\n");
+        }
+
+        trace_sequence++;
+        trace_next_slot = (slot + 1) % TRACE_SLOTS;
+    }
+    trace_pending_count = 0;
+
+    if (trace_dropped > 0) {
+        os_printf("Trace records dropped: %d\n", trace_dropped);
+        trace_dropped = 0;
+    }
+}
+
+LOCAL uint32 ICACHE_FLASH_ATTR trace_slot_addr(int slot)
+{
+    return (TRACE_START_SEC * SPI_FLASH_SEC_SIZE) + (slot * WB_TRACE_SLOT_SIZE);
+}
+
+void ICACHE_FLASH_ATTR user_wb_trace_reader_init(wb_trace_reader *reader)
+{
+    os_bzero(reader, sizeof(wb_trace_reader));
+
+    // The next slot to be written holds the oldest record
+    reader->slot = trace_next_slot;
+    reader->slots_left = trace_enabled ? TRACE_SLOTS : 0;
+}
+
+/*
+ * Load the next valid record into the reader.
+ * Returns false once all the slots have been visited.
+ */
+LOCAL bool ICACHE_FLASH_ATTR trace_reader_load(wb_trace_reader *reader)
+{
+    wb_trace_header *header = (wb_trace_header *)reader->record;
+
+    while (!reader->loaded && reader->slots_left > 0) {
+        int slot = reader->slot;
+        reader->slot = (slot + 1) % TRACE_SLOTS;
+        reader->slots_left--;
+
+        if (spi_flash_read(trace_slot_addr(slot), reader->record, WB_TRACE_SLOT_SIZE) != SPI_FLASH_RESULT_OK) {
+            continue;
+        }
+        if (header->magic != TRACE_MAGIC || header->data_len > TRACE_DATA_MAX) {
+            continue;
+        }
+
+        reader->loaded = true;
+        reader->offset = -1;
+        reader->edges_left = header->edge_count;
+        reader->time = header->start_time;
+    }
+
+    return reader->loaded;
+}
+
+/*
+ * Read out the recorded traces as CSV, in the format accepted by the
+ * trace replay endpoint. Returns the length written, or 0 when done.
+ */
+int ICACHE_FLASH_ATTR user_wb_trace_read_csv(wb_trace_reader *reader, char *buf, int buf_len)
+{
+    wb_trace_header *header = (wb_trace_header *)reader->record;
+    const uint8 *data = (const uint8 *)reader->record + sizeof(wb_trace_header);
+    int n = 0;
+
+    while (buf_len - n > 64 && trace_reader_load(reader)) {
+        if (reader->offset < 0) {
+            const wb_protocol *protocol = wb_protocol_get((wallbox_type)header->wallbox_type);
+            n += os_sprintf(buf + n, "# attempt %d, input %d, %s, ",
+                header->sequence, WB_TRACE_INPUT(header->flags) + 1,
+                protocol ? protocol->name : "UNKNOWN_WALLBOX");
+            if (header->result == WB_TRACE_SONG) {
+                n += os_sprintf(buf + n, "%c%d", header->letter, header->number);
+            } else {
+                n += os_sprintf(buf + n, "error");
+            }
+            n += os_sprintf(buf + n, ", %d spikes, %d bounces%s\n",
+                header->spikes, header->bounces,
+                (header->flags & WB_TRACE_FLAG_TRUNCATED) ? ", truncated" : "");
+            reader->offset = 0;
+            continue;
+        }
+
+        if (reader->edges_left == 0 || reader->offset >= header->data_len) {
+            n += os_sprintf(buf + n, "\n");
+            reader->loaded = false;
+            continue;
+        }
+
+        uint32 code = 0;
+        int shift = 0;
+        while (reader->offset < header->data_len && shift < 32) {
+            uint8 b = data[reader->offset++];
+            code |= (uint32)(b & 0x7F) << shift;
+            shift += 7;
+            if (!(b & 0x80)) {
+                break;
+            }
+        }
+        reader->time += code >> 1;
+        reader->edges_left--;
+        n += os_sprintf(buf + n, "%u,%d\n", reader->time, code & 1);
+    }
+
+    return n;
+}
+
+/*
+ * Read out the recorded traces as their raw records, each being the
+ * header followed by the edge data. Returns the length written,
+ * or 0 when done.
+ */
+int ICACHE_FLASH_ATTR user_wb_trace_read_bin(wb_trace_reader *reader, char *buf, int buf_len)
+{
+    wb_trace_header *header = (wb_trace_header *)reader->record;
+    int n = 0;
+
+    while (trace_reader_load(reader)) {
+        int len = sizeof(wb_trace_header) + header->data_len;
+        if (buf_len - n < len) {
+            break;
+        }
+        os_memcpy(buf + n, reader->record, len);
+        n += len;
+        reader->loaded = false;
+    }
+
+    return n;
+}
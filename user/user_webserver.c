@@ -20,33 +20,75 @@
 
 #include "user_config.h"
 #include "user_wb_credit.h"
+#include "user_wb_ledger.h"
 #include "user_wb_selection.h"
+#include "user_wb_protocol.h"
+#include "user_wb_replay.h"
+#include "user_wb_trace.h"
+#include "user_wb_stats.h"
 #include "user_sonos_discovery.h"
 #include "user_sonos_client.h"
+#include "user_sonos_request.h"
+#include "user_pool.h"
 #include "user_util.h"
 
 typedef struct wb_song_list_data {
+    int input;
     int track_pos;
 } wb_song_list_data;
 
+typedef struct wb_trace_data {
+    bool binary;
+    wb_trace_reader reader;
+} wb_trace_data;
+
+typedef struct wb_stats_data {
+    int part;
+    wb_stats stats;
+} wb_stats_data;
+
+typedef struct sonos_stats_data {
+    int part;
+    bool reset;
+} sonos_stats_data;
+
+typedef struct wb_ledger_data {
+    int part;
+} wb_ledger_data;
+
 typedef struct wb_song_select_data {
+    int input;
     wallbox_type wallbox;
+    bool detect_save;
+    int min_pulse;
+    int credit_gap;
     char uri_base[256];
     char track_file[200][16];
     char *buf;
     int buf_len;
 } wb_song_select_data;
 
+LOCAL int ICACHE_FLASH_ATTR webserver_input_arg(char *args);
+LOCAL CgiStatus ICACHE_FLASH_ATTR tpl_input_links(HttpdConnData *connData, const char *page, int input);
 LOCAL CgiStatus ICACHE_FLASH_ATTR tpl_index(HttpdConnData *connData, char *token, void **arg);
 LOCAL CgiStatus ICACHE_FLASH_ATTR tpl_about(HttpdConnData *connData, char *token, void **arg);
 LOCAL CgiStatus ICACHE_FLASH_ATTR tpl_sonos(HttpdConnData *connData, char *token, void **arg);
 LOCAL CgiStatus ICACHE_FLASH_ATTR tpl_wallbox(HttpdConnData *connData, char *token, void **arg);
+LOCAL int ICACHE_FLASH_ATTR credit_status_json(int id, char *buf);
+LOCAL int ICACHE_FLASH_ATTR credit_pulses_json(char *buf, int buf_len);
 LOCAL CgiStatus ICACHE_FLASH_ATTR cgi_credit(HttpdConnData *data);
 LOCAL CgiStatus ICACHE_FLASH_ATTR cgi_sonos(HttpdConnData *data);
 LOCAL CgiStatus ICACHE_FLASH_ATTR cgi_sonos_zone_list(HttpdConnData *data);
+LOCAL CgiStatus ICACHE_FLASH_ATTR cgi_sonos_paths(HttpdConnData *data);
+LOCAL CgiStatus ICACHE_FLASH_ATTR cgi_sonos_stats(HttpdConnData *data);
+LOCAL CgiStatus ICACHE_FLASH_ATTR cgi_pools(HttpdConnData *data);
 LOCAL CgiStatus ICACHE_FLASH_ATTR cgi_sonos_zone_select(HttpdConnData *data);
 LOCAL CgiStatus ICACHE_FLASH_ATTR cgi_wb_song_list(HttpdConnData *data);
 LOCAL CgiStatus ICACHE_FLASH_ATTR cgi_wb_song_select(HttpdConnData *data);
+LOCAL CgiStatus ICACHE_FLASH_ATTR cgi_wb_replay(HttpdConnData *data);
+LOCAL CgiStatus ICACHE_FLASH_ATTR cgi_wb_trace(HttpdConnData *data);
+LOCAL CgiStatus ICACHE_FLASH_ATTR cgi_wb_stats(HttpdConnData *data);
+LOCAL CgiStatus ICACHE_FLASH_ATTR cgi_wb_ledger(HttpdConnData *data);
 
 LOCAL const CgiUploadFlashDef FLASH_UPLOAD_PARAMS = {
     .type=CGIFLASH_TYPE_FW,
@@ -89,10 +131,17 @@ LOCAL const HttpdBuiltInUrl FIXED_URL_MAP[] = {
     {"/wallbox.tpl", cgiEspFsTemplate, tpl_wallbox},
     {"/zonelist.cgi", cgi_sonos_zone_list, NULL},
     {"/zoneselect.cgi", cgi_sonos_zone_select, NULL},
+    {"/sonospaths.cgi", cgi_sonos_paths, NULL},
+    {"/sonosstats.cgi", cgi_sonos_stats, NULL},
+    {"/pools.cgi", cgi_pools, NULL},
     {"/songlist.cgi", cgi_wb_song_list, NULL},
     {"/songselect.cgi", cgi_wb_song_select, NULL},
+    {"/trace.cgi", cgi_wb_trace, NULL},
+    {"/stats.cgi", cgi_wb_stats, NULL},
+    {"/ledger.cgi", cgi_wb_ledger, NULL},
     {"/control/credit", cgi_credit, NULL},
     {"/control/sonos", cgi_sonos, NULL},
+    {"/control/replay", cgi_wb_replay, NULL},
     {"/control/flash_next", cgiGetFirmwareNext, &FLASH_UPLOAD_PARAMS},
     {"/control/flash_upload", cgiUploadFirmware, &FLASH_UPLOAD_PARAMS},
     {"/control/flash_reboot", cgiRebootFirmware, NULL},
@@ -114,6 +163,52 @@ void ICACHE_FLASH_ATTR user_webserver_init(uint32 port, bool config_mode)
         port, HTTPD_FLAG_NONE);
 }
 
+/*
+ * Wallbox input selected by the "input" argument, numbered from 1,
+ * falling back to the first input when missing or out of range.
+ */
+LOCAL int ICACHE_FLASH_ATTR webserver_input_arg(char *args)
+{
+    char buf[8];
+    int input;
+
+    if (!args || httpdFindArg(args, "input", buf, sizeof(buf)) <= 0) {
+        return 0;
+    }
+
+    input = strtol(buf, NULL, 10) - 1;
+    if (input < 0 || input >= user_config_get_input_count()) {
+        return 0;
+    }
+    return input;
+}
+
+/*
+ * Links to the same page for each of the other inputs,
+ * only shown when there is more than one.
+ */
+LOCAL CgiStatus ICACHE_FLASH_ATTR tpl_input_links(HttpdConnData *connData, const char *page, int input)
+{
+    char buf[64];
+    int count = user_config_get_input_count();
+    int i;
+
+    if (count < 2) {
+        return HTTPD_CGI_DONE;
+    }
+
+    for (i = 0; i < count; i++) {
+        if (i == input) {
+            os_sprintf(buf, "%s<b>Input %d</b>", (i > 0) ? " | " : "", i + 1);
+        } else {
+            os_sprintf(buf, "%s<a href=\"/%s?input=%d\">Input %d</a>",
+                (i > 0) ? " | " : "", page, i + 1, i + 1);
+        }
+        httpdSend(connData, buf, -1);
+    }
+    return HTTPD_CGI_DONE;
+}
+
 LOCAL CgiStatus ICACHE_FLASH_ATTR tpl_index(HttpdConnData *connData, char *token, void **arg)
 {
     char buf[128];
@@ -122,27 +217,50 @@ LOCAL CgiStatus ICACHE_FLASH_ATTR tpl_index(HttpdConnData *connData, char *token
     os_bzero(buf, sizeof(buf));
 
     if (os_strcmp(token, "WallboxType") == 0) {
-        switch(user_config_get_wallbox_type()) {
-        case SEEBURG_3W1_100:
-            os_strcpy(buf, "Seeburg Wall-O-Matic \"100\"");
-            break;
-        case SEEBURG_V3WA_200:
-            os_strcpy(buf, "Seeburg Wall-O-Matic \"200\"");
-            break;
-        case UNKNOWN_WALLBOX:
-        default:
-            os_strcpy(buf, "<i>Wallbox Not Configured</i>");
-            break;
+        // One line per input, when there is more than one
+        int count = user_config_get_input_count();
+        int i;
+        for (i = 0; i < count; i++) {
+            const wb_protocol *protocol = wb_protocol_get(user_config_get_wallbox_type(i));
+            const wb_protocol *detected = wb_protocol_get(user_wb_get_wallbox_type(i));
+            int n = 0;
+            if (count > 1) {
+                n += os_sprintf(buf + n, "%sInput %d: ", (i > 0) ? "<br/>" : "", i + 1);
+            }
+            if (protocol) {
+                os_sprintf(buf + n, "%s", protocol->description);
+            }
+            else if (detected) {
+                os_sprintf(buf + n, "%s <i>(Detected)</i>", detected->description);
+            }
+            else {
+                os_strcpy(buf + n, "<i>Detecting Wallbox Type</i>");
+            }
+            httpdSend(connData, buf, -1);
         }
+        return HTTPD_CGI_DONE;
     }
     else if (os_strcmp(token, "SonosZone") == 0) {
-        sonos_device device;
-        if (user_sonos_client_get_device(&device)) {
-            os_sprintf(buf, "%s", device.zone_name);
-        }
-        else {
-            os_sprintf(buf, "<i>Sonos Zone Not Configured</i>");
+        int count = user_config_get_input_count();
+        int i;
+        for (i = 0; i < count; i++) {
+            sonos_device device;
+            int n = 0;
+            if (count > 1) {
+                n += os_sprintf(buf + n, "%sInput %d: ", (i > 0) ? "<br/>" : "", i + 1);
+            }
+            if (user_sonos_client_get_device(i, &device)) {
+                os_sprintf(buf + n, "%s", device.zone_name);
+            }
+            else if (i > 0 && user_sonos_client_get_device(0, &device)) {
+                os_sprintf(buf + n, "%s <i>(Input 1)</i>", device.zone_name);
+            }
+            else {
+                os_sprintf(buf + n, "<i>Sonos Zone Not Configured</i>");
+            }
+            httpdSend(connData, buf, -1);
         }
+        return HTTPD_CGI_DONE;
     }
 
     httpdSend(connData, buf, -1);
@@ -234,9 +352,11 @@ LOCAL CgiStatus ICACHE_FLASH_ATTR tpl_sonos(HttpdConnData *connData, char *token
     char buf[128];
     if (!token) return HTTPD_CGI_DONE;
 
+    int input = webserver_input_arg(connData->getArgs);
+
     if (os_strcmp(token, "ZoneName") == 0) {
         sonos_device device;
-        if (user_sonos_client_get_device(&device)) {
+        if (user_sonos_client_get_device(input, &device)) {
             os_sprintf(buf, "%s", device.zone_name);
         }
         else {
@@ -245,13 +365,19 @@ LOCAL CgiStatus ICACHE_FLASH_ATTR tpl_sonos(HttpdConnData *connData, char *token
     }
     else if (os_strcmp(token, "ZoneUUID") == 0) {
         sonos_device device;
-        if (user_sonos_client_get_device(&device)) {
+        if (user_sonos_client_get_device(input, &device)) {
             os_sprintf(buf, "%s", device.uuid);
         }
         else {
             buf[0]='\0';
         }
     }
+    else if (os_strcmp(token, "Input") == 0) {
+        os_sprintf(buf, "%d", input + 1);
+    }
+    else if (os_strcmp(token, "InputLinks") == 0) {
+        return tpl_input_links(connData, "sonos.tpl", input);
+    }
 
     httpdSend(connData, buf, -1);
     return HTTPD_CGI_DONE;
@@ -264,64 +390,187 @@ LOCAL CgiStatus ICACHE_FLASH_ATTR tpl_wallbox(HttpdConnData *connData, char *tok
 
     os_bzero(buf, sizeof(buf));
 
+    int input = webserver_input_arg(connData->getArgs);
+
     if (os_strcmp(token, "Wallbox") == 0) {
-        switch(user_config_get_wallbox_type()) {
-        case SEEBURG_3W1_100:
-            os_strcpy(buf, "SEEBURG_3W1_100");
-            break;
-        case SEEBURG_V3WA_200:
-            os_strcpy(buf, "SEEBURG_V3WA_200");
-            break;
-        case UNKNOWN_WALLBOX:
-        default:
+        const wb_protocol *protocol = wb_protocol_get(user_config_get_wallbox_type(input));
+        if (protocol) {
+            os_strcpy(buf, protocol->name);
+        }
+        else {
             os_strcpy(buf, "UNKNOWN_WALLBOX");
-            break;
+        }
+    }
+    else if (os_strcmp(token, "WallboxOptions") == 0) {
+        // The song sheet is laid out either with two letters per page,
+        // or with one number per page, and only has the letters in use.
+        int i;
+        for (i = UNKNOWN_WALLBOX + 1; i < MAX_WALLBOX_TYPES; i++) {
+            const wb_protocol *protocol = wb_protocol_get((wallbox_type)i);
+            bool number_letter = (protocol->layout == LAYOUT_NUMBER_LETTER);
+            os_sprintf(buf,
+                "<option value=\"%s\" data-pages=\"%d\" data-layout=\"%d\" data-letters=\"%d\">%s</option>\n",
+                protocol->name,
+                number_letter ? ((protocol->letter_count + 1) / 2) : 10,
+                number_letter ? 1 : 2,
+                protocol->letter_count,
+                protocol->description);
+            httpdSend(connData, buf, -1);
+        }
+        return HTTPD_CGI_DONE;
+    }
+    else if (os_strcmp(token, "WallboxMinPulse") == 0) {
+        os_sprintf(buf, "%d", user_config_get_wallbox_min_pulse());
+    }
+    else if (os_strcmp(token, "CreditGap") == 0) {
+        os_sprintf(buf, "%d", user_config_get_credit_gap());
+    }
+    else if (os_strcmp(token, "WallboxDetectSave") == 0) {
+        if (user_config_get_wallbox_detect_save()) {
+            os_strcpy(buf, "checked");
         }
     }
     else if (os_strcmp(token, "UriBase") == 0) {
         const char *uri_base = user_config_get_sonos_uri_base();
         os_strcpy(buf, uri_base);
     }
+    else if (os_strcmp(token, "Input") == 0) {
+        os_sprintf(buf, "%d", input + 1);
+    }
+    else if (os_strcmp(token, "InputLinks") == 0) {
+        return tpl_input_links(connData, "wallbox.tpl", input);
+    }
 
     httpdSend(connData, buf, -1);
     return HTTPD_CGI_DONE;
 }
 
+/*
+ * Progress of a coin request, as JSON.
+ */
+LOCAL int ICACHE_FLASH_ATTR credit_status_json(int id, char *buf)
+{
+    LOCAL const char *CREDIT_STATES[] = {"unknown", "queued", "active", "done"};
+    wb_credit_status status;
+
+    user_wb_credit_status(id, &status);
+
+    return os_sprintf(buf, "{\"id\": %d, \"state\": \"%s\", \"sent\": %d, \"count\": %d, "
+        "\"width_us\": {\"target\": %d, \"min\": %d, \"max\": %d}}",
+        id, CREDIT_STATES[status.state], status.sent, status.count,
+        status.width_target, status.width_min, status.width_max);
+}
+
+/*
+ * Measured widths of the most recent coin pulses, as JSON.
+ */
+LOCAL int ICACHE_FLASH_ATTR credit_pulses_json(char *buf, int buf_len)
+{
+    wb_credit_pulse pulses[CREDIT_PULSE_LOG];
+    int count = user_wb_credit_pulses(pulses, CREDIT_PULSE_LOG);
+    int n = 0;
+    int i;
+
+    n += os_sprintf(buf + n, "{\"pulses\": [");
+    for (i = 0; i < count && buf_len - n > 80; i++) {
+        n += os_sprintf(buf + n, "%s{\"id\": %d, \"coin\": %d, \"target_us\": %d, \"width_us\": %d}",
+            (i > 0) ? ", " : "", pulses[i].id, pulses[i].coin_type,
+            pulses[i].width_target, pulses[i].width);
+    }
+    n += os_sprintf(buf + n, "]}");
+    return n;
+}
+
 LOCAL CgiStatus ICACHE_FLASH_ATTR cgi_credit(HttpdConnData *data)
 {
     int credit_result = -1;
+    int count = 1;
     int len;
-    char buf[128];
+    char buf[192];
     
     if (!data->conn) {
         return HTTPD_CGI_DONE;
     }
 
+    // http://<ip>/control/credit?id=<request>
+    len = httpdFindArg(data->getArgs, "id", buf, sizeof(buf));
+    if (len > 0) {
+        len = credit_status_json(strtol(buf, NULL, 10), buf);
+        httpdStartResponse(data, 200);
+        httpdHeader(data, "Content-Type", "text/json");
+        httpdEndHeaders(data);
+        httpdSend(data, buf, len);
+        return HTTPD_CGI_DONE;
+    }
+
+    // http://<ip>/control/credit?pulses=1
+    len = httpdFindArg(data->getArgs, "pulses", buf, sizeof(buf));
+    if (len > 0 && os_strcmp(buf, "1") == 0) {
+        char *json = (char *)os_malloc(1536);
+        if (!json) {
+            httpdStartResponse(data, 500);
+            httpdEndHeaders(data);
+            return HTTPD_CGI_DONE;
+        }
+        len = credit_pulses_json(json, 1536);
+        httpdStartResponse(data, 200);
+        httpdHeader(data, "Content-Type", "text/json");
+        httpdEndHeaders(data);
+        httpdSend(data, json, len);
+        os_free(json);
+        return HTTPD_CGI_DONE;
+    }
+
     // Accept arguments via the URL or the POST data
+    len = httpdFindArg(data->getArgs, "count", buf, sizeof(buf));
+    if (len < 0) {
+        len = httpdFindArg(data->post->buff, "count", buf, sizeof(buf));
+    }
+    if (len > 0) {
+        count = strtol(buf, NULL, 10);
+    }
+
     len = httpdFindArg(data->getArgs, "coin", buf, sizeof(buf));
     if (len < 0) {
         len = httpdFindArg(data->post->buff, "coin", buf, sizeof(buf));
     }
     
-    // http://<ip>/control/credit?coin=<value>
+    // http://<ip>/control/credit?coin=<value>&count=<coins>
     if (len > 0) {
         if (os_strcmp(buf, "5") == 0) {
-            os_printf("Inserted nickel\n");
-            credit_result = user_wb_credit_drop(NICKEL);
+            os_printf("Inserted nickel x%d\n", count);
+            credit_result = user_wb_credit_queue(NICKEL, count);
         } else if (os_strcmp(buf, "10") == 0) {
-            os_printf("Inserted dime\n");
-            credit_result = user_wb_credit_drop(DIME);
+            os_printf("Inserted dime x%d\n", count);
+            credit_result = user_wb_credit_queue(DIME, count);
         } else if (os_strcmp(buf, "25") == 0) {
-            os_printf("Inserted quarter\n");
-            credit_result = user_wb_credit_drop(QUARTER);
+            os_printf("Inserted quarter x%d\n", count);
+            credit_result = user_wb_credit_queue(QUARTER, count);
         }
     }
 
-    if (credit_result != 1) {
+    if (credit_result <= 0) {
         os_printf("Credit drop error: %d\n", credit_result);
     }
 
-    httpdRedirect(data, "/index.tpl");
+    // Requests from the form go back to the page,
+    // while others get the request id to check on.
+    if (data->requestType == HTTPD_METHOD_POST) {
+        httpdRedirect(data, "/index.tpl");
+        return HTTPD_CGI_DONE;
+    }
+
+    if (credit_result <= 0) {
+        httpdStartResponse(data, (credit_result == 0) ? 503 : 400);
+        httpdEndHeaders(data);
+        return HTTPD_CGI_DONE;
+    }
+
+    len = credit_status_json(credit_result, buf);
+    httpdStartResponse(data, 202);
+    httpdHeader(data, "Content-Type", "text/json");
+    httpdEndHeaders(data);
+    httpdSend(data, buf, len);
     return HTTPD_CGI_DONE;
 }
 
@@ -356,9 +605,11 @@ LOCAL CgiStatus ICACHE_FLASH_ATTR cgi_sonos(HttpdConnData *data)
         len = httpdFindArg(data->post->buff, "uuid", buf, sizeof(buf));
     }
     if (len > 0) {
-        os_printf("Setting zone to \"%s\"\n", buf);
-        if (user_sonos_client_set_device(buf)) {
-            user_config_set_sonos_uuid(buf);
+        int input = webserver_input_arg(data->getArgs);
+        os_printf("Setting zone for input %d to \"%s\"\n", input + 1, buf);
+        if (user_sonos_client_set_device(input, buf)) {
+            user_config_set_sonos_uuid(input, buf);
+            user_config_save();
         }
 
         httpdRedirect(data, "/index.tpl");
@@ -370,6 +621,91 @@ LOCAL CgiStatus ICACHE_FLASH_ATTR cgi_sonos(HttpdConnData *data)
     return HTTPD_CGI_DONE;
 }
 
+LOCAL CgiStatus ICACHE_FLASH_ATTR cgi_sonos_paths(HttpdConnData *data)
+{
+    char buf[384];
+    int len;
+
+    if (!data->conn) {
+        return HTTPD_CGI_DONE;
+    }
+
+    // http://<ip>/sonospaths.cgi
+    len = user_sonos_client_paths_json(buf, sizeof(buf));
+
+    httpdStartResponse(data, 200);
+    httpdHeader(data, "Content-Type", "text/json");
+    httpdEndHeaders(data);
+    httpdSend(data, buf, len);
+    return HTTPD_CGI_DONE;
+}
+
+LOCAL CgiStatus ICACHE_FLASH_ATTR cgi_sonos_stats(HttpdConnData *data)
+{
+    char buf[1024];
+    int len;
+
+    sonos_stats_data *state = (sonos_stats_data *)data->cgiData;
+
+    if (!data->conn) {
+        if (state) {
+            os_free(state);
+        }
+        return HTTPD_CGI_DONE;
+    }
+
+    // http://<ip>/sonosstats.cgi?reset=1
+    if (!state) {
+        state = (sonos_stats_data *)os_zalloc(sizeof(sonos_stats_data));
+        if (!state) {
+            httpdStartResponse(data, 500);
+            httpdEndHeaders(data);
+            return HTTPD_CGI_DONE;
+        }
+        data->cgiData = state;
+
+        len = httpdFindArg(data->getArgs, "reset", buf, sizeof(buf));
+        state->reset = (len > 0 && os_strcmp(buf, "1") == 0);
+
+        httpdStartResponse(data, 200);
+        httpdHeader(data, "Content-Type", "text/json");
+        httpdEndHeaders(data);
+    }
+
+    len = user_sonos_request_stats_json(state->part++, buf, sizeof(buf));
+
+    if (len > 0) {
+        httpdSend(data, buf, len);
+        return HTTPD_CGI_MORE;
+    } else {
+        // Reset once all of it has been written out
+        if (state->reset) {
+            user_sonos_request_stats_reset();
+        }
+        os_free(state);
+        return HTTPD_CGI_DONE;
+    }
+}
+
+LOCAL CgiStatus ICACHE_FLASH_ATTR cgi_pools(HttpdConnData *data)
+{
+    char buf[768];
+    int len;
+
+    if (!data->conn) {
+        return HTTPD_CGI_DONE;
+    }
+
+    // http://<ip>/pools.cgi
+    len = user_pool_json(buf, sizeof(buf));
+
+    httpdStartResponse(data, 200);
+    httpdHeader(data, "Content-Type", "text/json");
+    httpdEndHeaders(data);
+    httpdSend(data, buf, len);
+    return HTTPD_CGI_DONE;
+}
+
 LOCAL CgiStatus ICACHE_FLASH_ATTR cgi_sonos_zone_list(HttpdConnData *data)
 {
     LOCAL const char RESPONSE[] = "{\"result\": { \"inProgress\": \"0\", \"zones\": %s}}";
@@ -417,9 +753,11 @@ LOCAL CgiStatus ICACHE_FLASH_ATTR cgi_sonos_zone_select(HttpdConnData *data)
     len = httpdFindArg(data->post->buff, "uuid", buf, sizeof(buf));
 
     if (len > 0) {
-        os_printf("Setting zone to \"%s\"\n", buf);
-        if (user_sonos_client_set_device(buf)) {
-            user_config_set_sonos_uuid(buf);
+        int input = webserver_input_arg(data->post->buff);
+        os_printf("Setting zone for input %d to \"%s\"\n", input + 1, buf);
+        if (user_sonos_client_set_device(input, buf)) {
+            user_config_set_sonos_uuid(input, buf);
+            user_config_save();
         }
     }
 
@@ -447,6 +785,7 @@ LOCAL CgiStatus ICACHE_FLASH_ATTR cgi_wb_song_list(HttpdConnData *data)
     if (!state) {
         state = (wb_song_list_data *)os_zalloc(sizeof(wb_song_list_data));
         data->cgiData = state;
+        state->input = webserver_input_arg(data->getArgs);
         httpdStartResponse(data, 200);
         httpdHeader(data, "Content-Type", "text/json");
         httpdEndHeaders(data);
@@ -462,7 +801,7 @@ LOCAL CgiStatus ICACHE_FLASH_ATTR cgi_wb_song_list(HttpdConnData *data)
         }
         n += os_sprintf(buf + n, "\"%c%d\": \"%s\"%s",
             letter, number,
-            user_config_get_sonos_track_file(i),
+            user_config_get_sonos_track_file(state->input, i),
             (i < 199) ? ", " : "}");
     }
     state->track_pos = i;
@@ -526,17 +865,27 @@ LOCAL CgiStatus ICACHE_FLASH_ATTR cgi_wb_song_select(HttpdConnData *data)
     ptemp = data->post->buff;
     while(ptemp && *ptemp !='\n' && *ptemp!='\r' && *ptemp != 0) {
         offset = ptemp;
-        if(os_strncmp(ptemp, "wallbox=", 8) == 0) {
+        if(os_strncmp(ptemp, "input=", 6) == 0) {
+            ptemp += 6;
+            state->input = strtol(ptemp, NULL, 10) - 1;
+        }
+        else if(os_strncmp(ptemp, "wallbox=", 8) == 0) {
             ptemp += 8;
             qtemp = (char *)os_strchr(ptemp, '&');
             if (!qtemp) { qtemp = ptemp + os_strlen(ptemp); }
             n = qtemp - ptemp;
-            if (n >= 15 && os_strncmp(ptemp, "SEEBURG_3W1_100", 15) == 0) {
-                state->wallbox = SEEBURG_3W1_100;
-            }
-            else if (n >= 16 && os_strncmp(ptemp, "SEEBURG_V3WA_200", 16) == 0) {
-                state->wallbox = SEEBURG_V3WA_200;
-            }
+            state->wallbox = wb_protocol_find(ptemp, n);
+        }
+        else if(os_strncmp(ptemp, "wallbox-detect-save=", 20) == 0) {
+            state->detect_save = true;
+        }
+        else if(os_strncmp(ptemp, "min-pulse=", 10) == 0) {
+            ptemp += 10;
+            state->min_pulse = strtol(ptemp, NULL, 10);
+        }
+        else if(os_strncmp(ptemp, "credit-gap=", 11) == 0) {
+            ptemp += 11;
+            state->credit_gap = strtol(ptemp, NULL, 10);
         }
         else if(os_strncmp(ptemp, "uri-base=", 9) == 0) {
             ptemp += 9;
@@ -583,19 +932,238 @@ LOCAL CgiStatus ICACHE_FLASH_ATTR cgi_wb_song_select(HttpdConnData *data)
         return HTTPD_CGI_MORE;
     } else {
         // Save all the data
-        user_config_set_wallbox_type(state->wallbox);
+        int input = (state->input >= 0 && state->input < user_config_get_input_count()) ? state->input : 0;
+        uint8 min_pulse = user_config_get_wallbox_min_pulse();
+        user_config_set_wallbox_type(input, state->wallbox);
+        user_config_set_wallbox_detect_save(state->detect_save);
+        user_config_set_wallbox_min_pulse(MAX(0, MIN(state->min_pulse, 50)));
+        user_config_set_credit_gap(MAX(0, MIN(state->credit_gap, 1000)));
         user_config_set_sonos_uri_base(state->uri_base);
-        user_config_set_sonos_track_files(&state->track_file);
+        user_config_set_sonos_track_files(input, &state->track_file);
+        user_config_save();
 
         // Update the active wallbox selection
-        user_wb_set_wallbox_type(user_config_get_wallbox_type());
+        user_wb_set_wallbox_type(input, user_config_get_wallbox_type(input));
+        if (user_config_get_wallbox_min_pulse() != min_pulse) {
+            // Shared by every input, not just the one being edited
+            user_wb_reload_timing();
+        }
 
-        os_free(state);
         if (state->buf) {
             os_free(state->buf);
         }
+        os_free(state);
 
         httpdRedirect(data, "/index.tpl");
         return HTTPD_CGI_DONE;
     }
 }
+
+LOCAL CgiStatus ICACHE_FLASH_ATTR cgi_wb_replay(HttpdConnData *data)
+{
+    wb_replay *replay = (wb_replay *)data->cgiData;
+    char buf[32];
+    int len;
+
+    if (!data->conn) {
+        // Connection aborted. Clean up.
+        if (replay) {
+            user_wb_replay_free(replay);
+        }
+        return HTTPD_CGI_DONE;
+    }
+
+    // http://<ip>/control/replay?wallbox=<type>&timing={default|calibrated}&input=<n>
+    // with the trace as the POST body
+    if (!replay) {
+        int input = webserver_input_arg(data->getArgs);
+        wallbox_type wb_type = user_config_get_wallbox_type(input);
+        bool calibrated = true;
+
+        len = httpdFindArg(data->getArgs, "wallbox", buf, sizeof(buf));
+        if (len > 0) {
+            wb_type = wb_protocol_find(buf, len);
+        }
+        len = httpdFindArg(data->getArgs, "timing", buf, sizeof(buf));
+        if (len > 0 && os_strcmp(buf, "default") == 0) {
+            calibrated = false;
+        }
+
+        replay = user_wb_replay_start(input, wb_type, calibrated);
+        if (!replay) {
+            httpdStartResponse(data, 400);
+            httpdEndHeaders(data);
+            return HTTPD_CGI_DONE;
+        }
+        data->cgiData = replay;
+    }
+
+    user_wb_replay_feed(replay, data->post->buff, data->post->buffLen);
+
+    if (data->post->received < data->post->len) {
+        return HTTPD_CGI_MORE;
+    }
+
+    data->cgiData = NULL;
+
+    char *json = (char *)os_malloc(2048);
+    if (!json) {
+        user_wb_replay_free(replay);
+        httpdStartResponse(data, 500);
+        httpdEndHeaders(data);
+        return HTTPD_CGI_DONE;
+    }
+
+    len = user_wb_replay_finish(replay, json, 2048);
+    user_wb_replay_free(replay);
+
+    httpdStartResponse(data, 200);
+    httpdHeader(data, "Content-Type", "text/json");
+    httpdEndHeaders(data);
+    httpdSend(data, json, len);
+
+    os_free(json);
+    return HTTPD_CGI_DONE;
+}
+
+LOCAL CgiStatus ICACHE_FLASH_ATTR cgi_wb_trace(HttpdConnData *data)
+{
+    char buf[1024];
+    int len;
+
+    wb_trace_data *state = (wb_trace_data *)data->cgiData;
+
+    if (!data->conn) {
+        if (state) {
+            os_free(state);
+        }
+        return HTTPD_CGI_DONE;
+    }
+
+    // http://<ip>/trace.cgi?format={csv|bin}
+    if (!state) {
+        state = (wb_trace_data *)os_zalloc(sizeof(wb_trace_data));
+        if (!state) {
+            httpdStartResponse(data, 500);
+            httpdEndHeaders(data);
+            return HTTPD_CGI_DONE;
+        }
+        data->cgiData = state;
+
+        len = httpdFindArg(data->getArgs, "format", buf, sizeof(buf));
+        state->binary = (len > 0 && os_strcmp(buf, "bin") == 0);
+        user_wb_trace_reader_init(&state->reader);
+
+        httpdStartResponse(data, 200);
+        if (state->binary) {
+            httpdHeader(data, "Content-Type", "application/octet-stream");
+            httpdHeader(data, "Content-Disposition", "attachment; filename=\"trace.bin\"");
+        } else {
+            httpdHeader(data, "Content-Type", "text/csv");
+            httpdHeader(data, "Content-Disposition", "attachment; filename=\"trace.csv\"");
+        }
+        httpdEndHeaders(data);
+    }
+
+    if (state->binary) {
+        len = user_wb_trace_read_bin(&state->reader, buf, sizeof(buf));
+    } else {
+        len = user_wb_trace_read_csv(&state->reader, buf, sizeof(buf));
+    }
+
+    if (len > 0) {
+        httpdSend(data, buf, len);
+        return HTTPD_CGI_MORE;
+    } else {
+        os_free(state);
+        return HTTPD_CGI_DONE;
+    }
+}
+
+LOCAL CgiStatus ICACHE_FLASH_ATTR cgi_wb_stats(HttpdConnData *data)
+{
+    char buf[1024];
+    int len;
+
+    wb_stats_data *state = (wb_stats_data *)data->cgiData;
+
+    if (!data->conn) {
+        if (state) {
+            os_free(state);
+        }
+        return HTTPD_CGI_DONE;
+    }
+
+    // http://<ip>/stats.cgi?input=<n>&reset=1
+    if (!state) {
+        state = (wb_stats_data *)os_zalloc(sizeof(wb_stats_data));
+        if (!state) {
+            httpdStartResponse(data, 500);
+            httpdEndHeaders(data);
+            return HTTPD_CGI_DONE;
+        }
+        data->cgiData = state;
+
+        // Reset straight after the copy, so no counts are lost in between
+        int input = webserver_input_arg(data->getArgs);
+        user_wb_stats_get(input, &state->stats);
+        len = httpdFindArg(data->getArgs, "reset", buf, sizeof(buf));
+        if (len > 0 && os_strcmp(buf, "1") == 0) {
+            user_wb_stats_reset(input);
+        }
+
+        httpdStartResponse(data, 200);
+        httpdHeader(data, "Content-Type", "text/json");
+        httpdEndHeaders(data);
+    }
+
+    len = user_wb_stats_json(&state->stats, state->part++, buf, sizeof(buf));
+
+    if (len > 0) {
+        httpdSend(data, buf, len);
+        return HTTPD_CGI_MORE;
+    } else {
+        os_free(state);
+        return HTTPD_CGI_DONE;
+    }
+}
+
+LOCAL CgiStatus ICACHE_FLASH_ATTR cgi_wb_ledger(HttpdConnData *data)
+{
+    char buf[1024];
+    int len;
+
+    wb_ledger_data *state = (wb_ledger_data *)data->cgiData;
+
+    if (!data->conn) {
+        if (state) {
+            os_free(state);
+        }
+        return HTTPD_CGI_DONE;
+    }
+
+    // http://<ip>/ledger.cgi
+    if (!state) {
+        state = (wb_ledger_data *)os_zalloc(sizeof(wb_ledger_data));
+        if (!state) {
+            httpdStartResponse(data, 500);
+            httpdEndHeaders(data);
+            return HTTPD_CGI_DONE;
+        }
+        data->cgiData = state;
+
+        httpdStartResponse(data, 200);
+        httpdHeader(data, "Content-Type", "text/json");
+        httpdEndHeaders(data);
+    }
+
+    len = user_wb_ledger_json(state->part++, buf, sizeof(buf));
+
+    if (len > 0) {
+        httpdSend(data, buf, len);
+        return HTTPD_CGI_MORE;
+    } else {
+        os_free(state);
+        return HTTPD_CGI_DONE;
+    }
+}